@@ -0,0 +1,329 @@
+/*
+** crlf.c - Block translation between local and network line ends
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "plib/config.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CRLF_SSE2 1
+#include <emmintrin.h>
+
+/* AVX2 is picked at run time, so plain -O2 builds still get it */
+#if __GNUC__ >= 5 || defined(__clang__)
+#define CRLF_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+#include "plib/crlf.h"
+
+
+static size_t
+span_scalar(const char *buf,
+	    size_t len)
+{
+    size_t i;
+
+
+    for (i = 0; i < len && buf[i] != '\r' && buf[i] != '\n'; i++)
+	;
+
+    return i;
+}
+
+
+#ifdef CRLF_SSE2
+static size_t
+span_sse2(const char *buf,
+	  size_t len)
+{
+    __m128i cr, lf, v;
+    size_t i;
+    int m;
+
+
+    cr = _mm_set1_epi8('\r');
+    lf = _mm_set1_epi8('\n');
+
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+	v = _mm_loadu_si128((const __m128i *) (buf+i));
+	m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+					   _mm_cmpeq_epi8(v, lf)));
+	if (m)
+	    return i + __builtin_ctz(m);
+    }
+
+    return i + span_scalar(buf+i, len-i);
+}
+#endif
+
+
+#ifdef CRLF_AVX2
+__attribute__((target("avx2")))
+static size_t
+span_avx2(const char *buf,
+	  size_t len)
+{
+    __m256i cr, lf, v;
+    size_t i;
+    unsigned int m;
+
+
+    cr = _mm256_set1_epi8('\r');
+    lf = _mm256_set1_epi8('\n');
+
+    for (i = 0; i + 32 <= len; i += 32)
+    {
+	v = _mm256_loadu_si256((const __m256i *) (buf+i));
+	m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr),
+						 _mm256_cmpeq_epi8(v, lf)));
+	if (m)
+	    return i + __builtin_ctz(m);
+    }
+
+    return i + span_sse2(buf+i, len-i);
+}
+#endif
+
+
+#ifdef CRLF_AVX2
+static int
+have_avx2(void)
+{
+    static int avx2 = -1;
+
+
+    /* Harmless if two threads race here - they get the same answer */
+    if (avx2 < 0)
+    {
+	__builtin_cpu_init();
+	avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+
+    return avx2;
+}
+#endif
+
+
+size_t
+crlf_span(const char *buf,
+	  size_t len)
+{
+#ifdef CRLF_AVX2
+    if (have_avx2())
+	return span_avx2(buf, len);
+#endif
+#ifdef CRLF_SSE2
+    return span_sse2(buf, len);
+#else
+    return span_scalar(buf, len);
+#endif
+}
+
+
+/*
+** Counting: a CR becomes CRLF (+1), an LF after a CR is dropped (-1)
+** and any other LF becomes CRLF (+1). So the network size of a block
+** is len + #CR + #LF - 2*#CRLF, and the SIMD versions only need to
+** count matching bytes and pairs.
+*/
+static size_t
+count_scalar(const char *buf,
+	     size_t len,
+	     int *lastcr)
+{
+    size_t i, size;
+    int cr;
+
+
+    size = len;
+    cr = *lastcr;
+    for (i = 0; i < len; i++)
+    {
+	if (buf[i] == '\r')
+	{
+	    size++;
+	    cr = 1;
+	    continue;
+	}
+	
+	if (buf[i] == '\n')
+	{
+	    if (cr)
+		size--;
+	    else
+		size++;
+	}
+	cr = 0;
+    }
+
+    *lastcr = cr;
+    return size;
+}
+
+
+#ifdef CRLF_SSE2
+static size_t
+count_sse2(const char *buf,
+	   size_t len,
+	   int *lastcr)
+{
+    __m128i cr, lf, v;
+    size_t i, size;
+    unsigned int mcr, mlf, carry;
+
+
+    cr = _mm_set1_epi8('\r');
+    lf = _mm_set1_epi8('\n');
+
+    size = 0;
+    carry = *lastcr;
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+	v = _mm_loadu_si128((const __m128i *) (buf+i));
+	mcr = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+	mlf = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+
+	size += 16 + __builtin_popcount(mcr) + __builtin_popcount(mlf)
+	    - 2 * __builtin_popcount(((mcr << 1) | carry) & mlf);
+	carry = (mcr >> 15) & 1;
+    }
+
+    *lastcr = carry;
+    return size + count_scalar(buf+i, len-i, lastcr);
+}
+#endif
+
+
+#ifdef CRLF_AVX2
+__attribute__((target("avx2")))
+static size_t
+count_avx2(const char *buf,
+	   size_t len,
+	   int *lastcr)
+{
+    __m256i cr, lf, v;
+    size_t i, size;
+    unsigned long long mcr, mlf, carry;
+
+
+    cr = _mm256_set1_epi8('\r');
+    lf = _mm256_set1_epi8('\n');
+
+    size = 0;
+    carry = *lastcr;
+    for (i = 0; i + 32 <= len; i += 32)
+    {
+	v = _mm256_loadu_si256((const __m256i *) (buf+i));
+	mcr = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+	mlf = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+
+	size += 32 + __builtin_popcountll(mcr) + __builtin_popcountll(mlf)
+	    - 2 * __builtin_popcountll(((mcr << 1) | carry) & mlf);
+	carry = (mcr >> 31) & 1;
+    }
+
+    *lastcr = carry;
+    return size + count_sse2(buf+i, len-i, lastcr);
+}
+#endif
+
+
+size_t
+crlf_count(const char *buf,
+	   size_t len,
+	   int *lastcr)
+{
+#ifdef CRLF_AVX2
+    if (have_avx2())
+	return count_avx2(buf, len, lastcr);
+#endif
+#ifdef CRLF_SSE2
+    return count_sse2(buf, len, lastcr);
+#else
+    return count_scalar(buf, len, lastcr);
+#endif
+}
+
+
+/*
+** Copy 'src' to 'dst', replacing each CR, LF or CRLF with 'eol'.
+** Runs without line ends are moved with memmove(), so this may be
+** done in place as long as 'eol' is a single character.
+*/
+static size_t
+crlf_translate(char *dst,
+	       const char *src,
+	       size_t len,
+	       const char *eol,
+	       size_t eollen,
+	       int *lastcr)
+{
+    size_t i, o, n;
+    int c;
+
+
+    i = o = 0;
+    while (i < len)
+    {
+	n = crlf_span(src+i, len-i);
+	if (n > 0)
+	{
+	    if (dst+o != src+i)
+		memmove(dst+o, src+i, n);
+	    i += n;
+	    o += n;
+	    *lastcr = 0;
+	    if (i == len)
+		break;
+	}
+
+	c = src[i++];
+	if (c == '\n' && *lastcr)
+	{
+	    /* Second half of a CRLF, maybe from the previous block */
+	    *lastcr = 0;
+	    continue;
+	}
+
+	memcpy(dst+o, eol, eollen);
+	o += eollen;
+	*lastcr = (c == '\r');
+    }
+
+    return o;
+}
+
+
+size_t
+crlf_encode(char *dst,
+	    const char *src,
+	    size_t len,
+	    int *lastcr)
+{
+    return crlf_translate(dst, src, len, "\r\n", 2, lastcr);
+}
+
+
+size_t
+crlf_decode(char *dst,
+	    const char *src,
+	    size_t len,
+	    int *lastcr)
+{
+    return crlf_translate(dst, src, len, "\n", 1, lastcr);
+}
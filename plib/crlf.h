@@ -0,0 +1,61 @@
+/*
+** crlf.h - Block translation between local and network line ends
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef PLIB_CRLF_H
+#define PLIB_CRLF_H
+
+#include <stddef.h>
+
+/*
+** CR, LF and CRLF are all treated as one line end, just like
+** fd_getc() does for FDF_CRLF buffers. '*lastcr' carries a CR at
+** the end of one block over to the next one and must start out 0.
+*/
+
+/* Number of leading bytes in 'buf' that are neither CR nor LF */
+extern size_t
+crlf_span(const char *buf,
+	  size_t len);
+
+/*
+** Number of bytes crlf_encode() would produce for 'buf', without
+** storing anything
+*/
+extern size_t
+crlf_count(const char *buf,
+	   size_t len,
+	   int *lastcr);
+
+/*
+** Local to network (line ends become CRLF). 'dst' must have room
+** for 2*len bytes and must not overlap 'src'. Returns the number of
+** bytes stored in 'dst'.
+*/
+extern size_t
+crlf_encode(char *dst,
+	    const char *src,
+	    size_t len,
+	    int *lastcr);
+
+/*
+** Network to local (line ends become LF). 'dst' may be the same
+** buffer as 'src'. Returns the number of bytes stored in 'dst'.
+*/
+extern size_t
+crlf_decode(char *dst,
+	    const char *src,
+	    size_t len,
+	    int *lastcr);
+
+#endif
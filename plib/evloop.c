@@ -0,0 +1,317 @@
+/*
+** evloop.c - Event driven file descriptor dispatching
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "plib/config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "plib/safeio.h"
+#include "plib/aalloc.h"
+#include "plib/evloop.h"
+
+extern int debug;
+
+
+#if defined(HAVE_THREADS) && defined(HAVE_SYS_EPOLL_H)
+
+/*
+** All threads share a single epoll descriptor. Every event is
+** registered with EPOLLONESHOT so only one thread at a time will
+** ever run the callback for a specific file descriptor.
+*/
+static void *
+evloop_thread(void *vp)
+{
+    EVLOOP *elp = (EVLOOP *) vp;
+    struct epoll_event ev;
+    EVENT *evp;
+    int n;
+
+
+    if (debug)
+	fprintf(stderr, "evloop_thread: Started\n");
+
+    for (;;)
+    {
+	while ((n = epoll_wait(elp->epfd, &ev, 1, -1)) < 0 && errno == EINTR)
+	    ;
+
+	if (n < 0)
+	{
+	    syslog(LOG_ERR, "evloop_thread: epoll_wait: %m");
+	    break;
+	}
+
+	if (n == 0)
+	    continue;
+
+	evp = (EVENT *) ev.data.ptr;
+	if (evp == NULL)
+	{
+	    /* Wakeup pipe - we are being stopped */
+	    pthread_mutex_lock(&elp->mtx);
+	    if (elp->state == 2)
+	    {
+		pthread_mutex_unlock(&elp->mtx);
+		break;
+	    }
+	    pthread_mutex_unlock(&elp->mtx);
+	    continue;
+	}
+
+	evp->fun(evp, evp->arg);
+    }
+
+    pthread_mutex_lock(&elp->mtx);
+    elp->nthreads--;
+    pthread_mutex_unlock(&elp->mtx);
+    pthread_cond_broadcast(&elp->cv);
+
+    if (debug)
+	fprintf(stderr, "evloop_thread: Terminating\n");
+
+    return NULL;
+}
+
+
+EVLOOP *
+evloop_create(int nthreads)
+{
+    EVLOOP *elp;
+    struct epoll_event ev;
+    pthread_t tid;
+    int i, code;
+
+
+    if (debug)
+	fprintf(stderr, "evloop_create(%d): Start\n", nthreads);
+
+    A_NEW(elp);
+    elp->nthreads = 0;
+    elp->state = 1;
+    elp->wakeup[0] = elp->wakeup[1] = -1;
+    pthread_mutex_init(&elp->mtx, NULL);
+    pthread_cond_init(&elp->cv, NULL);
+    pthread_attr_init(&elp->ca_detached);
+    pthread_attr_setdetachstate(&elp->ca_detached, PTHREAD_CREATE_DETACHED);
+
+    elp->epfd = epoll_create(1024);
+    if (elp->epfd < 0)
+    {
+	syslog(LOG_ERR, "evloop_create: epoll_create: %m");
+	goto Fail;
+    }
+
+    if (pipe(elp->wakeup) < 0)
+    {
+	syslog(LOG_ERR, "evloop_create: pipe: %m");
+	goto Fail;
+    }
+
+    /* Level triggered so all threads notice it */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(elp->epfd, EPOLL_CTL_ADD, elp->wakeup[0], &ev) < 0)
+    {
+	syslog(LOG_ERR, "evloop_create: epoll_ctl(ADD): %m");
+	goto Fail;
+    }
+
+    for (i = 0; i < nthreads; i++)
+    {
+	code = pthread_create(&tid, &elp->ca_detached, evloop_thread, (void *) elp);
+	if (code)
+	{
+	    syslog(LOG_ERR, "evloop_create: pthread_create: %s",
+		   strerror(code));
+	    break;
+	}
+
+	pthread_mutex_lock(&elp->mtx);
+	elp->nthreads++;
+	pthread_mutex_unlock(&elp->mtx);
+    }
+
+    if (elp->nthreads == 0)
+    {
+	evloop_destroy(elp);
+	if (debug)
+	    fprintf(stderr, "evloop_create(%d): End: Failure\n", nthreads);
+	return NULL;
+    }
+
+    if (debug)
+	fprintf(stderr, "evloop_create(%d): End: OK\n", nthreads);
+    return elp;
+
+  Fail:
+    if (elp->epfd >= 0)
+	s_close(elp->epfd);
+    if (elp->wakeup[0] >= 0)
+    {
+	s_close(elp->wakeup[0]);
+	s_close(elp->wakeup[1]);
+    }
+    pthread_attr_destroy(&elp->ca_detached);
+    pthread_mutex_destroy(&elp->mtx);
+    pthread_cond_destroy(&elp->cv);
+    a_free(elp);
+
+    if (debug)
+	fprintf(stderr, "evloop_create(%d): End: Failure\n", nthreads);
+    return NULL;
+}
+
+
+EVENT *
+evloop_add(EVLOOP *elp,
+	   int fd,
+	   void (*fun)(EVENT *evp, void *arg),
+	   void *arg)
+{
+    EVENT *evp;
+
+
+    A_NEW(evp);
+    evp->elp = elp;
+    evp->fd = fd;
+    evp->fun = fun;
+    evp->arg = arg;
+    evp->added = 0;
+
+    return evp;
+}
+
+
+int
+evloop_rearm(EVENT *evp)
+{
+    struct epoll_event ev;
+    int op;
+
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN|EPOLLRDHUP|EPOLLONESHOT;
+    ev.data.ptr = (void *) evp;
+
+    /* The callback may run before epoll_ctl() even returns */
+    op = evp->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    evp->added = 1;
+
+    if (epoll_ctl(evp->elp->epfd, op, evp->fd, &ev) < 0)
+    {
+	syslog(LOG_ERR, "evloop_rearm: epoll_ctl(%s, %d): %m",
+	       op == EPOLL_CTL_ADD ? "ADD" : "MOD", evp->fd);
+	if (op == EPOLL_CTL_ADD)
+	    evp->added = 0;
+	return -1;
+    }
+
+    return 0;
+}
+
+
+void
+evloop_remove(EVENT *evp)
+{
+    struct epoll_event ev;
+
+
+    if (evp == NULL)
+	return;
+
+    /* Pre 2.6.9 kernels require a non-NULL event pointer */
+    memset(&ev, 0, sizeof(ev));
+    if (evp->added)
+	(void) epoll_ctl(evp->elp->epfd, EPOLL_CTL_DEL, evp->fd, &ev);
+    a_free(evp);
+}
+
+
+void
+evloop_destroy(EVLOOP *elp)
+{
+    if (elp == NULL)
+	return;
+
+    pthread_mutex_lock(&elp->mtx);
+    elp->state = 2;
+    pthread_mutex_unlock(&elp->mtx);
+
+    (void) s_write(elp->wakeup[1], "", 1);
+
+    pthread_mutex_lock(&elp->mtx);
+    while (elp->nthreads > 0)
+	pthread_cond_wait(&elp->cv, &elp->mtx);
+    pthread_mutex_unlock(&elp->mtx);
+
+    s_close(elp->epfd);
+    s_close(elp->wakeup[0]);
+    s_close(elp->wakeup[1]);
+
+    pthread_attr_destroy(&elp->ca_detached);
+    pthread_mutex_destroy(&elp->mtx);
+    pthread_cond_destroy(&elp->cv);
+    a_free(elp);
+}
+
+#else /* No threads or no epoll() */
+
+EVLOOP *
+evloop_create(int nthreads)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+EVENT *
+evloop_add(EVLOOP *elp,
+	   int fd,
+	   void (*fun)(EVENT *evp, void *arg),
+	   void *arg)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int
+evloop_rearm(EVENT *evp)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void
+evloop_remove(EVENT *evp)
+{
+}
+
+void
+evloop_destroy(EVLOOP *elp)
+{
+}
+
+#endif
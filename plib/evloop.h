@@ -0,0 +1,72 @@
+/*
+** evloop.h - Event driven file descriptor dispatching
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef PLIB_EVLOOP_H
+#define PLIB_EVLOOP_H
+
+#include "plib/threads.h"
+
+struct evloop;
+
+typedef struct evloop_event
+{
+    struct evloop *elp;
+    int fd;
+    void (*fun)(struct evloop_event *evp, void *arg);
+    void *arg;
+    int added;		/* Registered with the event threads */
+} EVENT;
+
+typedef struct evloop
+{
+    int epfd;
+    int wakeup[2];
+    int nthreads;
+    int state; /* 0 = not running, 1 = running, 2 = stopping */
+    pthread_mutex_t mtx;
+    pthread_cond_t cv;
+    pthread_attr_t ca_detached;
+} EVLOOP;
+
+
+/* Start 'nthreads' threads that dispatch events */
+extern EVLOOP *
+evloop_create(int nthreads);
+
+/*
+** Create an event for input on 'fd'. Nothing is watched until the
+** first evloop_rearm(), so the caller can finish setting up (and
+** record the EVENT) before the callback may run. The callback is
+** called (from one of the event threads) once when data is available
+** - after that the event must be rearmed with evloop_rearm().
+*/
+extern EVENT *
+evloop_add(EVLOOP *elp,
+	   int fd,
+	   void (*fun)(EVENT *evp, void *arg),
+	   void *arg);
+
+/* Watch for input (again) */
+extern int
+evloop_rearm(EVENT *evp);
+
+/* Stop watching and release the event (does not close the fd) */
+extern void
+evloop_remove(EVENT *evp);
+
+/* Stop the event threads */
+extern void
+evloop_destroy(EVLOOP *elp);
+
+#endif
@@ -76,6 +76,8 @@ fd_create(int fd,
     fdp->outbufsize = FDBUF_OUTBUFSIZE;
     fdp->outbuf = a_malloc(fdp->outbufsize, "FDBUF outbuf");
 
+    fdp->moved = NULL;
+    
     return fdp;
 }
 
@@ -117,6 +119,14 @@ _fd_fill(FDBUF *fdp)
 
     if (fdp->in_start == fdp->in_end)
 	fdp->in_start = fdp->in_end = 0;
+    else if (fdp->in_end == fdp->inbufsize && fdp->in_start > 0)
+    {
+	/* Move any partial data to the start of the buffer */
+	memmove(fdp->inbuf, fdp->inbuf+fdp->in_start,
+		fdp->in_end - fdp->in_start);
+	fdp->in_end -= fdp->in_start;
+	fdp->in_start = 0;
+    }
 	    
     /* Free space in the input buffer */
     maxlen = fdp->inbufsize - fdp->in_end;
@@ -132,7 +142,7 @@ _fd_fill(FDBUF *fdp)
     if (avail > maxlen)
 	avail = maxlen;
     
-    len = s_read(fdp->fd, fdp->inbuf+fdp->in_start, avail);
+    len = s_read(fdp->fd, fdp->inbuf+fdp->in_end, avail);
     
     if (len == 0)
 	return -1;
@@ -158,6 +168,64 @@ fd_fill(FDBUF *fdp)
 }
 
 
+/*
+** Check if a complete line is buffered so that fd_gets()
+** can be called without blocking
+*/
+int
+fd_haveline(FDBUF *fdp)
+{
+    int i, rc;
+
+
+    pthread_mutex_lock(&fdp->in_lock);
+
+    i = fdp->in_start;
+    
+    /* Skip the LF of a CRLF pair already handled by fd_gets() */
+    if ((fdp->flags & FDF_CRLF) && fdp->lastc == '\r' &&
+	i < fdp->in_end && fdp->inbuf[i] == '\n')
+	++i;
+
+    rc = 0;
+    for (; i < fdp->in_end && !rc; i++)
+    {
+	if ((fdp->flags & FDF_TELNET) && fdp->inbuf[i] == IAC)
+	{
+	    /* _fd_getc() would block on an incomplete TELNET command */
+	    if (i+1 >= fdp->in_end)
+		goto End;
+	    switch (fdp->inbuf[i+1])
+	    {
+	      case WILL:
+	      case WONT:
+	      case DO:
+	      case DONT:
+		if (i+2 >= fdp->in_end)
+		    goto End;
+		i += 2;
+		break;
+
+	      default:
+		i += 1;
+	    }
+	    continue;
+	}
+	
+	if (fdp->inbuf[i] == '\n' || fdp->inbuf[i] == '\r')
+	    rc = 1;
+    }
+  End:
+
+    /* A full buffer will be returned as an (overlong) line */
+    if (fdp->in_end - fdp->in_start == fdp->inbufsize)
+	rc = 1;
+    
+    pthread_mutex_unlock(&fdp->in_lock);
+    return rc;
+}
+
+
 /*
 ** Send any buffered data
 */
@@ -177,6 +245,9 @@ _fd_flush(FDBUF *fdp)
     if (len == 0)
 	return 0;
 
+    if (fdp->moved)
+	*fdp->moved += len;
+    
     rest = fdp->outbuflen - len;
     if (rest > 0)
 	memcpy(fdp->outbuf, fdp->outbuf+len, rest);
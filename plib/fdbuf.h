@@ -15,6 +15,8 @@
 #ifndef PLIB_FDBUF_H
 #define PLIB_FDBUF_H
 
+#include <sys/types.h>
+
 #include "plib/threads.h"
 
 #define FDBUF_INBUFSIZE 8192
@@ -45,6 +47,8 @@ typedef struct
     int outbuflen;
     int outbufsize;
     unsigned char *outbuf;
+
+    volatile off_t *moved;	/* If set, bytes written are added here */
 } FDBUF;
 
 
@@ -59,6 +63,9 @@ fd_destroy(FDBUF *fdp);
 extern int
 fd_fill(FDBUF *fdp);
 
+extern int
+fd_haveline(FDBUF *fdp);
+
 extern int
 fd_flush(FDBUF *fdp);
 
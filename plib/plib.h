@@ -21,8 +21,10 @@
 #include "threads.h"
 #include "aalloc.h"
 #include "avail.h"
+#include "crlf.h"
 #include "daemon.h"
 #include "dirlist.h"
+#include "evloop.h"
 #include "fdbuf.h"
 #include "ident.h"
 #include "petopt.h"
@@ -36,5 +38,7 @@
 #include "support.h"
 #include "system.h"
 #include "timeout.h"
+#include "tpool.h"
+#include "uring.h"
 
 #endif
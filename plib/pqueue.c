@@ -14,6 +14,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
 #include <pthread.h>
 
 #include "pqueue.h"
@@ -42,6 +45,7 @@ pqueue_init(PQUEUE *qp,
     qp->nextin = 0;
     qp->nextout = 0;
     qp->closed = 0;
+    qp->wakeups = 0;
 
     pthread_mutex_init(&qp->mtx, NULL);
     pthread_cond_init(&qp->more, NULL);
@@ -67,10 +71,30 @@ pqueue_close(PQUEUE *qp)
 }
 
 
+
+void
+pqueue_wakeup(PQUEUE *qp)
+{
+    pthread_mutex_lock(&qp->mtx);
+
+    qp->wakeups++;
+
+    pthread_mutex_unlock(&qp->mtx);
+    pthread_cond_broadcast(&qp->less);
+}
+
+
+/*
+** Returns 1 if the item was queued, 0 if the queue is closed and
+** -1 if pqueue_wakeup() was called while waiting for room.
+*/
 int
 pqueue_put(PQUEUE *qp,
 	  void *item)
 {
+    int wakeups;
+
+    
     if (debug > 2)
 	fprintf(stderr, "pqueue_put(%p, %p): Start\n", (void *) qp, item);
     
@@ -78,14 +102,27 @@ pqueue_put(PQUEUE *qp,
 
     if (qp->closed)
     {
+	pthread_mutex_unlock(&qp->mtx);
 	if (debug > 2)
 	    fprintf(stderr, "pqueue_put(): End (ret=0)\n");
 	
 	return 0;
     }
     
+    wakeups = qp->wakeups;
     while (qp->occupied >= qp->qsize)
+    {
+	if (qp->wakeups != wakeups)
+	{
+	    pthread_mutex_unlock(&qp->mtx);
+	    if (debug > 2)
+		fprintf(stderr, "pqueue_put(): End (ret=-1)\n");
+	    
+	    return -1;
+	}
+	
 	pthread_cond_wait(&qp->less, &qp->mtx);
+    }
 
     qp->buf[qp->nextin++] = item;
 
@@ -102,6 +139,36 @@ pqueue_put(PQUEUE *qp,
 }
 
 
+/*
+** Like pqueue_put() but never waits. Returns 1 if the item was
+** queued, 0 if the queue is closed and -1 if it is full.
+*/
+int
+pqueue_tryput(PQUEUE *qp,
+	      void *item)
+{
+    pthread_mutex_lock(&qp->mtx);
+
+    if (qp->closed || qp->occupied >= qp->qsize)
+    {
+	int ret = qp->closed ? 0 : -1;
+	
+	pthread_mutex_unlock(&qp->mtx);
+	return ret;
+    }
+    
+    qp->buf[qp->nextin++] = item;
+
+    qp->nextin %= qp->qsize;
+    qp->occupied++;
+
+    pthread_mutex_unlock(&qp->mtx);
+    pthread_cond_signal(&qp->more);
+
+    return 1;
+}
+
+
 
 int
 pqueue_get(PQUEUE *qp,
@@ -142,6 +209,58 @@ pqueue_get(PQUEUE *qp,
 
 
 
+/*
+** Like pqueue_get() but give up after 'timeout' seconds.
+** Returns -1 on timeout.
+*/
+int
+pqueue_timedget(PQUEUE *qp,
+		void **item,
+		int timeout)
+{
+    struct timeval now;
+    struct timespec when;
+    int got = 0, code = 0;
+
+
+    if (debug > 1)
+	fprintf(stderr, "pqueue_timedget(%p, ..., %d): Start\n",
+		(void *) qp, timeout);
+
+    gettimeofday(&now, NULL);
+    when.tv_sec = now.tv_sec + timeout;
+    when.tv_nsec = now.tv_usec * 1000;
+    
+    pthread_mutex_lock(&qp->mtx);
+    
+    while (qp->occupied <= 0 && !qp->closed && code != ETIMEDOUT)
+	code = pthread_cond_timedwait(&qp->more, &qp->mtx, &when);
+
+    if (qp->occupied > 0)
+    {
+	*item = qp->buf[qp->nextout++];
+	qp->nextout %= qp->qsize;
+	qp->occupied--;
+	got = 1;
+
+	pthread_mutex_unlock(&qp->mtx);
+	pthread_cond_signal(&qp->less);
+    }
+    else
+    {
+	if (!qp->closed)
+	    got = -1;
+	pthread_mutex_unlock(&qp->mtx);
+    }
+
+    if (debug > 2)
+	fprintf(stderr, "pqueue_timedget(...): End (got=%d)\n", got);
+    
+    return got;
+}
+
+
+
 void
 pqueue_destroy(PQUEUE *qp)
 {
@@ -23,6 +23,7 @@ typedef struct
     int nextin;
     int nextout;
     int closed;
+    int wakeups;	/* Bumped by pqueue_wakeup() */
     pthread_mutex_t mtx;
     pthread_cond_t more;
     pthread_cond_t less;
@@ -40,12 +41,26 @@ extern int
 pqueue_put(PQUEUE *bp,
 	  void *item);
 
+/* Returns -1 at once instead of waiting if the queue is full */
+extern int
+pqueue_tryput(PQUEUE *bp,
+	      void *item);
+
 extern int
 pqueue_get(PQUEUE *bp,
 	   void **item);
 
+extern int
+pqueue_timedget(PQUEUE *bp,
+		void **item,
+		int timeout);
+
 extern void
 pqueue_close(PQUEUE *bp);
 
+/* Make pqueue_put() calls waiting for room give up (return -1) */
+extern void
+pqueue_wakeup(PQUEUE *bp);
+
 #endif
     
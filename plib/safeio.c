@@ -16,6 +16,10 @@
 
 #include "plib/config.h"
 
+#if defined(HAVE_SPLICE) || defined(__linux__)
+#define _GNU_SOURCE 1
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -48,11 +52,19 @@
 #include <sys/sendfile.h>
 #endif
 
+#ifdef HAVE_SYS_STATFS_H
+#include <sys/statfs.h>
+#endif
+
 #include "plib/threads.h"
 #include "plib/sockaddr.h"
+#include "plib/aalloc.h"
+#include "plib/pqueue.h"
 
 #include "plib/safeio.h"
 
+extern int debug;
+
 
 void
 s_abort(void)
@@ -326,222 +338,1320 @@ s_signal(int sig,
 
 #define COPYFD_BUFSIZE (64*1024)
 
+int copyfd_strategy = COPYFD_AUTO;
+int copyfd_bufsize = COPYFD_BUFSIZE;
+int copyfd_small = COPYFD_BUFSIZE;
+
+int copyfd_readahead = 2*1024*1024;
+int copyfd_dontneed_mb = 256;
+int copyfd_direct_mb = 0;
+int copyfd_depth = 4;
+
+unsigned long copyfd_count[COPYFD_NSTRATEGIES];
+unsigned long long copyfd_bytes[COPYFD_NSTRATEGIES];
+
+static pthread_mutex_t copyfd_mtx;
+static pthread_once_t copyfd_once = PTHREAD_ONCE_INIT;
+
+static const char *copyfd_names[COPYFD_NSTRATEGIES] =
+{
+    "auto", "sendfile", "splice", "mmap", "readwrite", "direct"
+};
+
+
+const char *
+copyfd_name(int strategy)
+{
+    if (strategy < 0 || strategy >= COPYFD_NSTRATEGIES)
+	return "?";
+
+    return copyfd_names[strategy];
+}
+
+
+int
+copyfd_lookup(const char *name)
+{
+    int i;
+
+
+    for (i = 0; i < COPYFD_NSTRATEGIES; i++)
+	if (strcasecmp(name, copyfd_names[i]) == 0)
+	    return i;
+
+    return -1;
+}
+
+
+static void
+copyfd_init(void)
+{
+    pthread_mutex_init(&copyfd_mtx, NULL);
+}
+
+
+static void
+copyfd_record(int strategy,
+	      off_t bytes)
+{
+    pthread_once(&copyfd_once, copyfd_init);
+
+    pthread_mutex_lock(&copyfd_mtx);
+    copyfd_count[strategy]++;
+    if (bytes > 0)
+	copyfd_bytes[strategy] += bytes;
+    pthread_mutex_unlock(&copyfd_mtx);
+}
+
+
+/*
+** Largest amount handed to a single sendfile() or write() call. Linux
+** won't move more than about 2 GB per call anyway, and smaller chunks
+** keep the progress counter moving.
+*/
+#define COPYFD_MAXCHUNK (16*1024*1024)
+
+/*
+** Per sendfile() or mmap write() call when progress is tracked. Large
+** enough to keep the number of system calls down, small enough that a
+** client at a few kB/s still moves the counter within a stall timeout.
+*/
+#define COPYFD_PROGRESS_CHUNK (1024*1024)
+
+/* Bytes per read()/write() */
 static int
-simple_copyfd(int to_fd,
-	      int from_fd,
-	      off_t *start,
-	      size_t maxlen)
+copyfd_chunk(void)
 {
-    char buf[COPYFD_BUFSIZE];
-    int err, tlen, written, i;
+    return copyfd_bufsize > 0 ? copyfd_bufsize : COPYFD_BUFSIZE;
+}
 
 
-    if (start && *start > 0)
-	if (lseek(from_fd, *start, SEEK_SET) == (off_t) -1)
-	{
-	    /* Can't seek - wind to the starting point */
-	    tlen = 0;
-	    while (tlen < *start)
-	    {
-		i = *start - tlen;
-		if (i > sizeof(buf))
-		    i = sizeof(buf);
-		
-		err = s_read(from_fd, buf, i);
-		if (err <= 0)
-		    return -1;
-		
-		tlen += err;
-	    }
-	    
-	    if (tlen < *start)
-		return -1;		
-	}
-    
-    written = 0;
-    tlen = -1;
-    
-    while ((maxlen == 0 || written < maxlen) &&
-	   (tlen = s_read(from_fd, buf,
-			  (maxlen == 0 || maxlen - written > sizeof(buf) ?
-			   sizeof(buf) : maxlen - written))) > 0)
-    {
-	err = s_write(to_fd, buf, tlen);
-	if (err < 0)
-	    return -1;
-	
-	written += tlen;
-	if (start)
-	    *start += tlen;
-    }
-    
-    if (tlen < 0)
-	return -1;
+/*
+** Page cache hints. Files larger than copyfd_small get prefetched
+** copyfd_readahead bytes ahead of the copy. Files of at least
+** copyfd_dontneed_mb megabytes are also dropped from the cache
+** behind it, so one big download doesn't push out everything else.
+*/
+#define COPYFD_CACHE_STEP (4*1024*1024)
 
-    return written;
+void
+copyfd_cache_start(COPYFD_CACHE *cp,
+		   int fd,
+		   off_t size,
+		   off_t pos)
+{
+    cp->fd = fd;
+    cp->lag = 0;
+    cp->ahead = cp->behind = pos;
+#ifdef HAVE_POSIX_FADVISE
+    cp->willneed = (copyfd_readahead > 0 && size > copyfd_small);
+    cp->dontneed = (copyfd_dontneed_mb > 0 &&
+		    size >= (off_t) copyfd_dontneed_mb * 1024 * 1024);
+
+    if (cp->willneed)
+	(void) posix_fadvise(fd, pos, 0, POSIX_FADV_SEQUENTIAL);
+#else
+    cp->willneed = cp->dontneed = 0;
+#endif
 }
 
-#if !defined(HAVE_SENDFILE) && defined(HAVE_SENDFILEV)
-static ssize_t
-sendfile(int out_fd,
-	 int in_fd,
-	 off_t *off,
-	 size_t len)
+
+/*
+** Pages handed to a socket by sendfile() or splice() stay busy until
+** they have been sent, and can't be dropped until then. So stay about
+** one socket buffer behind.
+*/
+static off_t
+copyfd_cache_lag(int fd)
 {
-    struct sendfilevec vb;
-    int code;
-    size_t written = 0;
-    
+    int size;
+    socklen_t len;
 
-    vb.sfv_fd = in_fd;
-    vb.sfv_flag = 0;
-    vb.sfv_off = *off;
-    vb.sfv_len = len;
 
-    if (1)
-	fprintf(stderr, "sendfilev(), off = %lu, len = %lu\n",
-		(unsigned long) *off,
-		(unsigned long) len);
-    
-    code = sendfilev(out_fd, &vb, 1, &written);
+    len = sizeof(size);
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void *) &size, &len) < 0)
+	return 0;
 
-    if (1)
-	fprintf(stderr, "\t-> code = %d, written = %lu\n",
-		code, (unsigned long) written);
-		
-    if (written > 0)
+    return size;
+}
+
+
+void
+copyfd_cache_update(COPYFD_CACHE *cp,
+		    off_t pos)
+{
+#ifdef HAVE_POSIX_FADVISE
+    /* Refill the window when less than half of it is left */
+    if (cp->willneed && cp->ahead - pos < copyfd_readahead / 2)
     {
-	*off += written;
-	return written;
+	if (cp->ahead < pos)
+	    cp->ahead = pos;
+	(void) posix_fadvise(cp->fd, cp->ahead, pos + copyfd_readahead - cp->ahead,
+			     POSIX_FADV_WILLNEED);
+	cp->ahead = pos + copyfd_readahead;
     }
 
-    return code;
+    pos -= cp->lag;
+    if (cp->dontneed && pos - cp->behind >= COPYFD_CACHE_STEP)
+    {
+	(void) posix_fadvise(cp->fd, cp->behind, pos - cp->behind,
+			     POSIX_FADV_DONTNEED);
+	cp->behind = pos;
+    }
+#endif
 }
 
-#define HAVE_SENDFILE 1
 
+void
+copyfd_cache_end(COPYFD_CACHE *cp,
+		 off_t pos)
+{
+#ifdef HAVE_POSIX_FADVISE
+    pos -= cp->lag;
+    if (cp->dontneed && pos > cp->behind)
+	(void) posix_fadvise(cp->fd, cp->behind, pos - cp->behind,
+			     POSIX_FADV_DONTNEED);
 #endif
+    cp->willneed = cp->dontneed = 0;
+}
 
-int
-s_copyfd(int to_fd,
-	 int from_fd,
-	 off_t *start,
-	 size_t maxlen)
+
+/*
+** Start reading the first copyfd_readahead bytes from 'pos' into the
+** page cache, for a copy that will begin shortly.
+*/
+void
+copyfd_prefetch(int fd,
+		off_t pos)
 {
-    struct stat sb;
-    int len;
-    
+#ifdef HAVE_POSIX_FADVISE
+    if (copyfd_readahead > 0)
+	(void) posix_fadvise(fd, pos, copyfd_readahead, POSIX_FADV_WILLNEED);
+#endif
+}
 
-    /* If source isn't a plain file, use simple copyfd */
-    if (fstat(from_fd, &sb) < 0)
-	return simple_copyfd(to_fd, from_fd, start, maxlen);
+
+/*
+** Reading ahead in a separate thread, so the disk and the network
+** are kept busy at the same time. 'depth' buffers are passed back
+** and forth between the reader and the consumer in two queues.
+*/
+typedef struct copyfd_block
+{
+    char *buf;
+    ssize_t len;
+    int err;
+} COPYFD_BLOCK;
+
+struct copyfd_reader
+{
+    int fd;
+    off_t pos;		/* -1 = read() from the current position */
+    off_t left;		/* -1 = until EOF */
+    int bufsize;
+    int depth;
+    int eof;
     
-    if (start && (*start >= sb.st_size))
-	return -1;
+    PQUEUE free;
+    PQUEUE full;
+    COPYFD_BLOCK *blockv;
+    COPYFD_BLOCK *cur;	/* Handed out by copyfd_reader_get() */
+    
+    pthread_t tid;
+    int started;	/* 'tid' is a running reader thread */
+};
 
-    if (maxlen == 0)
-	len = sb.st_size-(start != NULL ? *start : 0);
-    else
-	len = maxlen;
 
-#ifdef HAVE_SENDFILE
+#ifdef HAVE_THREADS
+static void *
+copyfd_reader_thread(void *vp)
+{
+    COPYFD_READER *rp = (COPYFD_READER *) vp;
+    COPYFD_BLOCK *bp;
+    void *item;
+    int n;
+
+    
+    while (rp->left != 0 && pqueue_get(&rp->free, &item) == 1)
     {
-	int err;
+	bp = (COPYFD_BLOCK *) item;
 	
-#if defined(__FreeBSD__) && __FreeBSD__ >= 3
-	off_t sbytes;
-	while ((err = sendfile(to_fd, from_fd, *start, len,
-			       NULL, &sbytes, 0)) == -1) {
-	    switch (errno) {
-	    case EINTR:
-		continue;
-	    case EAGAIN:
-		*start += sbytes;
-		len -= sbytes;
-		break;
-	    default:
-		sbytes = 0;
-		break;
-	    }
-	}
-	*start += sbytes;
-#else
-	/* Assuming Linux / Solaris style sendfile() */
-	while ((err = sendfile(to_fd, from_fd, start, len)) == -1 &&
-	       errno == EINTR)
-	    ;
+	n = rp->bufsize;
+	if (rp->left > 0 && rp->left < n)
+	    n = rp->left;
+
+	if (rp->pos >= 0)
+	    bp->len = s_pread(rp->fd, bp->buf, n, rp->pos);
+	else
+	    bp->len = s_read(rp->fd, bp->buf, n);
+	bp->err = errno;
+
+	pqueue_put(&rp->full, bp);
+	if (bp->len <= 0)
+	    break;
+	
+	if (rp->pos >= 0)
+	    rp->pos += bp->len;
+	if (rp->left > 0)
+	    rp->left -= bp->len;
+    }
+
+    /* Nothing more will come */
+    pqueue_close(&rp->full);
+    return NULL;
+}
 #endif
 
-	if (err == -1 && errno == EINVAL)
-	    return simple_copyfd(to_fd, from_fd, start, maxlen);
+
+COPYFD_READER *
+copyfd_reader_start(int from_fd,
+		    off_t start,
+		    off_t maxlen,
+		    int bufsize)
+{
+#ifdef HAVE_THREADS
+    COPYFD_READER *rp;
+    int i;
+
+    
+    if (copyfd_depth < 2)
+	return NULL;
+    
+    A_NEW(rp);
+    rp->fd = from_fd;
+    rp->pos = start;
+    rp->left = (maxlen > 0 ? maxlen : -1);
+    rp->bufsize = bufsize;
+    rp->depth = copyfd_depth;
+    
+    rp->blockv = a_malloc(rp->depth * sizeof(COPYFD_BLOCK),
+			  "COPYFD_READER blockv");
+    if (pqueue_init(&rp->free, rp->depth) < 0)
+    {
+	a_free(rp->blockv);
+	a_free(rp);
+	return NULL;
+    }
+    if (pqueue_init(&rp->full, rp->depth) < 0)
+    {
+	pqueue_destroy(&rp->free);
+	a_free(rp->blockv);
+	a_free(rp);
+	return NULL;
+    }
     
-	return err;
+    for (i = 0; i < rp->depth; i++)
+    {
+	rp->blockv[i].buf = a_malloc(rp->bufsize, "COPYFD_READER buf");
+	pqueue_put(&rp->free, &rp->blockv[i]);
     }
-#else
-#ifndef HAVE_MMAP
-    return simple_copyfd(to_fd, from_fd, start, maxlen);
-#else
+    
+    if (pthread_create(&rp->tid, NULL, copyfd_reader_thread, (void *) rp) == 0)
+	rp->started = 1;
+    else
     {
-	char *buf;
-	int err;
-	
-	
-	/* Don't bother with mmap() for small files */
-	if (sb.st_size <= COPYFD_BUFSIZE)
-	    return simple_copyfd(to_fd, from_fd, start, maxlen);
-	
-	buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE,
-		   from_fd, 0);
-	
-	if (buf == (char *) MAP_FAILED)
-	    return simple_copyfd(to_fd, from_fd, start, maxlen);
+	rp->eof = 1;
+	copyfd_reader_end(rp);
+	return NULL;
+    }
 
-#ifdef MADV_SEQUENTIAL
-	/* XXX: Enable MADV_WILLNEED? */
-	madvise(buf, sb.st_size, MADV_SEQUENTIAL);
+    return rp;
+#else
+    return NULL;
 #endif
-	
-	/* XXX: Lock the file region in order to protect against
-	   someone doing an ftruncate()? */
-	
-	err = s_write(to_fd, buf+(start != NULL ? *start : 0), len);
-	munmap(buf, sb.st_size);
-	if (err > 0 && start)
-	*start += err;
-	
-	return err;
+}
+
+
+ssize_t
+copyfd_reader_get(COPYFD_READER *rp,
+		  char **bufp)
+{
+    void *item;
+
+    
+    if (pqueue_get(&rp->full, &item) != 1)
+    {
+	rp->eof = 1;
+	return 0;
     }
-#endif
-#endif
+
+    rp->cur = (COPYFD_BLOCK *) item;
+    if (rp->cur->len <= 0)
+    {
+	rp->eof = 1;
+	errno = rp->cur->err;
+	return rp->cur->len;
+    }
+    
+    *bufp = rp->cur->buf;
+    return rp->cur->len;
 }
 
 
-int
-s_bind(int fd,
-       struct sockaddr *sin,
-       socklen_t len)
+void
+copyfd_reader_put(COPYFD_READER *rp)
 {
-    int err;
+    if (rp->cur)
+	pqueue_put(&rp->free, rp->cur);
+    rp->cur = NULL;
+}
 
 
-    while ((err = bind(fd, sin, len)) < 0 && errno == EINTR)
-	;
+void
+copyfd_reader_end(COPYFD_READER *rp)
+{
+    int i;
 
-    return err;
+    
+#ifdef HAVE_THREADS
+    if (rp->started)
+    {
+	/*
+	** Stopped early - don't leave the reader waiting for
+	** a buffer, or for more data from a socket
+	*/
+	pqueue_close(&rp->free);
+	if (!rp->eof && rp->pos < 0)
+	    (void) shutdown(rp->fd, SHUT_RD);
+	pthread_join(rp->tid, NULL);
+    }
+#endif
+    
+    pqueue_destroy(&rp->full);
+    pqueue_destroy(&rp->free);
+    for (i = 0; i < rp->depth; i++)
+	a_free(rp->blockv[i].buf);
+    a_free(rp->blockv);
+    a_free(rp);
 }
 
-int
-s_connect(int fd,
-	  struct sockaddr *sin,
-	  socklen_t len)
+
+static off_t
+simple_copyfd(int to_fd,
+	      int from_fd,
+	      off_t *start,
+	      off_t maxlen,
+	      volatile off_t *moved,
+	      COPYFD_CACHE *cp,
+	      int ahead)
 {
-    int err;
+    COPYFD_READER *rp;
+    char *buf, *bp = NULL;
+    int bufsize, err, tlen, i, positional;
+    off_t written, skipped;
 
 
-    while ((err = connect(fd, sin, len)) < 0 && errno == EINTR)
-	;
+    bufsize = copyfd_chunk();
+    buf = a_malloc(bufsize, "simple_copyfd buf");
 
-    return err;
+    /*
+    ** Read seekable files at explicit offsets, leaving the file
+    ** position alone, so the descriptor may be shared with others
+    */
+    positional = (start != NULL && lseek(from_fd, 0, SEEK_CUR) != (off_t) -1);
+    
+    if (start && *start > 0 && !positional)
+    {
+	/* Can't seek - wind to the starting point */
+	skipped = 0;
+	while (skipped < *start)
+	{
+	    i = bufsize;
+	    if (*start - skipped < i)
+		i = *start - skipped;
+		
+	    err = s_read(from_fd, buf, i);
+	    if (err <= 0)
+	    {
+		a_free(buf);
+		return -1;
+	    }
+		
+	    skipped += err;
+	}
+	    
+	if (skipped < *start)
+	{
+	    a_free(buf);
+	    return -1;
+	}
+    }
+    
+    written = 0;
+    tlen = -1;
+    err = 0;
+
+    rp = NULL;
+    if (ahead)
+	rp = copyfd_reader_start(from_fd, positional ? *start : -1,
+				 maxlen, bufsize);
+    if (rp)
+    {
+	while ((tlen = copyfd_reader_get(rp, &bp)) > 0)
+	{
+	    err = s_write(to_fd, bp, tlen);
+	    copyfd_reader_put(rp);
+	    if (err < 0)
+		break;
+	    
+	    written += tlen;
+	    if (start)
+		*start += tlen;
+	    if (moved)
+		*moved += tlen;
+	    if (cp && start)
+		copyfd_cache_update(cp, *start);
+	}
+	
+	copyfd_reader_end(rp);
+	a_free(buf);
+	
+	return (tlen < 0 || err < 0) ? -1 : written;
+    }
+    
+    while ((maxlen == 0 || written < maxlen) &&
+	   (tlen = (positional ?
+		    s_pread(from_fd, buf,
+			    (maxlen == 0 || maxlen - written > bufsize ?
+			     bufsize : maxlen - written), *start) :
+		    s_read(from_fd, buf,
+			   (maxlen == 0 || maxlen - written > bufsize ?
+			    bufsize : maxlen - written)))) > 0)
+    {
+	err = s_write(to_fd, buf, tlen);
+	if (err < 0)
+	{
+	    a_free(buf);
+	    return -1;
+	}
+	
+	written += tlen;
+	if (start)
+	    *start += tlen;
+	if (moved)
+	    *moved += tlen;
+	if (cp && start)
+	    copyfd_cache_update(cp, *start);
+    }
+
+    a_free(buf);
+    
+    if (tlen < 0)
+	return -1;
+
+    return written;
+}
+
+
+#ifdef HAVE_SPLICE
+
+#define SPLICE_CHUNK (64*1024)
+
+/*
+** Each thread keeps a pipe around to splice() through, so we
+** don't have to create a new one for every transfer.
+*/
+#ifdef HAVE_THREADS
+static pthread_key_t splice_key;
+static pthread_once_t splice_once = PTHREAD_ONCE_INIT;
+
+static void
+splice_pipe_free(void *vp)
+{
+    int *pfd = (int *) vp;
+
+    close(pfd[0]);
+    close(pfd[1]);
+    a_free(pfd);
+}
+
+static void
+splice_init(void)
+{
+    pthread_key_create(&splice_key, splice_pipe_free);
+}
+#else
+static int *splice_pfd = NULL;
+#endif
+
+
+static int *
+splice_pipe(void)
+{
+    int *pfd;
+
+
+#ifdef HAVE_THREADS
+    pthread_once(&splice_once, splice_init);
+    pfd = (int *) pthread_getspecific(splice_key);
+#else
+    pfd = splice_pfd;
+#endif
+    if (pfd)
+	return pfd;
+
+    pfd = a_malloc(2 * sizeof(int), "splice_pipe");
+    if (pipe(pfd) < 0)
+    {
+	a_free(pfd);
+	return NULL;
+    }
+
+#ifdef F_SETPIPE_SZ
+    (void) fcntl(pfd[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+#endif
+
+#ifdef HAVE_THREADS
+    pthread_setspecific(splice_key, pfd);
+#else
+    splice_pfd = pfd;
+#endif
+    return pfd;
+}
+
+
+/* Throw away a pipe that may still contain data */
+static void
+splice_pipe_drop(void)
+{
+    int *pfd;
+
+
+#ifdef HAVE_THREADS
+    pfd = (int *) pthread_getspecific(splice_key);
+    pthread_setspecific(splice_key, NULL);
+#else
+    pfd = splice_pfd;
+    splice_pfd = NULL;
+#endif
+    if (pfd)
+	splice_pipe_free(pfd);
+}
+
+
+/*
+** Copy via a pipe, without the data passing through user space.
+** 'start' is the offset in 'from_fd' if it is a plain file, or NULL.
+** Returns the number of bytes copied, -1 on error, or -2 if splice()
+** can't be used for these descriptors and nothing has been read yet.
+*/
+static off_t
+splice_copyfd(int to_fd,
+	      int from_fd,
+	      off_t *start,
+	      off_t maxlen,
+	      volatile off_t *moved,
+	      COPYFD_CACHE *cp)
+{
+    char buf[COPYFD_BUFSIZE];
+    int *pfd, in, out, n;
+    off_t total, rest;
+    loff_t off;
+
+
+    pfd = splice_pipe();
+    if (pfd == NULL)
+	return -2;
+
+    off = (start ? *start : 0);
+    total = 0;
+    for (;;)
+    {
+	n = SPLICE_CHUNK;
+	if (maxlen > 0 && maxlen - total < n)
+	    n = maxlen - total;
+	if (n == 0)
+	    break;
+	
+	while ((in = splice(from_fd, start ? &off : NULL, pfd[1], NULL, n,
+			    SPLICE_F_MOVE|SPLICE_F_MORE)) < 0 &&
+	       errno == EINTR)
+	    ;
+	if (in < 0)
+	    return (total == 0 && errno == EINVAL) ? -2 : -1;
+	if (in == 0)
+	    break;
+	if (start)
+	{
+	    *start = off;
+	    if (cp)
+		copyfd_cache_update(cp, off);
+	}
+	
+	while (in > 0)
+	{
+	    while ((out = splice(pfd[0], NULL, to_fd, NULL, in,
+				 SPLICE_F_MOVE)) < 0 &&
+		   errno == EINTR)
+		;
+	    
+	    if (out < 0 && errno == EINVAL && total == 0)
+	    {
+		/* Destination can't be spliced to - write what we got */
+		while (in > 0 && (out = s_read(pfd[0], buf,
+					       in < sizeof(buf) ?
+					       in : sizeof(buf))) > 0)
+		{
+		    if (s_write(to_fd, buf, out) < 0)
+			break;
+		    in -= out;
+		    total += out;
+		    if (moved)
+			*moved += out;
+		}
+		
+		if (in > 0)
+		{
+		    splice_pipe_drop();
+		    return -1;
+		}
+
+		rest = simple_copyfd(to_fd, from_fd, start,
+				     maxlen > 0 ? maxlen - total : 0, moved, cp,
+				     1);
+		return rest < 0 ? -1 : total + rest;
+	    }
+	    
+	    if (out <= 0)
+	    {
+		splice_pipe_drop();
+		return -1;
+	    }
+
+	    in -= out;
+	    total += out;
+	    if (moved)
+		*moved += out;
+	}
+    }
+
+    return total;
+}
+
+#endif
+
+
+#if !defined(HAVE_SENDFILE) && defined(HAVE_SENDFILEV)
+static ssize_t
+sendfile(int out_fd,
+	 int in_fd,
+	 off_t *off,
+	 size_t len)
+{
+    struct sendfilevec vb;
+    int code;
+    size_t written = 0;
+    
+
+    vb.sfv_fd = in_fd;
+    vb.sfv_flag = 0;
+    vb.sfv_off = *off;
+    vb.sfv_len = len;
+
+    if (1)
+	fprintf(stderr, "sendfilev(), off = %lu, len = %lu\n",
+		(unsigned long) *off,
+		(unsigned long) len);
+    
+    code = sendfilev(out_fd, &vb, 1, &written);
+
+    if (1)
+	fprintf(stderr, "\t-> code = %d, written = %lu\n",
+		code, (unsigned long) written);
+		
+    if (written > 0)
+    {
+	*off += written;
+	return written;
+    }
+
+    return code;
+}
+
+#define HAVE_SENDFILE 1
+
+#endif
+
+#ifdef HAVE_SENDFILE
+/*
+** Returns the number of bytes sent, -1 on error, or -2 if sendfile()
+** can't be used for these descriptors.
+*/
+static off_t
+sendfile_copyfd(int to_fd,
+		int from_fd,
+		off_t *start,
+		off_t len,
+		volatile off_t *moved,
+		COPYFD_CACHE *cp)
+{
+    ssize_t err;
+    off_t total;
+    size_t n;
+    
+#if defined(__FreeBSD__) && __FreeBSD__ >= 3
+    off_t sbytes;
+    while ((err = sendfile(to_fd, from_fd, *start, len,
+			   NULL, &sbytes, 0)) == -1) {
+	switch (errno) {
+	case EINTR:
+	    continue;
+	case EAGAIN:
+	    *start += sbytes;
+	    len -= sbytes;
+	    break;
+	default:
+	    sbytes = 0;
+	    break;
+	}
+    }
+    *start += sbytes;
+    if (moved && err >= 0)
+	*moved += sbytes;
+
+    if (err == -1 && errno == EINVAL)
+	return -2;
+
+    return err < 0 ? -1 : sbytes;
+#else
+    /* Assuming Linux / Solaris style sendfile() */
+    total = 0;
+    err = 0;
+    while (total < len)
+    {
+	n = (moved ? COPYFD_PROGRESS_CHUNK : COPYFD_MAXCHUNK);
+	if (cp && n > COPYFD_CACHE_STEP)
+	    n = COPYFD_CACHE_STEP;
+	if (len - total < n)
+	    n = len - total;
+	
+	while ((err = sendfile(to_fd, from_fd, start, n)) == -1 &&
+	       errno == EINTR)
+	    ;
+	if (err <= 0)
+	    break;
+
+	total += err;
+	if (moved)
+	    *moved += err;
+	if (cp)
+	    copyfd_cache_update(cp, *start);
+    }
+
+    if (err == -1 && errno == EINVAL && total == 0)
+	return -2;
+
+    if (err < 0)
+	return -1;
+    
+    return total;
+#endif
+}
+#endif
+
+
+#ifdef HAVE_MMAP
+/*
+** Returns the number of bytes written, -1 on error, or -2 if the
+** file can't be mapped.
+*/
+static off_t
+mmap_copyfd(int to_fd,
+	    int from_fd,
+	    off_t *start,
+	    off_t len,
+	    off_t size,
+	    volatile off_t *moved,
+	    COPYFD_CACHE *cp)
+{
+    char *buf, *bp = NULL;
+    off_t err;
+    int n;
+
+    
+    /* Doesn't fit in the address space (32 bit hosts) */
+    if ((off_t) (size_t) size != size)
+	return -2;
+    
+    buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, from_fd, 0);
+    if (buf == (char *) MAP_FAILED)
+	return -2;
+
+#ifdef MADV_SEQUENTIAL
+    madvise(buf, size, MADV_SEQUENTIAL);
+#endif
+    
+    /* XXX: Lock the file region in order to protect against
+       someone doing an ftruncate()? */
+
+    /* write() may return short counts for large buffers, so loop */
+    bp = buf + (start != NULL ? *start : 0);
+    for (err = 0; err < len; err += n)
+    {
+	n = (moved ? COPYFD_PROGRESS_CHUNK : COPYFD_MAXCHUNK);
+	if (len - err < n)
+	    n = len - err;
+	
+	n = s_write(to_fd, bp+err, n);
+	if (n <= 0)
+	{
+	    err = -1;
+	    break;
+	}
+	if (moved)
+	    *moved += n;
+	if (cp)
+	    copyfd_cache_update(cp, (bp - buf) + err + n);
+    }
+    
+    munmap(buf, size);
+
+    /* Mapped pages couldn't be dropped, so let copyfd_cache_end() redo it */
+    if (cp && cp->behind > bp - buf)
+	cp->behind = bp - buf;
+    
+    if (err > 0 && start)
+	*start += err;
+    
+    return err;
+}
+#endif
+
+
+#ifdef O_DIRECT
+#define DIRECT_ALIGN	4096
+#define DIRECT_BUFSIZE	(1024*1024)
+
+/*
+** Read with O_DIRECT into an aligned buffer, bypassing the page cache
+** completely. Returns the number of bytes written, -1 on error, or -2
+** if the file system doesn't do O_DIRECT.
+*/
+static off_t
+direct_copyfd(int to_fd,
+	      int from_fd,
+	      off_t *start,
+	      off_t len,
+	      volatile off_t *moved)
+{
+    void *vbuf;
+    char *buf;
+    off_t pos, total;
+    ssize_t n;
+    int flags, skip, w;
+
+
+    flags = fcntl(from_fd, F_GETFL);
+    if (flags < 0 || fcntl(from_fd, F_SETFL, flags|O_DIRECT) < 0)
+	return -2;
+    
+    if (posix_memalign(&vbuf, DIRECT_ALIGN, DIRECT_BUFSIZE) != 0)
+    {
+	(void) fcntl(from_fd, F_SETFL, flags);
+	return -2;
+    }
+    buf = (char *) vbuf;
+
+    /* Reads must start on an aligned offset */
+    pos = (start ? *start : 0);
+    skip = pos % DIRECT_ALIGN;
+    pos -= skip;
+    
+    total = 0;
+    while (total < len)
+    {
+	n = s_pread(from_fd, buf, DIRECT_BUFSIZE, pos);
+	if (n < 0)
+	{
+	    total = (total == 0 && errno == EINVAL) ? -2 : -1;
+	    break;
+	}
+	if (n <= skip)
+	    break;
+	
+	w = n - skip;
+	if (w > len - total)
+	    w = len - total;
+	
+	if (s_write(to_fd, buf+skip, w) != w)
+	{
+	    total = -1;
+	    break;
+	}
+	
+	total += w;
+	if (moved)
+	    *moved += w;
+	pos += n;
+	skip = 0;
+	
+	if (n < DIRECT_BUFSIZE)
+	    break;
+    }
+
+    free(vbuf);
+    (void) fcntl(from_fd, F_SETFL, flags);
+    
+    if (total > 0 && start)
+	*start += total;
+    
+    return total;
+}
+#endif
+
+
+/*
+** Pseudo and user space file systems, where sizes may be bogus or
+** the zero copy paths aren't supported
+*/
+static int
+copyfd_slowfs(int fd)
+{
+#if defined(HAVE_FSTATFS) && defined(HAVE_SYS_STATFS_H) && defined(__linux__)
+    struct statfs fsb;
+
+
+    if (fstatfs(fd, &fsb) < 0)
+	return 0;
+
+    switch ((unsigned long) fsb.f_type)
+    {
+      case 0x9fa0:	/* proc */
+      case 0x62656572:	/* sysfs */
+      case 0x64626720:	/* debugfs */
+      case 0x65735546:	/* fuse */
+	return 1;
+    }
+#endif
+    return 0;
+}
+
+
+/*
+** Pick a strategy for copying a plain file of size 'size'. A fixed
+** copyfd_strategy is honoured if it is available in this build.
+*/
+static int
+copyfd_select(int from_fd,
+	      off_t size)
+{
+    switch (copyfd_strategy)
+    {
+#ifdef HAVE_SENDFILE
+      case COPYFD_SENDFILE:
+#endif
+#ifdef HAVE_SPLICE
+      case COPYFD_SPLICE:
+#endif
+#ifdef HAVE_MMAP
+      case COPYFD_MMAP:
+#endif
+#ifdef O_DIRECT
+      case COPYFD_DIRECT:
+#endif
+      case COPYFD_READWRITE:
+	return copyfd_strategy;
+    }
+    
+    if (size <= copyfd_small || copyfd_slowfs(from_fd))
+	return COPYFD_READWRITE;
+
+#ifdef O_DIRECT
+    if (copyfd_direct_mb > 0 && size >= (off_t) copyfd_direct_mb * 1024 * 1024)
+	return COPYFD_DIRECT;
+#endif
+    
+#if defined(HAVE_SENDFILE)
+    return COPYFD_SENDFILE;
+#elif defined(HAVE_MMAP)
+    return COPYFD_MMAP;
+#else
+    return COPYFD_READWRITE;
+#endif
+}
+
+
+/*
+** O_DIRECT copies change the status flags of the source descriptor
+** while they run, so such files must not be read through a
+** descriptor shared with other transfers
+*/
+int
+copyfd_shareable(off_t size)
+{
+#ifdef O_DIRECT
+    if (copyfd_strategy == COPYFD_DIRECT)
+	return 0;
+    
+    if (copyfd_strategy == COPYFD_AUTO && copyfd_direct_mb > 0 &&
+	size >= (off_t) copyfd_direct_mb * 1024 * 1024)
+	return 0;
+#endif
+    return 1;
+}
+
+
+off_t
+s_copyfd(int to_fd,
+	 int from_fd,
+	 off_t *start,
+	 off_t maxlen)
+{
+    return s_copyfd2(to_fd, from_fd, start, maxlen, NULL);
+}
+
+
+/*
+** Like s_copyfd(), but adds the number of bytes moved so far to
+** '*moved' as the copy proceeds, so another thread can watch it.
+*/
+off_t
+s_copyfd2(int to_fd,
+	  int from_fd,
+	  off_t *start,
+	  off_t maxlen,
+	  volatile off_t *moved)
+{
+    struct stat sb;
+    COPYFD_CACHE cache, *cp;
+    off_t len, err;
+    int strategy, ahead;
+    
+
+    err = -2;
+    cp = NULL;
+    ahead = 1;
+    
+    if (fstat(from_fd, &sb) < 0 || !S_ISREG(sb.st_mode))
+    {
+	/* Not a plain file - splice() if going into one, else read/write */
+	strategy = COPYFD_READWRITE;
+#ifdef HAVE_SPLICE
+	if (start == NULL &&
+	    (copyfd_strategy == COPYFD_AUTO || copyfd_strategy == COPYFD_SPLICE) &&
+	    fstat(to_fd, &sb) == 0 && S_ISREG(sb.st_mode))
+	{
+	    strategy = COPYFD_SPLICE;
+	    err = splice_copyfd(to_fd, from_fd, NULL, maxlen, moved, NULL);
+	}
+#endif
+	goto End;
+    }
+    
+    if (start && (*start >= sb.st_size))
+	return -1;
+
+    if (maxlen == 0)
+	len = sb.st_size-(start != NULL ? *start : 0);
+    else
+	len = maxlen;
+
+    /* Not worth starting a reader thread for a few buffers */
+    ahead = (len > copyfd_small);
+    
+    strategy = copyfd_select(from_fd, sb.st_size);
+    if (start && strategy != COPYFD_DIRECT)
+    {
+	cp = &cache;
+	copyfd_cache_start(cp, from_fd, sb.st_size, *start);
+	if (!cp->willneed && !cp->dontneed)
+	    cp = NULL;
+	else if (strategy == COPYFD_SENDFILE || strategy == COPYFD_SPLICE)
+	    cp->lag = copyfd_cache_lag(to_fd);
+    }
+    
+    switch (strategy)
+    {
+#ifdef HAVE_SENDFILE
+      case COPYFD_SENDFILE:
+	err = sendfile_copyfd(to_fd, from_fd, start, len, moved, cp);
+	break;
+#endif
+#ifdef HAVE_SPLICE
+      case COPYFD_SPLICE:
+	err = splice_copyfd(to_fd, from_fd, start, len, moved, cp);
+	break;
+#endif
+#ifdef HAVE_MMAP
+      case COPYFD_MMAP:
+	err = mmap_copyfd(to_fd, from_fd, start, len, sb.st_size, moved, cp);
+	break;
+#endif
+#ifdef O_DIRECT
+      case COPYFD_DIRECT:
+	err = direct_copyfd(to_fd, from_fd, start, len, moved);
+	break;
+#endif
+    }
+
+  End:
+    if (err == -2)
+    {
+	strategy = COPYFD_READWRITE;
+	err = simple_copyfd(to_fd, from_fd, start, maxlen, moved, cp, ahead);
+    }
+
+    if (cp)
+	copyfd_cache_end(cp, *start);
+
+    if (debug)
+	fprintf(stderr, "s_copyfd2(%d, %d): %s: %lld bytes\n",
+		to_fd, from_fd, copyfd_name(strategy), (long long) err);
+    
+    copyfd_record(strategy, err);
+    return err;
+}
+
+
+int
+s_bind(int fd,
+       struct sockaddr *sin,
+       socklen_t len)
+{
+    int err;
+
+
+    while ((err = bind(fd, sin, len)) < 0 && errno == EINTR)
+	;
+
+    return err;
+}
+
+int
+s_connect(int fd,
+	  struct sockaddr *sin,
+	  socklen_t len)
+{
+    int err;
+
+
+    while ((err = connect(fd, sin, len)) < 0 && errno == EINTR)
+	;
+
+    return err;
+}
+
+
+/*
+** Start connecting without waiting for it. Returns 0 if the connect
+** is done or in progress, the socket is then left nonblocking until
+** s_connect_wait() is called.
+*/
+int
+s_connect_start(int fd,
+		struct sockaddr *sin,
+		socklen_t len)
+{
+    int flags, err;
+
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags|O_NONBLOCK) < 0)
+	return -1;
+
+    if (connect(fd, sin, len) < 0 && errno != EINPROGRESS && errno != EINTR)
+    {
+	err = errno;
+	(void) fcntl(fd, F_SETFL, flags);
+	errno = err;
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+** Wait at most 'timeout' seconds (forever if <= 0) for a connect
+** started by s_connect_start() to finish (ETIMEDOUT if it doesn't).
+** The socket is put back in blocking mode.
+*/
+int
+s_connect_wait(int fd,
+	       int timeout)
+{
+    int flags, err, res;
+    socklen_t elen;
+#ifdef HAVE_POLL
+    struct pollfd pfd;
+#else
+    fd_set wfds;
+    struct timeval to;
+#endif
+
+
+#ifdef HAVE_POLL
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    
+    while ((res = poll(&pfd, 1, timeout > 0 ? timeout*1000 : -1)) == -1 &&
+	   errno == EINTR)
+	;
+#else
+#ifdef FD_SETSIZE
+    if (fd >= FD_SETSIZE)
+    {
+	errno = EINVAL;
+	res = -1;
+    }
+    else
+#endif
+    {
+	FD_ZERO(&wfds);
+	FD_SET(fd, &wfds);
+	
+	to.tv_sec = timeout;
+	to.tv_usec = 0;
+	
+	while ((res = select(fd+1, NULL, &wfds, NULL,
+			     timeout > 0 ? &to : NULL)) < 0 &&
+	       errno == EINTR)
+	    ;
+    }
+#endif
+    if (res == 0)
+	errno = ETIMEDOUT;
+	
+    err = 0;
+    if (res > 0)
+    {
+	elen = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *) &err, &elen) < 0)
+	    err = errno;
+	
+	if (err)
+	    errno = err;
+    }
+	
+    err = (res > 0 && err == 0) ? 0 : -1;
+
+    res = errno;
+    flags = fcntl(fd, F_GETFL);
+    if (flags >= 0)
+	(void) fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    errno = res;
+    
+    return err;
+}
+
+
+/*
+** Connect, but give up after 'timeout' seconds (ETIMEDOUT). The
+** socket is left in blocking mode.
+*/
+int
+s_connect2(int fd,
+	   struct sockaddr *sin,
+	   socklen_t len,
+	   int timeout)
+{
+    if (timeout <= 0)
+	return s_connect(fd, sin, len);
+
+    if (s_connect_start(fd, sin, len) < 0)
+	return -1;
+
+    return s_connect_wait(fd, timeout);
 }
 
 
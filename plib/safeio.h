@@ -68,6 +68,10 @@ s_pread(int fd,
 extern int
 s_close(int fd);
 
+extern int
+s_waitfd(int fd,
+	 int timeout);
+
 extern int
 s_accept2(int fd,
 	  struct sockaddr *sa,
@@ -88,11 +92,114 @@ extern SIGHANDLER_T
 s_signal(int sig,
 	 SIGHANDLER_T handler);
 
+/* Ways of copying data between descriptors in s_copyfd() */
+#define COPYFD_AUTO		0
+#define COPYFD_SENDFILE		1
+#define COPYFD_SPLICE		2
+#define COPYFD_MMAP		3
+#define COPYFD_READWRITE	4
+#define COPYFD_DIRECT		5
+#define COPYFD_NSTRATEGIES	6
+
+extern int copyfd_strategy;	/* COPYFD_AUTO = choose for each copy */
+extern int copyfd_bufsize;	/* Bytes per read()/write() */
+extern int copyfd_small;	/* Files up to this size use read()/write() */
+
+extern int copyfd_readahead;	/* Bytes to prefetch ahead, 0 = none */
+extern int copyfd_dontneed_mb;	/* Uncache behind copies of files this big */
+extern int copyfd_direct_mb;	/* Use O_DIRECT for files this big, 0 = never */
+extern int copyfd_depth;	/* Buffers read ahead by a thread, < 2 = none */
+
+/* Number of copies and bytes moved with each strategy */
+extern unsigned long copyfd_count[COPYFD_NSTRATEGIES];
+extern unsigned long long copyfd_bytes[COPYFD_NSTRATEGIES];
+
+/* Page cache hints for one copy from a plain file */
+typedef struct copyfd_cache
+{
+    int fd;
+    int willneed;
+    int dontneed;
+    off_t ahead;	/* Prefetch requested up to here */
+    off_t behind;	/* Uncached up to here */
+    off_t lag;		/* Bytes behind the copy that may still be in use */
+} COPYFD_CACHE;
+
+extern void
+copyfd_cache_start(COPYFD_CACHE *cp,
+		   int fd,
+		   off_t size,
+		   off_t pos);
+
+/* The copy has read up to 'pos' */
+extern void
+copyfd_cache_update(COPYFD_CACHE *cp,
+		    off_t pos);
+
+extern void
+copyfd_cache_end(COPYFD_CACHE *cp,
+		 off_t pos);
+
+/* Prefetch the start of a copy from 'pos' before it begins */
+extern void
+copyfd_prefetch(int fd,
+		off_t pos);
+
+/*
+** Reads 'from_fd' in a separate thread, up to copyfd_depth buffers
+** of 'bufsize' bytes ahead of the consumer. 'start' is the offset to
+** read at, or -1 for the current position (sockets). 'maxlen' 0 =
+** until EOF. Returns NULL if reading ahead isn't possible.
+*/
+typedef struct copyfd_reader COPYFD_READER;
+
+extern COPYFD_READER *
+copyfd_reader_start(int from_fd,
+		    off_t start,
+		    off_t maxlen,
+		    int bufsize);
+
+/*
+** The next buffer in '*bufp'. Returns its length, 0 at EOF or -1
+** with errno set. The buffer must be given back before the next.
+*/
+extern ssize_t
+copyfd_reader_get(COPYFD_READER *rp,
+		  char **bufp);
+
+extern void
+copyfd_reader_put(COPYFD_READER *rp);
+
+extern void
+copyfd_reader_end(COPYFD_READER *rp);
+
+extern const char *
+copyfd_name(int strategy);
+
+/* Returns -1 if 'name' isn't a known strategy */
+extern int
+copyfd_lookup(const char *name);
+
+/* Whether copies of a file of 'size' bytes leave its descriptor as is */
 extern int
+copyfd_shareable(off_t size);
+
+/*
+** Copy 'len' bytes (0 = until EOF) starting at '*start' (NULL = the
+** current position). Returns the number of bytes copied, or -1.
+*/
+extern off_t
 s_copyfd(int to_fd,
 	 int from_fd,
 	 off_t *start,
-	 size_t len);
+	 off_t len);
+
+extern off_t
+s_copyfd2(int to_fd,
+	  int from_fd,
+	  off_t *start,
+	  off_t len,
+	  volatile off_t *moved);
 
 extern int
 s_bind(int fd,
@@ -104,6 +211,21 @@ s_connect(int fd,
 	  struct sockaddr *sin,
 	  socklen_t len);
 
+extern int
+s_connect2(int fd,
+	   struct sockaddr *sin,
+	   socklen_t len,
+	   int timeout);
+
+extern int
+s_connect_start(int fd,
+		struct sockaddr *sin,
+		socklen_t len);
+
+extern int
+s_connect_wait(int fd,
+	       int timeout);
+
 extern const char *
 s_inet_ntox(struct sockaddr_gen *ia,
 	    char *buf,
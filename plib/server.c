@@ -14,6 +14,10 @@
 
 #include "plib/config.h"
 
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#define _GNU_SOURCE 1
+#endif
+
 #include <stdio.h>
 #include <syslog.h>
 #include <stdlib.h>
@@ -21,6 +25,10 @@
 #include <errno.h>
 #include <signal.h>
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/types.h>
@@ -33,6 +41,10 @@
 #include <sys/wait.h>
 #endif
 
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
+
 #include "plib/safeio.h"
 #include "plib/safestr.h"
 #include "plib/support.h"
@@ -43,37 +55,241 @@
 
 int debug;
 
+/* Set IPV6_V6ONLY on IPv6 listeners (needed when also listening on IPv4) */
+int server_v6only = 0;
 
 
-SERVER *
-server_init(int fd,
-	    const struct sockaddr_gen *sg,
-	    int backlog,
-	    int max_clients,
-	    void (*handler)(CLIENT *cp))
+
+/*
+** Create, configure and bind one listening socket
+*/
+static int
+server_socket(SERVER_SHARD *ssp,
+	      int reuseport)
 {
     static int one = 1;
-    socklen_t slen;
-    SERVER *sp;
+    int fd;
+
     
+    fd = socket(SGFAM(ssp->sin), SOCK_STREAM, 0);
+#ifdef HAVE_IPV6
+    if (fd < 0 &&
+	(errno == EAFNOSUPPORT || errno == EPFNOSUPPORT) &&
+	SGFAM(ssp->sin) == AF_INET6)
+    {
+#if 0
+	/* Try to convert to IPv4 format... */
+	struct in6_addr *addr6 = (struct in6_addr *) SGADDRP(ssp->sin);
+	
+	if (IN6_IS_ADDR_V4MAPPED(addr6))
+	{
+	    UINT32 addr4 = addr6->s6_addr32[3];
+	    
+	    SGFAM(ssp->sin) = AF_INET;
+	    * (UINT32 *) SGADDRP(ssp->sin) = addr4;
+	}
+#endif
 
-    if (debug)
-	fprintf(stderr, "server_init(%d, ..., %d, %d, ...): Start\n",
-		fd, backlog, max_clients);
+	/* Let's try with an IPv4 socket - who knows, it might work */
+	errno = 0;
+	fd = socket(PF_INET, SOCK_STREAM, 0);
+    }
+#endif
+	
+    if (fd < 0)
+    {
+	syslog(LOG_ERR, "socket(%s, SOCK_STREAM) failed (errno=%d): %m",
+	       (SGFAM(ssp->sin) == AF_INET ? "AF_INET" : "AF_INET6"),
+	       errno);
+	return -1;
+    }
+
+    (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+		      (void *) &one, sizeof(one));
+
+#ifdef SO_REUSEPORT
+    if (reuseport &&
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+		   (void *) &one, sizeof(one)) < 0)
+    {
+	syslog(LOG_ERR, "setsockopt(%d, SO_REUSEPORT) failed: %m", fd);
+	s_close(fd);
+	return -1;
+    }
+#endif
+    
+#if defined(HAVE_IPV6) && defined(IPV6_V6ONLY)
+    if (server_v6only && SGFAM(ssp->sin) == AF_INET6)
+	(void) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+			  (void *) &one, sizeof(one));
+#endif
+    
+#ifdef SO_INCOMING_CPU
+    /* Prefer connections that arrive on the same CPU as the accept thread */
+    if (ssp->cpu >= 0)
+	(void) setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU,
+			  (void *) &ssp->cpu, sizeof(ssp->cpu));
+#endif
+    
+    if (s_bind(fd, (struct sockaddr *) &ssp->sin,
+	       SGSOCKSIZE(ssp->sin)) < 0)
+    {
+	char buf1[64];
+	
+	syslog(LOG_ERR, "bind(%d,%s:%d) failed: %m",
+	       fd,
+	       s_inet_ntox(&ssp->sin, buf1, sizeof(buf1)),
+	       ntohs(SGPORT(ssp->sin)));
+	s_close(fd);
+	return -1;
+    }
+
+    return fd;
+}
+
+
+static int
+server_ncpus(void)
+{
+    long n = -1;
+
+    
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return n > 0 ? (int) n : 1;
+}
+
+
+/*
+** Allocate and set up a SERVER with 'nshards' (unopened) listeners
+*/
+static SERVER *
+server_alloc(int nshards,
+	     int affinity,
+	     int max_clients)
+{
+    SERVER *sp;
+    int i, ncpus;
+
+
+    ncpus = server_ncpus();
     
     A_NEW(sp);
 
     sp->fd = -1;
-    
+    sp->async = 0;
+    sp->pool = NULL;
+    sp->busy_msg = NULL;
+    sp->admit = NULL;
+    sp->release = NULL;
+    sp->rejected = 0;
+    sp->affinity = affinity;
+
     sp->state = 0;
+    pthread_mutex_init(&sp->mtx, NULL);
     pthread_attr_init(&sp->ca_detached);
     pthread_attr_setdetachstate(&sp->ca_detached,
 				PTHREAD_CREATE_DETACHED);
-    
+
     pthread_mutex_init(&sp->clients_mtx, NULL);
     pthread_cond_init(&sp->clients_cv, NULL);
-    sp->clients_cur = 0;
+    sp->clients_waiting = 0;
     sp->clients_max = max_clients;
+
+    sp->nshards = nshards;
+    sp->shards = a_malloc(nshards * sizeof(sp->shards[0]), "SERVER shards");
+    for (i = 0; i < nshards; i++)
+    {
+	SERVER_SHARD *ssp = &sp->shards[i];
+	
+	ssp->fd = -1;
+	SGINIT(ssp->sin);
+	ssp->cpu = (affinity ? i % ncpus : -1);
+	pthread_mutex_init(&ssp->mtx, NULL);
+	ssp->clients_cur = 0;
+	ssp->sp = sp;
+    }
+
+    return sp;
+}
+
+
+/*
+** Open, bind and start listening on shards [first, first+n)
+*/
+static int
+server_listen(SERVER *sp,
+	      int first,
+	      int n,
+	      const struct sockaddr_gen *sg,
+	      int backlog)
+{
+    int i;
+
+    
+    for (i = first; i < first+n; i++)
+    {
+	sp->shards[i].sin = *sg;
+	sp->shards[i].fd = server_socket(&sp->shards[i], n > 1);
+	if (sp->shards[i].fd < 0)
+	    return -1;
+	
+	if (listen(sp->shards[i].fd, backlog) < 0)
+	{
+	    syslog(LOG_ERR, "listen(%d, %d) failed: %m",
+		   sp->shards[i].fd, backlog);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+
+static int
+server_nshards(int nshards)
+{
+    if (nshards <= 0)
+	nshards = server_ncpus();
+    
+#if !defined(HAVE_THREADS) || !defined(SO_REUSEPORT)
+    if (nshards > 1)
+    {
+	syslog(LOG_WARNING,
+	       "server_init: multiple listeners not supported - using one");
+	nshards = 1;
+    }
+#endif
+
+    return nshards;
+}
+
+
+SERVER *
+server_init(int fd,
+	    const struct sockaddr_gen *sg,
+	    int backlog,
+	    int max_clients,
+	    int nshards,
+	    int affinity,
+	    void (*handler)(CLIENT *cp))
+{
+    socklen_t slen;
+    SERVER *sp;
+    
+
+    if (debug)
+	fprintf(stderr, "server_init(%d, ..., %d, %d, %d, %d, ...): Start\n",
+		fd, backlog, max_clients, nshards, affinity);
+
+    nshards = server_nshards(nshards);
+    
+    /* A preopened socket can not be sharded */
+    if (fd >= 0)
+	nshards = 1;
+    
+    sp = server_alloc(nshards, affinity, max_clients);
     
     if (fd < 0)
     {
@@ -90,56 +306,26 @@ server_init(int fd,
 	}
 	
 	sp->sin = *sg;
-	
-	sp->fd = socket(SGFAM(sp->sin), SOCK_STREAM, 0);
-#ifdef HAVE_IPV6
-	if (sp->fd < 0 &&
-	    (errno == EAFNOSUPPORT || errno == EPFNOSUPPORT) &&
-	    SGFAM(sp->sin) == AF_INET6)
-	{
-#if 0
-	    /* Try to convert to IPv4 format... */
-	    struct in6_addr *addr6 = (struct in6_addr *) SGADDRP(sp->sin);
-	    
-	    if (IN6_IS_ADDR_V4MAPPED(addr6))
-	    {
-		UINT32 addr4 = addr6->s6_addr32[3];
-		
-		SGFAM(sp->sin) = AF_INET;
-		* (UINT32 *) SGADDRP(sp->sin) = addr4;
-	    }
-#endif
 
-	    /* Let's try with an IPv4 socket - who knows, it might work */
-	    errno = 0;
-	    sp->fd = socket(PF_INET, SOCK_STREAM, 0);
-	}
-#endif
-	
-	if (sp->fd < 0)
+	if (server_listen(sp, 0, nshards, sg, backlog) < 0)
 	{
-	    syslog(LOG_ERR, "socket(%s, SOCK_STREAM) failed (errno=%d): %m",
-		   (SGFAM(sp->sin) == AF_INET ? "AF_INET" : "AF_INET6"),
-		   errno);
-
 	    server_destroy(sp);
 	    if (debug)
 		fprintf(stderr, "server_init(): End: Failure\n");
 	    return NULL;
 	}
-
-	(void) setsockopt(sp->fd, SOL_SOCKET, SO_REUSEADDR,
-			  (void *) &one, sizeof(one));
-
-	if (s_bind(sp->fd, (struct sockaddr *) &sp->sin,
-		   SGSOCKSIZE(sp->sin)) < 0)
+    }
+    else
+    {
+	sp->shards[0].fd = fd;
+	slen = sizeof(sp->sin);
+	getsockname(fd, (struct sockaddr *) &sp->sin, &slen);
+	sp->shards[0].sin = sp->sin;
+	
+	/* We do this here too to support broken Inetd implementations */
+	if (backlog >= 0 && listen(fd, backlog) < 0)
 	{
-	    char buf1[16];
-
-	    syslog(LOG_ERR, "bind(%d,%s:%d) failed: %m",
-		   sp->fd,
-		   s_inet_ntox(&sp->sin, buf1, sizeof(buf1)),
-		   ntohs(SGPORT(sp->sin)));
+	    syslog(LOG_ERR, "listen(%d, %d) failed: %m", fd, backlog);
 	    
 	    server_destroy(sp);
 	    if (debug)
@@ -147,46 +333,170 @@ server_init(int fd,
 	    return NULL;
 	}
     }
-    else
+
+    sp->fd = sp->shards[0].fd;
+	
+    sp->handler = handler;
+    
+    if (debug)
+	fprintf(stderr, "server_init(): End: OK\n");
+    return sp;
+}
+
+/*
+** Listen on one more address, with 'nshards' sockets of its own.
+** Must be called before server_start().
+*/
+int
+server_add_address(SERVER *sp,
+		   const struct sockaddr_gen *sg,
+		   int backlog,
+		   int nshards)
+{
+    SERVER_SHARD *nv;
+    int i, first, ncpus;
+
+
+    if (debug)
+	fprintf(stderr, "server_add_address(..., %d, %d): Start\n",
+		backlog, nshards);
+    
+    pthread_mutex_lock(&sp->mtx);
+    if (sp->state != 0)
     {
-	sp->fd = fd;
-	slen = sizeof(sp->sin);
-	getsockname(sp->fd, (struct sockaddr *) &sp->sin, &slen);
+	pthread_mutex_unlock(&sp->mtx);
+	syslog(LOG_ERR, "server_add_address: server already started");
+	return -1;
     }
-
-    /* We do this outside the 'if' clause to support broken
-       Inetd implementations */
+    pthread_mutex_unlock(&sp->mtx);
     
-    if (backlog >= 0 && listen(sp->fd, backlog) < 0)
+    nshards = server_nshards(nshards);
+    ncpus = server_ncpus();
+    first = sp->nshards;
+
+    /* Not yet started, so no one else is using the shards */
+    nv = a_malloc((first+nshards) * sizeof(nv[0]), "SERVER shards");
+    for (i = 0; i < first+nshards; i++)
+    {
+	if (i < first)
+	{
+	    nv[i].fd = sp->shards[i].fd;
+	    nv[i].sin = sp->shards[i].sin;
+	    pthread_mutex_destroy(&sp->shards[i].mtx);
+	}
+	else
+	{
+	    nv[i].fd = -1;
+	    SGINIT(nv[i].sin);
+	}
+	nv[i].cpu = (sp->affinity ? i % ncpus : -1);
+	pthread_mutex_init(&nv[i].mtx, NULL);
+	nv[i].clients_cur = 0;
+	nv[i].sp = sp;
+    }
+    a_free(sp->shards);
+    sp->shards = nv;
+    sp->nshards = first+nshards;
+
+    if (server_listen(sp, first, nshards, sg, backlog) < 0)
     {
-	syslog(LOG_ERR, "listen(%d, %d) failed: %m", sp->fd, backlog);
-	
-	server_destroy(sp);
 	if (debug)
-	    fprintf(stderr, "server_init(): End: Failure\n");
+	    fprintf(stderr, "server_add_address(): End: Failure\n");
+	return -1;
+    }
+
+    if (debug)
+	fprintf(stderr, "server_add_address(): End: OK\n");
+    return 0;
+}
+
+
+/*
+** Create a server from already listening sockets, for example
+** ones handed over from another process
+*/
+SERVER *
+server_adopt(int *fds,
+	     int nfds,
+	     int max_clients,
+	     int affinity,
+	     void (*handler)(CLIENT *cp))
+{
+    socklen_t slen;
+    SERVER *sp;
+    int i;
+
+
+    if (debug)
+	fprintf(stderr, "server_adopt(..., %d, %d, %d, ...): Start\n",
+		nfds, max_clients, affinity);
+
+    if (nfds < 1)
 	return NULL;
+    
+    sp = server_alloc(nfds, affinity, max_clients);
+    for (i = 0; i < nfds; i++)
+    {
+	sp->shards[i].fd = fds[i];
+	slen = sizeof(sp->shards[i].sin);
+	getsockname(fds[i], (struct sockaddr *) &sp->shards[i].sin, &slen);
     }
-	
-    sp->handler = handler;
     
+    sp->fd = sp->shards[0].fd;
+    slen = sizeof(sp->sin);
+    getsockname(sp->fd, (struct sockaddr *) &sp->sin, &slen);
+    
+    sp->handler = handler;
+
     if (debug)
-	fprintf(stderr, "server_init(): End: OK\n");
+	fprintf(stderr, "server_adopt(): End: OK\n");
     return sp;
 }
 
+
 int
 server_destroy(SERVER *sp)
 {
+    int i;
+
+    
     server_stop(sp);
 
     pthread_attr_destroy(&sp->ca_detached);
     pthread_mutex_destroy(&sp->clients_mtx);
     pthread_cond_destroy(&sp->clients_cv); 
 
-    if (sp->fd >= 0)
-	s_close(sp->fd);
+    for (i = 0; i < sp->nshards; i++)
+    {
+	if (sp->shards[i].fd >= 0)
+	    s_close(sp->shards[i].fd);
+	pthread_mutex_destroy(&sp->shards[i].mtx);
+    }
+    a_free(sp->shards);
 
     a_free(sp);
+    return 0;
+}
+
+
+/*
+** Get the total number of active clients
+*/
+int
+server_clients(SERVER *sp)
+{
+    int i, n;
+
+
+    n = 0;
+    for (i = 0; i < sp->nshards; i++)
+    {
+	pthread_mutex_lock(&sp->shards[i].mtx);
+	n += sp->shards[i].clients_cur;
+	pthread_mutex_unlock(&sp->shards[i].mtx);
+    }
+
+    return n;
 }
 
 static RETSIGTYPE
@@ -224,7 +534,7 @@ server_thread(void *vp)
 int
 server_stop(SERVER *sp)
 {
-    int code;
+    int code, i;
     void *res;
     
     
@@ -236,17 +546,94 @@ server_stop(SERVER *sp)
     }
     
     sp->state = 2;
+
+    for (i = 0; i < sp->nshards; i++)
+    {
+	shutdown(sp->shards[i].fd, 2);
+	if (sp->shards[i].running)
+	    pthread_kill(sp->shards[i].tid, SIGUSR1); /* Some other signal? */
+    }
+    pthread_mutex_unlock(&sp->mtx);
+
+    /* Wake up accept threads waiting for a free client slot */
+    if (sp->pool)
+	tpool_wakeup(sp->pool);
+    pthread_mutex_lock(&sp->clients_mtx);
+    pthread_cond_broadcast(&sp->clients_cv);
+    pthread_mutex_unlock(&sp->clients_mtx);
     
-    shutdown(sp->fd, 2);
-    pthread_kill(sp->tid, SIGUSR1); /* Some other signal? */
+    while ((code = pthread_join(sp->tid, (void *) &res)) == EINTR)
+	;
+
+    return 0;
+}
+
+/*
+** Stop accepting new clients without touching the listening
+** sockets (which may still be in use by another process), and
+** close our copies of them. Active clients are not affected.
+*/
+int
+server_detach(SERVER *sp)
+{
+    int code, i, running;
+    void *res;
+
+
+    pthread_mutex_lock(&sp->mtx);
+    if (sp->state != 1)
+    {
+	pthread_mutex_unlock(&sp->mtx);
+	return -1;
+    }
+    sp->state = 2;
     pthread_mutex_unlock(&sp->mtx);
 
+    pthread_mutex_lock(&sp->clients_mtx);
+    pthread_cond_broadcast(&sp->clients_cv);
+    pthread_mutex_unlock(&sp->clients_mtx);
+
+    /*
+    ** Without shutdown() only a signal will interrupt accept(), and
+    ** it may arrive just before the call - so keep sending them
+    ** until every accept thread has left its loop. Threads that
+    ** have left may already have been joined, so leave them alone.
+    ** An accept thread can also be waiting for room in the worker
+    ** pool queue.
+    */
+    do
+    {
+	if (sp->pool)
+	    tpool_wakeup(sp->pool);
+	
+	pthread_mutex_lock(&sp->mtx);
+	for (running = i = 0; i < sp->nshards; i++)
+	    if (sp->shards[i].running)
+	    {
+		pthread_kill(sp->shards[i].tid, SIGUSR1);
+		running++;
+	    }
+	pthread_mutex_unlock(&sp->mtx);
+	
+	if (running)
+	    usleep(100000);
+    } while (running);
+    
     while ((code = pthread_join(sp->tid, (void *) &res)) == EINTR)
 	;
 
+    for (i = 0; i < sp->nshards; i++)
+    {
+	if (sp->shards[i].fd >= 0)
+	    s_close(sp->shards[i].fd);
+	sp->shards[i].fd = -1;
+    }
+    sp->fd = -1;
+
     return 0;
 }
 
+
 int
 server_start(SERVER *sp)
 {
@@ -278,37 +665,95 @@ server_start(SERVER *sp)
 }
 
 
-static void *
-client_thread(void *vp)
+/*
+** Release a client connection. Called automatically when the
+** handler returns, or by the handler itself in async mode.
+*/
+void
+server_client_done(CLIENT *cp)
 {
-    CLIENT *cp = (CLIENT *) vp;
     SERVER *sp = cp->sp;
+    SERVER_SHARD *ssp = cp->ssp;
     
-    sp->handler(cp);
+    
+    if (sp->release)
+	sp->release(cp);
     
     s_close(cp->fd);
     
 #ifdef HAVE_THREADS
+    pthread_mutex_lock(&ssp->mtx);
+    ssp->clients_cur--;
+    pthread_mutex_unlock(&ssp->mtx);
+
+    /* Only touch the global lock if there is a limit to wait on */
     if (sp->clients_max > 0)
     {
 	pthread_mutex_lock(&sp->clients_mtx);
-	if (sp->clients_cur == sp->clients_max)
-	    pthread_cond_signal(&sp->clients_cv);
-	
-	sp->clients_cur--;
+	if (sp->clients_waiting > 0)
+	    pthread_cond_broadcast(&sp->clients_cv);
 	pthread_mutex_unlock(&sp->clients_mtx);
     }
 #endif
 
     a_free(cp);
+}
+
+
+static void *
+client_thread(void *vp)
+{
+    CLIENT *cp = (CLIENT *) vp;
+    SERVER *sp = cp->sp;
+    
+    sp->handler(cp);
+    server_client_done(cp);
     return NULL;
 }
 
-int
-server_run_one(SERVER *sp,
-	       int client_fd,
-	       int nofork)
+
+/*
+** Turn away a client with a short message
+*/
+static void
+server_reject(SERVER *sp,
+	      int fd,
+	      const char *msg)
+{
+    if (debug)
+	fprintf(stderr, "server_reject: fd#%d: rejected\n", fd);
+    
+    (void) s_write(fd, msg, strlen(msg));
+    s_close(fd);
+
+    pthread_mutex_lock(&sp->mtx);
+    sp->rejected++;
+    pthread_mutex_unlock(&sp->mtx);
+}
+
+
+/*
+** Check if there is room for a new client, else turn it away
+** with the busy message
+*/
+static int
+server_admit(SERVER *sp,
+	     int fd)
+{
+    if (sp->clients_max <= 0 || server_clients(sp) < sp->clients_max)
+	return 1;
+
+    server_reject(sp, fd, sp->busy_msg);
+    return 0;
+}
+
+
+static int
+shard_run_one(SERVER_SHARD *ssp,
+	      int client_fd,
+	      int nofork)
 {
+    SERVER *sp = ssp->sp;
     CLIENT *cp;
     pthread_t tid;
 #ifndef HAVE_THREADS
@@ -317,15 +762,36 @@ server_run_one(SERVER *sp,
 #endif
     int ecode;
     socklen_t slen;
+    struct sockaddr_gen rsin;
+    const char *msg;
     
+
+    slen = sizeof(rsin);
+    if (getpeername(client_fd,
+		    (struct sockaddr *) &rsin, &slen) < 0)
+    {
+	syslog(LOG_ERR, "getpeername(%d): %m", client_fd);
+	s_close(client_fd);
+	if (debug)
+	    fprintf(stderr, "server_run_one(...): End: FAILURE\n");
+	return EXIT_FAILURE;
+    }
+
+    if (sp->admit && (msg = sp->admit(sp, &rsin)) != NULL)
+    {
+	server_reject(sp, client_fd, msg);
+	if (debug)
+	    fprintf(stderr, "server_run_one(...): End: REJECTED\n");
+	return EXIT_FAILURE;
+    }
     
-    pthread_mutex_lock(&sp->clients_mtx);
-    sp->clients_cur++;
+    pthread_mutex_lock(&ssp->mtx);
+    ssp->clients_cur++;
     if (debug)
-	fprintf(stderr, "server_run_one: Number of clients is now: %d\n",
-		sp->clients_cur);
+	fprintf(stderr, "server_run_one: Number of clients in shard is now: %d\n",
+		ssp->clients_cur);
     
-    pthread_mutex_unlock(&sp->clients_mtx);
+    pthread_mutex_unlock(&ssp->mtx);
     
     if (debug)
 	fprintf(stderr, "server_run_one(..., %d, %d): Start\n", client_fd, nofork);
@@ -333,27 +799,29 @@ server_run_one(SERVER *sp,
     A_NEW(cp);
     cp->fd = client_fd;
     cp->sp = sp;
-    
-    slen = sizeof(cp->rsin);
-    if (getpeername(cp->fd,
-		    (struct sockaddr *) &cp->rsin, &slen) < 0)
-    {
-	syslog(LOG_ERR, "getpeername(%d): %m", cp->fd);
-	if (debug)
-	    fprintf(stderr, "server_run_one(...): End: FAILURE\n");
-	return EXIT_FAILURE;
-    }
+    cp->ssp = ssp;
+    cp->rsin = rsin;
     
     slen = sizeof(cp->lsin);
     if (getsockname(cp->fd,
 		    (struct sockaddr *) &cp->lsin, &slen) < 0)
     {
 	syslog(LOG_ERR, "getsockname(%d): %m", cp->fd);
+	server_client_done(cp);
 	if (debug)
 	    fprintf(stderr, "server_run_one(...): End: FAILURE\n");
 	return EXIT_FAILURE;
     }
     
+    if (sp->async && !nofork)
+    {
+	/* The handler takes over the connection and returns at once */
+	sp->handler(cp);
+	if (debug)
+	    fprintf(stderr, "server_run_one(...): End: OK\n");
+	return EXIT_SUCCESS;
+    }
+    
     if (nofork)
     {
 	(void) client_thread(cp);
@@ -364,6 +832,22 @@ server_run_one(SERVER *sp,
     else
     {
 #ifdef HAVE_THREADS
+	if (sp->pool)
+	{
+	    if (tpool_put(sp->pool, client_thread, (void *) cp) < 0)
+	    {
+		syslog(LOG_ERR, "tpool_put(client_thread) failed");
+		server_client_done(cp);
+		if (debug)
+		    fprintf(stderr, "server_run_one(...): End: FAILURE\n");
+		return EXIT_FAILURE;
+	    }
+	    
+	    if (debug)
+		fprintf(stderr, "server_run_one(...): End: OK\n");
+	    return EXIT_SUCCESS;
+	}
+	
 	ecode = pthread_create(&tid,
 			       &sp->ca_detached,
 			       client_thread, (void *) cp);
@@ -371,6 +855,7 @@ server_run_one(SERVER *sp,
 	{
 	    syslog(LOG_ERR, "pthread_create(client_thread) failed: %s",
 		   strerror(ecode));
+	    server_client_done(cp);
 	    if (debug)
 		fprintf(stderr, "server_run_one(...): End: FAILURE\n");
 	    return EXIT_FAILURE;
@@ -385,24 +870,24 @@ server_run_one(SERVER *sp,
 	**      SERVER's in a single process and aren't using
 	**      threads.
 	*/
-	while (sp->clients_cur > 0 &&
+	while (ssp->clients_cur > 0 &&
 	       (pid = waitpid((pid_t) -1, &status, WNOHANG)) > 0)
 	{
 	    if (WIFEXITED(status) || WIFSIGNALED(status))
 	    {
-		sp->clients_cur--;
+		ssp->clients_cur--;
 	    }
 	}
 
 	if (sp->clients_max > 0)
 	{
 	    /* Wait for atleast one slot to be available */
-	    while (sp->clients_cur >= sp->clients_max &&
+	    while (ssp->clients_cur >= sp->clients_max &&
 		   (pid = waitpid((pid_t) -1, &status, 0)) > 0)
 	    {
 		if (WIFEXITED(status) || WIFSIGNALED(status))
 		{
-		    sp->clients_cur--;
+		    ssp->clients_cur--;
 		}
 	    }
 	}
@@ -413,11 +898,11 @@ server_run_one(SERVER *sp,
 	    sleep(1);
 
 	    pid = waitpid((pid_t) -1, &status,
-			  (sp->clients_cur > 0) ? 0 : WNOHANG);
+			  (ssp->clients_cur > 0) ? 0 : WNOHANG);
 		
 	    if (pid > 0 && (WIFEXITED(status) || WIFSIGNALED(status)))
 	    {
-		sp->clients_cur--;
+		ssp->clients_cur--;
 	    }
 	}
 	      
@@ -435,7 +920,7 @@ server_run_one(SERVER *sp,
 	    _exit(EXIT_SUCCESS);
 	}
 
-	sp->clients_cur++;
+	ssp->clients_cur++;
 
 	s_close(cp->fd);
 	a_free(cp);
@@ -449,52 +934,85 @@ server_run_one(SERVER *sp,
 }
 
 
-
 int
-server_run_all(SERVER *sp)
+server_run_one(SERVER *sp,
+	       int client_fd,
+	       int nofork)
 {
-    int fd, state;
+    return shard_run_one(&sp->shards[0], client_fd, nofork);
+}
 
 
-    if (debug)
-	fprintf(stderr, "server_run_all(...): Start\n");
-    
+/*
+** Wait until the total number of clients is below the limit.
+** The per-shard counters are only summed here so the normal
+** accept path never touches a global lock.
+*/
+static void
+server_wait_slot(SERVER *sp)
+{
+    int n;
 
-    pthread_mutex_lock(&sp->mtx);
-    if (sp->state != 0)
+    
+    pthread_mutex_lock(&sp->clients_mtx);
+    sp->clients_waiting++;
+    while (sp->state == 1 && (n = server_clients(sp)) >= sp->clients_max)
     {
 	if (debug)
-	    fprintf(stderr, "server_run_all(...): invalid initial state (%d)\n", state);
-	sp->state = 3;
-	sp->error = EINVAL;
-	pthread_mutex_unlock(&sp->mtx);
-	return -1;
+	    fprintf(stderr, "server_run_all: Too many clients (%d > %d) - waiting for a slot\n",
+		    n, sp->clients_max);
+	
+	pthread_cond_wait(&sp->clients_cv, &sp->clients_mtx);
     }
+    sp->clients_waiting--;
+    pthread_mutex_unlock(&sp->clients_mtx);
+}
+
+
+static void
+shard_bind_cpu(SERVER_SHARD *ssp)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t cs;
+    int code;
     
-    sp->state = 1;
+
+    if (ssp->cpu < 0)
+	return;
+    
+    CPU_ZERO(&cs);
+    CPU_SET(ssp->cpu, &cs);
+    code = pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+    if (code)
+	syslog(LOG_WARNING, "pthread_setaffinity_np(%d): %s",
+	       ssp->cpu, strerror(code));
+#endif
+}
+
+
+/*
+** Accept loop for one listening socket
+*/
+static int
+shard_run_all(SERVER_SHARD *ssp)
+{
+    SERVER *sp = ssp->sp;
+    int fd, state;
+
+
+    shard_bind_cpu(ssp);
     
+    pthread_mutex_lock(&sp->mtx);
     while (sp->state == 1)
     {
 	pthread_mutex_unlock(&sp->mtx);
 #ifdef HAVE_THREADS
-	if (sp->clients_max > 0)
-	{
-	    pthread_mutex_lock(&sp->clients_mtx);
-	    while (sp->clients_cur >= sp->clients_max)
-	    {
-		if (debug)
-		    fprintf(stderr, "server_run_all: Too many clients (%d > %d) - waiting for a slot\n",
-			    sp->clients_cur, sp->clients_max);
-    
-		pthread_cond_wait(&sp->clients_cv, &sp->clients_mtx);
-	    }
-	    
-	    pthread_mutex_unlock(&sp->clients_mtx);
-	}
+	if (sp->clients_max > 0 && sp->busy_msg == NULL)
+	    server_wait_slot(sp);
 #endif
 	
 #undef accept	
-	while ((fd = accept(sp->fd, NULL, NULL)) < 0 && errno == EINTR)
+	while ((fd = accept(ssp->fd, NULL, NULL)) < 0 && errno == EINTR)
 	{
 	    pthread_mutex_lock(&sp->mtx);
 	    sp->error = errno;
@@ -512,6 +1030,14 @@ server_run_all(SERVER *sp)
 	
 	if (fd < 0)
 	{
+	    pthread_mutex_lock(&sp->mtx);
+	    state = sp->state;
+	    pthread_mutex_unlock(&sp->mtx);
+
+	    /* Listening socket shut down by server_stop() */
+	    if (state != 1)
+		return state;
+	    
 	    syslog(LOG_ERR, "accept() failed: %m");
 	    
 	    switch (errno)
@@ -525,14 +1051,14 @@ server_run_all(SERVER *sp)
 	      case EWOULDBLOCK:
 	      case EINVAL:
 	      case ENFILE:
+		pthread_mutex_lock(&sp->mtx);
 		sp->error = errno;
-		state = 3;
 		pthread_mutex_unlock(&sp->mtx);
 		return -1;
 	    }
 	}
-	else
-	    server_run_one(sp, fd, 0);
+	else if (sp->busy_msg == NULL || server_admit(sp, fd))
+	    shard_run_one(ssp, fd, 0);
 	
 	pthread_mutex_lock(&sp->mtx);
     }
@@ -544,3 +1070,88 @@ server_run_all(SERVER *sp)
 
     return -1;
 }
+
+
+/* Run the accept loop and note when it is done */
+static int
+shard_run(SERVER_SHARD *ssp)
+{
+    int rc;
+
+    
+    rc = shard_run_all(ssp);
+
+    pthread_mutex_lock(&ssp->sp->mtx);
+    ssp->running = 0;
+    pthread_mutex_unlock(&ssp->sp->mtx);
+
+    return rc;
+}
+
+
+static void *
+shard_thread(void *vp)
+{
+    SERVER_SHARD *ssp = (SERVER_SHARD *) vp;
+
+
+    (void) shard_run(ssp);
+    return NULL;
+}
+
+
+int
+server_run_all(SERVER *sp)
+{
+    int i, code, rc;
+    void *res;
+
+
+    if (debug)
+	fprintf(stderr, "server_run_all(...): Start\n");
+    
+
+    pthread_mutex_lock(&sp->mtx);
+    if (sp->state != 0)
+    {
+	if (debug)
+	    fprintf(stderr, "server_run_all(...): invalid initial state (%d)\n", sp->state);
+	sp->state = 3;
+	sp->error = EINVAL;
+	pthread_mutex_unlock(&sp->mtx);
+	return -1;
+    }
+    
+    sp->state = 1;
+
+    /* The first shard is run by the calling thread */
+    sp->shards[0].tid = pthread_self();
+    sp->shards[0].running = 1;
+    for (i = 1; i < sp->nshards; i++)
+    {
+	sp->shards[i].running = 1;
+	code = pthread_create(&sp->shards[i].tid, NULL,
+			      shard_thread, (void *) &sp->shards[i]);
+	if (code)
+	{
+	    syslog(LOG_ERR, "pthread_create(shard_thread) failed: %s",
+		   strerror(code));
+	    
+	    /* Let the other listeners handle the load */
+	    shutdown(sp->shards[i].fd, 2);
+	    sp->shards[i].running = 0;
+	    sp->shards[i].tid = sp->shards[0].tid;
+	}
+    }
+    
+    pthread_mutex_unlock(&sp->mtx);
+
+    rc = shard_run(&sp->shards[0]);
+
+    for (i = 1; i < sp->nshards; i++)
+	if (!pthread_equal(sp->shards[i].tid, sp->shards[0].tid))
+	    while ((code = pthread_join(sp->shards[i].tid, &res)) == EINTR)
+		;
+    
+    return rc;
+}
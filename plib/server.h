@@ -21,30 +21,76 @@
 
 #include "plib/threads.h"
 #include "plib/sockaddr.h"
+#include "plib/tpool.h"
+
+extern int server_v6only;
 
 struct server_info;
 
+/*
+** One listening socket with its own accept thread. With more than
+** one shard the sockets share the port via SO_REUSEPORT and the
+** kernel distributes incoming connections between them.
+*/
+typedef struct server_shard
+{
+    int fd;
+    struct sockaddr_gen sin;
+    int cpu; /* CPU to bind the accept thread to, -1 = none */
+    pthread_t tid;
+    int running; /* Accept thread still in its loop, under sp->mtx */
+    
+    pthread_mutex_t mtx;
+    int clients_cur;
+    
+    struct server_info *sp;
+} SERVER_SHARD;
+
 typedef struct
 {
     int fd;
     struct sockaddr_gen rsin; /* Remote address */
     struct sockaddr_gen lsin; /* Local address */
     struct server_info *sp;
+    SERVER_SHARD *ssp;
 } CLIENT;
 
 typedef struct server_info
 {
-    int fd;
+    int fd; /* Same as shards[0].fd */
     struct sockaddr_gen sin;
     void (*handler)(CLIENT *cp);
+    int async; /* Handler returns at once and calls server_client_done() */
+    TPOOL *pool; /* Run clients in a worker pool instead of new threads */
+
+    /*
+    ** If set, keep accepting when overloaded and send this message
+    ** to excess clients instead of leaving them in the backlog.
+    */
+    const char *busy_msg;
+
+    /*
+    ** Called for each new connection before a CLIENT is created.
+    ** Returns NULL to let the client in, or a message to send
+    ** before closing the connection. 'release' is called when an
+    ** admitted client goes away.
+    */
+    const char *(*admit)(struct server_info *sp,
+			 const struct sockaddr_gen *rsin);
+    void (*release)(CLIENT *cp);
+    unsigned long rejected;
 
     pthread_mutex_t mtx;
     int state; /* 0 = not running, 1 = starting/started, 2 = stopping, 3 = failure */
     int error; /* Failure reason (errno) */
     pthread_t tid;
+
+    int nshards;
+    SERVER_SHARD *shards;
+    int affinity;
     
     int clients_max;
-    int clients_cur;
+    int clients_waiting;	/* Accept threads waiting for a slot, under clients_mtx */
     pthread_mutex_t clients_mtx;
     pthread_cond_t clients_cv;
     pthread_attr_t ca_detached;
@@ -56,14 +102,35 @@ server_init(int fd,
 	    const struct sockaddr_gen *sg,
 	    int listen_backlog,
 	    int max_clients,
+	    int nshards,
+	    int affinity,
 	    void (*handler)(CLIENT *cp));
 
+extern int
+server_add_address(SERVER *sp,
+		   const struct sockaddr_gen *sg,
+		   int backlog,
+		   int nshards);
+
+extern SERVER *
+server_adopt(int *fds,
+	     int nfds,
+	     int max_clients,
+	     int affinity,
+	     void (*handler)(CLIENT *cp));
+
+extern int
+server_clients(SERVER *sp);
+
 extern int
 server_start(SERVER *sp);
 
 extern int
 server_stop(SERVER *sp);
 
+extern int
+server_detach(SERVER *sp);
+
 extern int
 server_run_all(SERVER *sp);
 
@@ -72,6 +139,9 @@ server_run_one(SERVER *sp,
 	       int fd,
 	       int nofork);
 
+extern void
+server_client_done(CLIENT *cp);
+
 extern void
 server_cancel(SERVER *sp);
      
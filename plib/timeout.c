@@ -34,22 +34,148 @@
 int debug;
 
 
+/*
+** A two level timing wheel with one second ticks. The first level
+** covers the next TW_SLOTS0 seconds, the second level TW_SLOTS1 blocks
+** of TW_SLOTS0 seconds each. Entries further away than that are parked
+** in the last block and moved again when it comes around.
+**
+** Resetting a timer to a later time only updates 'when' - the entry
+** is moved to the right slot when its current slot comes up.
+*/
+#define TW_BITS0	8
+#define TW_SLOTS0	(1 << TW_BITS0)
+#define TW_SLOTS1	64
+#define TW_SPAN		(TW_SLOTS0 * TW_SLOTS1)
+
+
 static struct timeout_cb
 {
     pthread_mutex_t mtx;
     pthread_cond_t cv;
+    pthread_cond_t done_cv;
     pthread_t tid;
     pthread_attr_t ca_detached;
     int state; /* 0 = not running, 1 = thread running */
-    TIMEOUT *top;
+    time_t tick; /* Next tick to process */
+    int count;
+    TIMEOUT *running;
+    TIMEOUT *wheel0[TW_SLOTS0];
+    TIMEOUT *wheel1[TW_SLOTS1];
 } tcb;
 
 
+/* Must be called with tcb.mtx locked */
+static void
+tw_unlink(TIMEOUT *tp)
+{
+    if (tp->slot < 0)
+	return;
+
+    if (tp->prev)
+	tp->prev->next = tp->next;
+    else if (tp->slot < TW_SLOTS0)
+	tcb.wheel0[tp->slot] = tp->next;
+    else
+	tcb.wheel1[tp->slot - TW_SLOTS0] = tp->next;
+
+    if (tp->next)
+	tp->next->prev = tp->prev;
+
+    tp->next = tp->prev = NULL;
+    tp->slot = -1;
+    tcb.count--;
+}
+
+
+/* Must be called with tcb.mtx locked */
+static void
+tw_insert(TIMEOUT *tp)
+{
+    TIMEOUT **head;
+    time_t d;
+
+
+    d = tp->when - tcb.tick;
+    if (d < 0)
+	d = 0;
+
+    if (d < TW_SLOTS0)
+    {
+	tp->due = tcb.tick + d;
+	tp->slot = tp->due & (TW_SLOTS0-1);
+	head = &tcb.wheel0[tp->slot];
+    }
+    else
+    {
+	if (d >= TW_SPAN)
+	    d = TW_SPAN-1;
+
+	tp->due = ((tcb.tick + d) >> TW_BITS0) << TW_BITS0;
+	tp->slot = TW_SLOTS0 + ((tp->due >> TW_BITS0) & (TW_SLOTS1-1));
+	head = &tcb.wheel1[tp->slot - TW_SLOTS0];
+    }
+
+    tp->prev = NULL;
+    tp->next = *head;
+    if (tp->next)
+	tp->next->prev = tp;
+    *head = tp;
+    tcb.count++;
+}
+
+
+/* Process one tick. Must be called with tcb.mtx locked */
+static void
+tw_tick(time_t t)
+{
+    TIMEOUT *tp;
+    int i;
+
+
+    /* Move the entries of a second level block down to the first level */
+    if ((t & (TW_SLOTS0-1)) == 0)
+    {
+	tcb.tick = t;
+	i = (t >> TW_BITS0) & (TW_SLOTS1-1);
+	while ((tp = tcb.wheel1[i]) != NULL)
+	{
+	    tw_unlink(tp);
+	    tw_insert(tp);
+	}
+    }
+
+    tcb.tick = t+1;
+    i = t & (TW_SLOTS0-1);
+    while ((tp = tcb.wheel0[i]) != NULL)
+    {
+	tw_unlink(tp);
+
+	if (tp->when > t)
+	{
+	    /* Was reset since it was inserted */
+	    tw_insert(tp);
+	    continue;
+	}
+
+	tcb.running = tp;
+	pthread_mutex_unlock(&tcb.mtx);
+
+	if (tp->fun)
+	    tp->fun(tp->arg);
+
+	pthread_mutex_lock(&tcb.mtx);
+	tcb.running = NULL;
+	pthread_cond_broadcast(&tcb.done_cv);
+    }
+}
+
+
 static void *
 timeout_thread(void *misc)
 {
     struct timeout_cb *tcb = (struct timeout_cb *) misc;
-    TIMEOUT *tp;
+    struct timespec when;
     time_t now;
 
 
@@ -58,41 +184,28 @@ timeout_thread(void *misc)
     
     pthread_mutex_lock(&tcb->mtx);
     
-    while (tp = tcb->top)
+    for (;;)
     {
 	time(&now);
 
-	while (tp && now >= tp->when)
-	{
-	    tcb->top = tp->next;
-	    pthread_mutex_unlock(&tcb->mtx);
-	    
-	    if (tp->fun)
-		tp->fun(tp->arg);
-	    
-	    pthread_mutex_lock(&tcb->mtx);
-	    tp = tcb->top;
-	}
+	while (tcb->count > 0 && tcb->tick <= now)
+	    tw_tick(tcb->tick);
 	
-	if (tp == NULL)
+	if (tcb->count == 0)
 	    pthread_cond_wait(&tcb->cv, &tcb->mtx);
 	else
 	{
-	    struct timespec when;
-
-	    when.tv_sec = tp->when;
+	    when.tv_sec = tcb->tick;
 	    when.tv_nsec = 0;
 	    
 	    pthread_cond_timedwait(&tcb->cv, &tcb->mtx, &when);
 	}
     }
 
+    /* Not reached */
     tcb->state = 0;
     pthread_mutex_unlock(&tcb->mtx);
     
-    if (debug)
-	fprintf(stderr, "timeout_thread(): Terminated\n");
-    
     return NULL;
 }
 
@@ -107,10 +220,15 @@ timeout_init(void)
     
     pthread_mutex_init(&tcb.mtx, NULL);
     pthread_cond_init(&tcb.cv, NULL);
+    pthread_cond_init(&tcb.done_cv, NULL);
     pthread_attr_init(&tcb.ca_detached);
     pthread_attr_setdetachstate(&tcb.ca_detached, PTHREAD_CREATE_DETACHED);
     tcb.state = 0;
-    tcb.top = NULL;
+    tcb.tick = time(NULL);
+    tcb.count = 0;
+    tcb.running = NULL;
+    memset(tcb.wheel0, 0, sizeof(tcb.wheel0));
+    memset(tcb.wheel1, 0, sizeof(tcb.wheel1));
     
     if (debug)
 	fprintf(stderr, "timeout_init(): End\n");
@@ -131,7 +249,10 @@ timeout_create(int timeout,
     A_NEW(tp);
 
     tp->next = NULL;
+    tp->prev = NULL;
+    tp->slot = -1;
     tp->when = 0;
+    tp->due = 0;
 
     tp->fun = fun;
     tp->arg = arg;
@@ -156,9 +277,7 @@ int
 timeout_reset(TIMEOUT *tp,
 	      int timeout)
 {
-    TIMEOUT **prev, *cur;
-    TIMEOUT *new_top, *old_top;
-    int code;
+    int code, wakeup = 0;
     
     
     if (debug)
@@ -166,46 +285,31 @@ timeout_reset(TIMEOUT *tp,
 
     pthread_mutex_lock(&tcb.mtx);
 
-    old_top = tcb.top;
-    
-    if (timeout > 0)
-	tp->when = time(NULL)+timeout;
-    else
-	tp->when = 0;
-
-    /* Locate it in the timeout list, if previously inserted */
-    prev = &tcb.top;
-    cur = tcb.top;
-
-    while (cur != NULL && cur != tp)
+    if (timeout <= 0)
     {
-	prev = &cur->next;
-	cur = cur->next;
+	tp->when = 0;
+	tw_unlink(tp);
+	pthread_mutex_unlock(&tcb.mtx);
+	return 0;
     }
 
-    /* Remove it from the list, if found */
-    if (cur == tp)
+    if (tcb.count == 0)
     {
-	*prev = cur->next;
-	tp->next = NULL;
+	/* Nothing pending - no need to step through the idle period */
+	tcb.tick = time(NULL);
+	wakeup = 1;
     }
+    
+    tp->when = time(NULL)+timeout;
 
-    if (timeout > 0)
+    /* Later than the current slot? Then it will be moved when that fires */
+    if (tp->slot < 0 || tp->when < tp->due)
     {
-	/* Reinsert it at the new position */
-	prev = &tcb.top;
-	cur = tcb.top;
-	while (cur != NULL && cur->when < tp->when)
-	{
-	    prev = &cur->next;
-	    cur = cur->next;
-	}
-	*prev = tp;
-	tp->next = cur;
-
+	tw_unlink(tp);
+	tw_insert(tp);
     }
 
-    if (tcb.top && tcb.state == 0)
+    if (tcb.state == 0)
     {
 	if (debug)
 	    fprintf(stderr, "timeout_reset: Starting timeout_thread...\n");
@@ -216,6 +320,8 @@ timeout_reset(TIMEOUT *tp,
 	if (code)
 	{
 	    tcb.state = 0;
+	    tw_unlink(tp);
+	    pthread_mutex_unlock(&tcb.mtx);
 	    
 	    syslog(LOG_ERR, "timeout_reset: pthread_create(timeout_thread): %s",
 		   strerror(code));
@@ -224,7 +330,9 @@ timeout_reset(TIMEOUT *tp,
     }
     
     pthread_mutex_unlock(&tcb.mtx);
-    pthread_cond_signal(&tcb.cv);
+    
+    if (wakeup)
+	pthread_cond_signal(&tcb.cv);
 
     if (debug)
 	fprintf(stderr, "timeout_reset(%p): Done\n",
@@ -234,6 +342,34 @@ timeout_reset(TIMEOUT *tp,
 }
 
 
+int
+timeout_destroy(TIMEOUT *tp)
+{
+    if (tp == NULL)
+	return -1;
+
+    if (debug)
+	fprintf(stderr, "timeout_destroy(%p): Start\n",
+		(void *) tp);
+    
+    pthread_mutex_lock(&tcb.mtx);
+    tw_unlink(tp);
+
+    /* Don't free it while its callback is running in the timeout thread */
+    while (tcb.running == tp && !pthread_equal(tcb.tid, pthread_self()))
+	pthread_cond_wait(&tcb.done_cv, &tcb.mtx);
+    pthread_mutex_unlock(&tcb.mtx);
+    
+    a_free(tp);
+    
+    if (debug)
+	fprintf(stderr, "timeout_destroy(%p): Done\n",
+		(void *) tp);
+    
+    return 0;
+}
+
+
 #else /* No threads */
 
 #include <signal.h>
@@ -360,8 +496,6 @@ timeout_init(void)
     /* Nothing really */
 }
 
-#endif
-
 
 int
 timeout_destroy(TIMEOUT *tp)
@@ -383,4 +517,4 @@ timeout_destroy(TIMEOUT *tp)
     return 0;
 }
 
-
+#endif
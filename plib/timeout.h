@@ -21,8 +21,11 @@
 typedef struct plib_timeout
 {
     struct plib_timeout *next;
+    struct plib_timeout *prev;
+    int slot;		/* Timing wheel slot, -1 if not queued */
 
-    time_t when;
+    time_t when;	/* When to fire */
+    time_t due;		/* When the slot it is queued in comes up */
 
     void (*fun)(void *arg);
     void *arg;
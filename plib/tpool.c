@@ -0,0 +1,310 @@
+/*
+** tpool.c - Self-sizing pool of worker threads
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "plib/config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "plib/aalloc.h"
+#include "plib/tpool.h"
+
+extern int debug;
+
+
+#ifdef HAVE_THREADS
+
+typedef struct
+{
+    void *(*fun)(void *arg);
+    void *arg;
+} TPOOL_JOB;
+
+
+static void *
+tpool_thread(void *vp)
+{
+    TPOOL *tp = (TPOOL *) vp;
+    TPOOL_JOB *jp;
+    void *item;
+    int got;
+
+
+    if (debug)
+	fprintf(stderr, "tpool_thread: Started\n");
+
+    for (;;)
+    {
+	pthread_mutex_lock(&tp->mtx);
+	tp->nidle++;
+	pthread_mutex_unlock(&tp->mtx);
+
+	got = pqueue_timedget(&tp->q, &item, tp->idle);
+
+	pthread_mutex_lock(&tp->mtx);
+	tp->nidle--;
+
+	if (got > 0)
+	{
+	    tp->njobs--;
+	    pthread_mutex_unlock(&tp->mtx);
+
+	    jp = (TPOOL_JOB *) item;
+	    (void) jp->fun(jp->arg);
+	    a_free(jp);
+	    continue;
+	}
+
+	/*
+	** Closed, or idle for too long and more threads than needed.
+	** A job may have been queued after the timeout, by someone who
+	** still counted us as idle - stay if no idle thread is left to
+	** take it.
+	*/
+	if (got == 0 ||
+	    (tp->nthreads > tp->min && tp->njobs <= tp->nidle))
+	    break;
+
+	pthread_mutex_unlock(&tp->mtx);
+    }
+
+    tp->nthreads--;
+    pthread_mutex_unlock(&tp->mtx);
+    pthread_cond_broadcast(&tp->cv);
+
+    if (debug)
+	fprintf(stderr, "tpool_thread: Terminating\n");
+
+    return NULL;
+}
+
+
+/* Must be called with tp->mtx locked */
+static int
+tpool_spawn(TPOOL *tp)
+{
+    pthread_t tid;
+    int code;
+
+
+    code = pthread_create(&tid, &tp->ca_detached, tpool_thread, (void *) tp);
+    if (code)
+    {
+	syslog(LOG_ERR, "tpool: pthread_create: %s", strerror(code));
+	return -1;
+    }
+
+    tp->nthreads++;
+    return 0;
+}
+
+
+TPOOL *
+tpool_create(int min,
+	     int max,
+	     int idle,
+	     int qsize)
+{
+    TPOOL *tp;
+    int i;
+
+
+    if (debug)
+	fprintf(stderr, "tpool_create(%d, %d, %d, %d): Start\n",
+		min, max, idle, qsize);
+
+    if (max < 1)
+	max = 1;
+    if (min > max)
+	min = max;
+    if (min < 0)
+	min = 0;
+    if (idle < 1)
+	idle = 60;
+    if (qsize < 1)
+	qsize = max;
+
+    A_NEW(tp);
+    if (pqueue_init(&tp->q, qsize) < 0)
+    {
+	a_free(tp);
+	return NULL;
+    }
+
+    tp->min = min;
+    tp->max = max;
+    tp->idle = idle;
+    tp->nthreads = 0;
+    tp->nidle = 0;
+    tp->njobs = 0;
+
+    pthread_mutex_init(&tp->mtx, NULL);
+    pthread_cond_init(&tp->cv, NULL);
+    pthread_attr_init(&tp->ca_detached);
+    pthread_attr_setdetachstate(&tp->ca_detached, PTHREAD_CREATE_DETACHED);
+
+    pthread_mutex_lock(&tp->mtx);
+    for (i = 0; i < min; i++)
+	if (tpool_spawn(tp) < 0)
+	    break;
+    pthread_mutex_unlock(&tp->mtx);
+
+    if (debug)
+	fprintf(stderr, "tpool_create(): End: %d threads\n", tp->nthreads);
+
+    return tp;
+}
+
+
+static int
+tpool_queue(TPOOL *tp,
+	    void *(*fun)(void *arg),
+	    void *arg,
+	    int wait)
+{
+    TPOOL_JOB *jp;
+
+
+    A_NEW(jp);
+    jp->fun = fun;
+    jp->arg = arg;
+
+    pthread_mutex_lock(&tp->mtx);
+    tp->njobs++;
+    if (tp->nidle < tp->njobs && tp->nthreads < tp->max)
+	(void) tpool_spawn(tp);
+    pthread_mutex_unlock(&tp->mtx);
+
+    if ((wait ? pqueue_put(&tp->q, jp) : pqueue_tryput(&tp->q, jp)) <= 0)
+    {
+	pthread_mutex_lock(&tp->mtx);
+	tp->njobs--;
+	pthread_mutex_unlock(&tp->mtx);
+
+	a_free(jp);
+	return -1;
+    }
+
+    return 0;
+}
+
+
+int
+tpool_put(TPOOL *tp,
+	  void *(*fun)(void *arg),
+	  void *arg)
+{
+    return tpool_queue(tp, fun, arg, 1);
+}
+
+
+int
+tpool_tryput(TPOOL *tp,
+	     void *(*fun)(void *arg),
+	     void *arg)
+{
+    return tpool_queue(tp, fun, arg, 0);
+}
+
+
+void
+tpool_wakeup(TPOOL *tp)
+{
+    pqueue_wakeup(&tp->q);
+}
+
+
+int
+tpool_queued(TPOOL *tp)
+{
+    int n;
+
+
+    pthread_mutex_lock(&tp->mtx);
+    n = tp->njobs - tp->nidle;
+    pthread_mutex_unlock(&tp->mtx);
+
+    return n > 0 ? n : 0;
+}
+
+
+void
+tpool_destroy(TPOOL *tp)
+{
+    if (tp == NULL)
+	return;
+
+    pqueue_close(&tp->q);
+
+    pthread_mutex_lock(&tp->mtx);
+    while (tp->nthreads > 0)
+	pthread_cond_wait(&tp->cv, &tp->mtx);
+    pthread_mutex_unlock(&tp->mtx);
+
+    pqueue_destroy(&tp->q);
+    pthread_attr_destroy(&tp->ca_detached);
+    pthread_mutex_destroy(&tp->mtx);
+    pthread_cond_destroy(&tp->cv);
+    a_free(tp);
+}
+
+#else /* No threads */
+
+TPOOL *
+tpool_create(int min,
+	     int max,
+	     int idle,
+	     int qsize)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int
+tpool_put(TPOOL *tp,
+	  void *(*fun)(void *arg),
+	  void *arg)
+{
+    (void) fun(arg);
+    return 0;
+}
+
+int
+tpool_tryput(TPOOL *tp,
+	     void *(*fun)(void *arg),
+	     void *arg)
+{
+    (void) fun(arg);
+    return 0;
+}
+
+void
+tpool_wakeup(TPOOL *tp)
+{
+}
+
+int
+tpool_queued(TPOOL *tp)
+{
+    return 0;
+}
+
+void
+tpool_destroy(TPOOL *tp)
+{
+}
+
+#endif
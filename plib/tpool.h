@@ -0,0 +1,77 @@
+/*
+** tpool.h - Self-sizing pool of worker threads
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef PLIB_TPOOL_H
+#define PLIB_TPOOL_H
+
+#include "plib/threads.h"
+#include "plib/pqueue.h"
+
+typedef struct tpool
+{
+    PQUEUE q;
+
+    int min;     /* Threads to keep around even when idle */
+    int max;     /* Max number of threads */
+    int idle;    /* Seconds before an idle thread above 'min' exits */
+
+    pthread_mutex_t mtx;
+    pthread_cond_t cv;
+    int nthreads;
+    int nidle;
+    int njobs;   /* Queued jobs not yet picked up by a thread */
+    pthread_attr_t ca_detached;
+} TPOOL;
+
+
+/*
+** Create a pool and start 'min' threads. At most 'qsize' jobs
+** may be queued before tpool_put() blocks.
+*/
+extern TPOOL *
+tpool_create(int min,
+	     int max,
+	     int idle,
+	     int qsize);
+
+/*
+** Run 'fun(arg)' in one of the threads. Starts a new thread
+** if none is idle and the pool is below 'max'.
+** Returns 0 if OK, or -1 if the pool is closed or tpool_wakeup()
+** was called while waiting for room in the queue.
+*/
+extern int
+tpool_put(TPOOL *tp,
+	  void *(*fun)(void *arg),
+	  void *arg);
+
+/* Like tpool_put() but returns -1 at once if the queue is full */
+extern int
+tpool_tryput(TPOOL *tp,
+	     void *(*fun)(void *arg),
+	     void *arg);
+
+/* Make tpool_put() calls blocked on a full queue return -1 */
+extern void
+tpool_wakeup(TPOOL *tp);
+
+/* Number of jobs waiting for a thread */
+extern int
+tpool_queued(TPOOL *tp);
+
+/* Run all queued jobs and wait for all threads to exit */
+extern void
+tpool_destroy(TPOOL *tp);
+
+#endif
@@ -0,0 +1,251 @@
+/*
+** uring.c - Minimal Linux io_uring interface
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "plib/config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "plib/uring.h"
+
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+/*
+** The rings are shared with the kernel, so the head and tail
+** indexes must be read and written with the right memory ordering.
+*/
+#define LOAD_ACQUIRE(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+
+int
+uring_init(URING *up,
+	   unsigned int entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+
+    memset(up, 0, sizeof(*up));
+    memset(&p, 0, sizeof(p));
+
+    up->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (up->fd < 0)
+	return -1;
+
+    up->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    up->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    up->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    up->sq_ptr = mmap(NULL, up->sq_len, PROT_READ|PROT_WRITE,
+		      MAP_SHARED|MAP_POPULATE, up->fd, IORING_OFF_SQ_RING);
+    if (up->sq_ptr == MAP_FAILED)
+	goto Fail;
+
+    up->cq_ptr = mmap(NULL, up->cq_len, PROT_READ|PROT_WRITE,
+		      MAP_SHARED|MAP_POPULATE, up->fd, IORING_OFF_CQ_RING);
+    if (up->cq_ptr == MAP_FAILED)
+	goto Fail;
+
+    up->sqes = mmap(NULL, up->sqes_len, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, up->fd, IORING_OFF_SQES);
+    if (up->sqes == MAP_FAILED)
+	goto Fail;
+
+    sq = (char *) up->sq_ptr;
+    up->sq_head = (unsigned int *) (sq + p.sq_off.head);
+    up->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    up->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+    up->sq_array = (unsigned int *) (sq + p.sq_off.array);
+
+    cq = (char *) up->cq_ptr;
+    up->cq_head = (unsigned int *) (cq + p.cq_off.head);
+    up->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    up->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+    up->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    up->sq_pending = 0;
+    return 0;
+
+  Fail:
+    uring_exit(up);
+    return -1;
+}
+
+
+void
+uring_exit(URING *up)
+{
+    if (up->sqes && up->sqes != MAP_FAILED)
+	munmap(up->sqes, up->sqes_len);
+    if (up->cq_ptr && up->cq_ptr != MAP_FAILED)
+	munmap(up->cq_ptr, up->cq_len);
+    if (up->sq_ptr && up->sq_ptr != MAP_FAILED)
+	munmap(up->sq_ptr, up->sq_len);
+    if (up->fd >= 0)
+	close(up->fd);
+
+    memset(up, 0, sizeof(*up));
+    up->fd = -1;
+}
+
+
+struct io_uring_sqe *
+uring_get_sqe(URING *up)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int head, tail, idx;
+
+
+    head = LOAD_ACQUIRE(up->sq_head);
+    tail = *up->sq_tail + up->sq_pending;
+
+    if (tail - head > *up->sq_mask)
+	return NULL;
+
+    idx = tail & *up->sq_mask;
+    sqe = &up->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    up->sq_array[idx] = idx;
+    up->sq_pending++;
+
+    return sqe;
+}
+
+
+int
+uring_submit(URING *up,
+	     unsigned int wait_nr)
+{
+    unsigned int n;
+    int code;
+
+
+    n = up->sq_pending;
+    if (n > 0)
+    {
+	STORE_RELEASE(up->sq_tail, *up->sq_tail + n);
+	up->sq_pending = 0;
+    }
+
+    if (n == 0 && wait_nr == 0)
+	return 0;
+
+    while ((code = syscall(__NR_io_uring_enter, up->fd, n, wait_nr,
+			   wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0,
+			   NULL, 0)) < 0 && errno == EINTR)
+    {
+	/* Already handed over to the kernel, just wait again */
+	n = 0;
+    }
+
+    return code;
+}
+
+
+struct io_uring_cqe *
+uring_peek_cqe(URING *up)
+{
+    unsigned int head;
+
+
+    head = *up->cq_head;
+    if (head == LOAD_ACQUIRE(up->cq_tail))
+	return NULL;
+
+    return &up->cqes[head & *up->cq_mask];
+}
+
+
+void
+uring_cqe_seen(URING *up)
+{
+    STORE_RELEASE(up->cq_head, *up->cq_head + 1);
+}
+
+
+int
+uring_register(URING *up,
+	       unsigned int opcode,
+	       const void *arg,
+	       unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, up->fd, opcode, arg, nr_args);
+}
+
+#else /* No io_uring */
+
+int
+uring_init(URING *up,
+	   unsigned int entries)
+{
+    memset(up, 0, sizeof(*up));
+    up->fd = -1;
+    errno = ENOSYS;
+    return -1;
+}
+
+void
+uring_exit(URING *up)
+{
+}
+
+struct io_uring_sqe *
+uring_get_sqe(URING *up)
+{
+    return NULL;
+}
+
+int
+uring_submit(URING *up,
+	     unsigned int wait_nr)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+struct io_uring_cqe *
+uring_peek_cqe(URING *up)
+{
+    return NULL;
+}
+
+void
+uring_cqe_seen(URING *up)
+{
+}
+
+int
+uring_register(URING *up,
+	       unsigned int opcode,
+	       const void *arg,
+	       unsigned int nr_args)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
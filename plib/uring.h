@@ -0,0 +1,83 @@
+/*
+** uring.h - Minimal Linux io_uring interface
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef PLIB_URING_H
+#define PLIB_URING_H
+
+#include <stddef.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+typedef struct uring
+{
+    int fd;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_pending;	/* Queued but not yet submitted */
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+} URING;
+
+
+/* Set up a ring with (at least) 'entries' submission slots */
+extern int
+uring_init(URING *up,
+	   unsigned int entries);
+
+/* Tear down the ring */
+extern void
+uring_exit(URING *up);
+
+/* Get a cleared submission entry, or NULL if the queue is full */
+extern struct io_uring_sqe *
+uring_get_sqe(URING *up);
+
+/*
+** Submit queued entries and wait for at least 'wait_nr'
+** completions. Returns the number submitted, or -1 on error.
+*/
+extern int
+uring_submit(URING *up,
+	     unsigned int wait_nr);
+
+/* Get the next completion without waiting, or NULL if none */
+extern struct io_uring_cqe *
+uring_peek_cqe(URING *up);
+
+/* Mark the completion returned by uring_peek_cqe() as consumed */
+extern void
+uring_cqe_seen(URING *up);
+
+/* io_uring_register(2) */
+extern int
+uring_register(URING *up,
+	       unsigned int opcode,
+	       const void *arg,
+	       unsigned int nr_args);
+
+#endif
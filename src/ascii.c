@@ -0,0 +1,191 @@
+/*
+** ascii.c - Size of files as sent in TYPE A
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "pftpd.h"
+
+#include "plib/aalloc.h"
+#include "plib/safeio.h"
+#include "plib/crlf.h"
+#include "ascii.h"
+
+
+int ascii_cache_size = 1024;
+
+
+/*
+** A direct mapped table - a new entry simply replaces whatever was
+** in its slot. Entries are only valid as long as the file still has
+** the same device, inode, size and modification time.
+*/
+#define ASCII_LOCKS	64
+#define ASCII_BUFSIZE	(64*1024)
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    off_t asize;	/* -1 = unused */
+} ASCIISIZE;
+
+static ASCIISIZE *ascii_tab = NULL;
+static int ascii_tab_size = 0;
+static pthread_mutex_t ascii_mtx[ASCII_LOCKS];
+static pthread_once_t ascii_once = PTHREAD_ONCE_INIT;
+
+
+static void
+ascii_init(void)
+{
+    int i;
+
+
+    for (i = 0; i < ASCII_LOCKS; i++)
+	pthread_mutex_init(&ascii_mtx[i], NULL);
+
+    if (ascii_cache_size <= 0)
+	return;
+
+    ascii_tab = a_malloc(ascii_cache_size * sizeof(ASCIISIZE), "ascii_tab");
+    for (i = 0; i < ascii_cache_size; i++)
+	ascii_tab[i].asize = -1;
+    ascii_tab_size = ascii_cache_size;
+}
+
+
+static unsigned int
+ascii_slot(const struct stat *sp)
+{
+    unsigned int h = 2166136261U;
+
+
+    h = (h ^ (unsigned int) sp->st_dev) * 16777619U;
+    h = (h ^ (unsigned int) sp->st_ino) * 16777619U;
+    h = (h ^ (unsigned int) (sp->st_ino >> 16 >> 16)) * 16777619U;
+
+    return h % ascii_tab_size;
+}
+
+
+static off_t
+ascii_lookup(const struct stat *sp)
+{
+    ASCIISIZE *ap;
+    unsigned int h;
+    off_t asize;
+
+
+    pthread_once(&ascii_once, ascii_init);
+    if (ascii_tab_size == 0)
+	return -1;
+
+    h = ascii_slot(sp);
+    ap = &ascii_tab[h];
+
+    pthread_mutex_lock(&ascii_mtx[h % ASCII_LOCKS]);
+    if (ap->asize >= 0 &&
+	ap->dev == sp->st_dev && ap->ino == sp->st_ino &&
+	ap->size == sp->st_size && ap->mtime == sp->st_mtime)
+	asize = ap->asize;
+    else
+	asize = -1;
+    pthread_mutex_unlock(&ascii_mtx[h % ASCII_LOCKS]);
+
+    return asize;
+}
+
+
+void
+ascii_size_learn(const struct stat *sp,
+		 off_t size)
+{
+    ASCIISIZE *ap;
+    unsigned int h;
+
+
+    pthread_once(&ascii_once, ascii_init);
+    if (ascii_tab_size == 0 || size < 0)
+	return;
+
+    h = ascii_slot(sp);
+    ap = &ascii_tab[h];
+
+    pthread_mutex_lock(&ascii_mtx[h % ASCII_LOCKS]);
+    ap->dev = sp->st_dev;
+    ap->ino = sp->st_ino;
+    ap->size = sp->st_size;
+    ap->mtime = sp->st_mtime;
+    ap->asize = size;
+    pthread_mutex_unlock(&ascii_mtx[h % ASCII_LOCKS]);
+}
+
+
+off_t
+ascii_size(const char *path)
+{
+    struct stat sb, sb2;
+    char *buf;
+    ssize_t len;
+    off_t size;
+    int fd, lastcr;
+
+
+    fd = s_open(path, O_RDONLY);
+    if (fd < 0)
+	return -1;
+
+    if (fstat(fd, &sb) < 0)
+    {
+	s_close(fd);
+	return -1;
+    }
+
+    size = ascii_lookup(&sb);
+    if (size >= 0)
+    {
+	if (debug)
+	    fprintf(stderr, "ascii_size(%s): %lld (cached)\n",
+		    path, (long long) size);
+	s_close(fd);
+	return size;
+    }
+
+    buf = a_malloc(ASCII_BUFSIZE, "ascii_size: buf");
+
+    size = 0;
+    lastcr = 0;
+    while ((len = s_read(fd, buf, ASCII_BUFSIZE)) > 0)
+	size += crlf_count(buf, len, &lastcr);
+
+    a_free(buf);
+
+    /* Don't remember counts of files that changed while being read */
+    if (len >= 0 && fstat(fd, &sb2) == 0 &&
+	sb2.st_size == sb.st_size && sb2.st_mtime == sb.st_mtime)
+	ascii_size_learn(&sb, size);
+    
+    s_close(fd);
+    return len < 0 ? -1 : size;
+}
@@ -0,0 +1,39 @@
+/*
+** ascii.h - Size of files as sent in TYPE A
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef PFTPD_ASCII_H
+#define PFTPD_ASCII_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+extern int ascii_cache_size;	/* Cached sizes, 0 = no cache */
+
+
+/*
+** Size of the file at 'path' after CRLF translation, or -1.
+** Answered from the cache if the file hasn't changed.
+*/
+extern off_t
+ascii_size(const char *path);
+
+/*
+** Remember 'size' for the file described by 'sp', learned from a
+** complete TYPE A transfer
+*/
+extern void
+ascii_size_learn(const struct stat *sp,
+		 off_t size);
+
+#endif
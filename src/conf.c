@@ -21,6 +21,7 @@
 
 #include "pftpd.h"
 
+#include "plib/safeio.h"
 #include "plib/safestr.h"
 #include "plib/str2.h"
 #include "plib/support.h"
@@ -120,14 +121,26 @@ conf_parse(const char *path,
 		       path, line, arg);
 	}
 
-#if 0 /* Enable when we have a str2addr() */
+	else if (s_strcasecmp(cp, "server:listen-shards") == 0)
+	{
+	    if (str2int(arg, &listen_shards) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid number: %s",
+		       path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:shard-affinity") == 0)
+	{
+	    if (str2bool(arg, &listen_affinity) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid boolean: %s",
+		       path, line, arg);
+	}
+
 	else if (s_strcasecmp(cp, "server:address") == 0)
 	{
-	    if (str2addr(arg, &listen_address) < 0)
+	    if (listen_add_address(arg) < 0)
 		syslog(LOG_ERR, "%s: %d: invalid address: %s",
 		       path, line, arg);
 	}
-#endif
 	
 	else if (s_strcasecmp(cp, "server:user") == 0)
 	{
@@ -159,6 +172,111 @@ conf_parse(const char *path,
 			path, line, arg);
 	}
 
+	else if (s_strcasecmp(cp, "server:min-workers") == 0)
+	{
+	     if (str2int(arg, &workers_min) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:max-workers") == 0)
+	{
+	     if (str2int(arg, &workers_max) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:worker-idle-timeout") == 0)
+	{
+	     if (str2int(arg, &workers_idle) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:worker-queue") == 0)
+	{
+	     if (str2int(arg, &workers_queue) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:shed-load") == 0)
+	{
+	     if (str2bool(arg, &request_shed) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid boolean: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:shed-queue-depth") == 0)
+	{
+	     if (str2int(arg, &request_shed_queue) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:shed-latency") == 0)
+	{
+	     if (str2int(arg, &request_shed_latency) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:max-peer-sessions") == 0)
+	{
+	     if (str2int(arg, &peer_max_sessions) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:max-peer-errors") == 0)
+	{
+	     if (str2int(arg, &peer_max_errors) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:peer-error-window") == 0)
+	{
+	     if (str2int(arg, &peer_error_window) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:peer-prefix-ipv4") == 0)
+	{
+	     if (str2int(arg, &peer_prefix4) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:peer-prefix-ipv6") == 0)
+	{
+	     if (str2int(arg, &peer_prefix6) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:handoff-timeout") == 0)
+	{
+	     if (str2int(arg, &handoff_timeout) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:drain-timeout") == 0)
+	{
+	     if (str2int(arg, &handoff_drain) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
+	else if (s_strcasecmp(cp, "server:event-threads") == 0)
+	{
+	     if (str2int(arg, &request_event_threads) < 0)
+		 syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+			path, line, arg);
+	}
+
 
 	/* Protocol variables */
 	
@@ -170,6 +288,173 @@ conf_parse(const char *path,
 	}
 
 
+	/* Data transfer variables */
+	
+	else if (s_strcasecmp(cp, "data:stall-timeout") == 0)
+	{
+	    if (str2int(arg, &data_stall_timeout) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	
+	else if (s_strcasecmp(cp, "data:min-rate") == 0)
+	{
+	    if (str2int(arg, &data_min_rate) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	
+	else if (s_strcasecmp(cp, "data:rate-window") == 0)
+	{
+	    if (str2int(arg, &data_rate_window) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	
+	else if (s_strcasecmp(cp, "data:connect-timeout") == 0)
+	{
+	    if (str2int(arg, &data_connect_timeout) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	
+	else if (s_strcasecmp(cp, "data:preconnect") == 0)
+	{
+	    if (str2int(arg, &data_preconnect) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	
+	else if (s_strcasecmp(cp, "data:min-workers") == 0)
+	{
+	    if (str2int(arg, &data_workers_min) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:max-workers") == 0)
+	{
+	    if (str2int(arg, &data_workers_max) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:worker-idle-timeout") == 0)
+	{
+	    if (str2int(arg, &data_workers_idle) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	
+	else if (s_strcasecmp(cp, "data:copy-strategy") == 0)
+	{
+	    int strategy = copyfd_lookup(arg);
+
+	    if (strategy < 0)
+		syslog(LOG_ERR, "%s: %d: invalid copy strategy: %s",
+		       path, line, arg);
+	    else
+		copyfd_strategy = strategy;
+	}
+	
+	else if (s_strcasecmp(cp, "data:copy-bufsize") == 0)
+	{
+	    if (str2int(arg, &copyfd_bufsize) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	
+	else if (s_strcasecmp(cp, "data:copy-small-file") == 0)
+	{
+	    if (str2int(arg, &copyfd_small) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:readahead") == 0)
+	{
+	    if (str2int(arg, &copyfd_readahead) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:dontneed-mb") == 0)
+	{
+	    if (str2int(arg, &copyfd_dontneed_mb) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:direct-mb") == 0)
+	{
+	    if (str2int(arg, &copyfd_direct_mb) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:copy-depth") == 0)
+	{
+	    if (str2int(arg, &copyfd_depth) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:file-cache") == 0)
+	{
+	    if (str2int(arg, &filecache_memory) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:file-cache-max") == 0)
+	{
+	    if (str2int(arg, &filecache_max_file) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:file-cache-ttl") == 0)
+	{
+	    if (str2int(arg, &filecache_ttl) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:fd-cache") == 0)
+	{
+	    if (str2int(arg, &fdcache_size) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:fd-cache-ttl") == 0)
+	{
+	    if (str2int(arg, &fdcache_ttl) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:fd-cache-idle") == 0)
+	{
+	    if (str2int(arg, &fdcache_idle) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:fanout-chunks") == 0)
+	{
+	    if (str2int(arg, &fanout_chunks) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:fanout-chunk-size") == 0)
+	{
+	    if (str2int(arg, &fanout_chunk_size) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	else if (s_strcasecmp(cp, "data:ascii-cache") == 0)
+	{
+	    if (str2int(arg, &ascii_cache_size) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+	
+	else if (s_strcasecmp(cp, "data:uring-threads") == 0)
+	{
+	    if (str2int(arg, &uxfer_threads) < 0)
+		syslog(LOG_ERR, "%s: %d: invalid integer: %s",
+		       path, line, arg);
+	}
+
+
 	/* Result variables */
 	
 	else
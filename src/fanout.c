@@ -0,0 +1,290 @@
+/*
+** fanout.c - One disk read for many concurrent downloads of a file
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "pftpd.h"
+
+#include "plib/aalloc.h"
+#include "plib/safeio.h"
+#include "fanout.h"
+
+
+int fanout_chunks = 0;
+int fanout_chunk_size = 256*1024;
+
+unsigned long fanout_reads = 0;
+unsigned long fanout_shared = 0;
+unsigned long fanout_behind = 0;
+
+
+/*
+** All transfers of a file share a ring of fanout_chunks buffers.
+** Chunk N of the file lives in slot N % fanout_chunks, so the ring
+** holds a window of consecutive chunks. Whoever first needs a chunk
+** reads it from disk, the others wait for that read and then send
+** from the same buffer. A transfer that finds its slot already
+** reused for a later chunk has fallen a whole ring behind (or was
+** overtaken by one that started further into the file), and does
+** the rest of the file on its own with s_copyfd2().
+*/
+static FANOUT *fanout_list = NULL;
+static pthread_mutex_t fanout_mtx;
+static pthread_once_t fanout_once = PTHREAD_ONCE_INIT;
+
+
+static void
+fanout_init(void)
+{
+    pthread_mutex_init(&fanout_mtx, NULL);
+}
+
+
+FANOUT *
+fanout_get(const struct stat *sp)
+{
+    FANOUT *fop;
+    int i;
+
+
+    if (fanout_chunks <= 0 || fanout_chunk_size <= 0 ||
+	!S_ISREG(sp->st_mode) || sp->st_size <= copyfd_small)
+	return NULL;
+
+    pthread_once(&fanout_once, fanout_init);
+
+    pthread_mutex_lock(&fanout_mtx);
+    for (fop = fanout_list; fop; fop = fop->next)
+	if (fop->dev == sp->st_dev && fop->ino == sp->st_ino &&
+	    fop->size == sp->st_size && fop->mtime == sp->st_mtime)
+	{
+	    fop->refs++;
+	    pthread_mutex_unlock(&fanout_mtx);
+	    return fop;
+	}
+
+    A_NEW(fop);
+    fop->dev = sp->st_dev;
+    fop->ino = sp->st_ino;
+    fop->size = sp->st_size;
+    fop->mtime = sp->st_mtime;
+    fop->refs = 1;
+
+    pthread_mutex_init(&fop->mtx, NULL);
+    pthread_cond_init(&fop->cv, NULL);
+    fop->csize = fanout_chunk_size;
+    fop->nslots = fanout_chunks;
+    fop->slotv = a_malloc(fop->nslots * sizeof(FANOUT_SLOT), "FANOUT slotv");
+    for (i = 0; i < fop->nslots; i++)
+    {
+	fop->slotv[i].chunk = -1;
+	fop->slotv[i].buf = a_malloc(fop->csize, "FANOUT buf");
+    }
+
+    fop->next = fanout_list;
+    fanout_list = fop;
+    pthread_mutex_unlock(&fanout_mtx);
+
+    if (debug)
+	fprintf(stderr, "fanout_get: new ring for %lu/%lu (%d x %d bytes)\n",
+		(unsigned long) fop->dev, (unsigned long) fop->ino,
+		fop->nslots, fop->csize);
+
+    return fop;
+}
+
+
+void
+fanout_release(FANOUT *fop)
+{
+    FANOUT **fopp;
+    int i;
+
+
+    pthread_mutex_lock(&fanout_mtx);
+    if (--fop->refs > 0)
+    {
+	pthread_mutex_unlock(&fanout_mtx);
+	return;
+    }
+
+    for (fopp = &fanout_list; *fopp && *fopp != fop; fopp = &(*fopp)->next)
+	;
+    if (*fopp)
+	*fopp = fop->next;
+    pthread_mutex_unlock(&fanout_mtx);
+
+    for (i = 0; i < fop->nslots; i++)
+	a_free(fop->slotv[i].buf);
+    a_free(fop->slotv);
+    pthread_cond_destroy(&fop->cv);
+    pthread_mutex_destroy(&fop->mtx);
+    a_free(fop);
+}
+
+
+/* Write all of 'buf', returns 0 or -1 */
+static int
+fanout_write(int fd,
+	     const char *buf,
+	     int len,
+	     volatile off_t *moved)
+{
+    int n;
+
+
+    for (; len > 0; buf += n, len -= n)
+    {
+	n = s_write(fd, buf, len);
+	if (n <= 0)
+	    return -1;
+	if (moved)
+	    *moved += n;
+    }
+
+    return 0;
+}
+
+
+off_t
+fanout_send(FANOUT *fop,
+	    int to_fd,
+	    int from_fd,
+	    off_t *start,
+	    volatile off_t *moved)
+{
+    FANOUT_SLOT *sp;
+    char *own;
+    off_t total, chunk, err;
+    ssize_t n;
+    int skip, len, mine;
+
+
+    own = NULL;
+    total = 0;
+
+    while (*start < fop->size)
+    {
+	chunk = *start / fop->csize;
+	skip = *start - chunk * fop->csize;
+	sp = &fop->slotv[chunk % fop->nslots];
+	mine = 0;
+
+	pthread_mutex_lock(&fop->mtx);
+	while (sp->loading && sp->chunk == chunk)
+	    pthread_cond_wait(&fop->cv, &fop->mtx);
+
+	if (sp->chunk > chunk)
+	{
+	    /* Overtaken by a whole ring - go on alone */
+	    fanout_behind++;
+	    pthread_mutex_unlock(&fop->mtx);
+	    goto Behind;
+	}
+
+	if (sp->chunk < chunk)
+	{
+	    if (sp->loading || sp->pins > 0)
+	    {
+		/* Still busy with an older chunk, read this one privately */
+		pthread_mutex_unlock(&fop->mtx);
+
+		if (own == NULL)
+		    own = a_malloc(fop->csize, "fanout_send: own");
+		n = s_pread(from_fd, own, fop->csize, chunk * fop->csize);
+		if (n < 0)
+		    goto Fail;
+		if (n <= skip)
+		    break;
+		if (fanout_write(to_fd, own+skip, n-skip, moved) < 0)
+		    goto Fail;
+
+		*start += n-skip;
+		total += n-skip;
+		continue;
+	    }
+
+	    sp->chunk = chunk;
+	    sp->loading = 1;
+	    fanout_reads++;
+	    pthread_mutex_unlock(&fop->mtx);
+
+	    n = s_pread(from_fd, sp->buf, fop->csize, chunk * fop->csize);
+
+	    pthread_mutex_lock(&fop->mtx);
+	    sp->loading = 0;
+	    if (n < 0)
+		sp->chunk = -1;
+	    else
+		sp->len = n;
+	    pthread_cond_broadcast(&fop->cv);
+
+	    if (n < 0)
+	    {
+		pthread_mutex_unlock(&fop->mtx);
+		goto Fail;
+	    }
+	    mine = 1;
+	}
+
+	/* The chunk is in the ring - send our part of it */
+	len = sp->len - skip;
+	if (len <= 0)
+	{
+	    /* File shrunk */
+	    pthread_mutex_unlock(&fop->mtx);
+	    break;
+	}
+	sp->pins++;
+	if (!mine)
+	    fanout_shared++;
+	pthread_mutex_unlock(&fop->mtx);
+
+	n = fanout_write(to_fd, sp->buf+skip, len, moved);
+
+	pthread_mutex_lock(&fop->mtx);
+	sp->pins--;
+	pthread_mutex_unlock(&fop->mtx);
+
+	if (n < 0)
+	    goto Fail;
+
+	*start += len;
+	total += len;
+    }
+
+    if (own)
+	a_free(own);
+    return total;
+
+  Behind:
+    if (own)
+	a_free(own);
+
+    err = s_copyfd2(to_fd, from_fd, start, 0, moved);
+    return err < 0 ? -1 : total + err;
+
+  Fail:
+    if (own)
+	a_free(own);
+    return -1;
+}
@@ -0,0 +1,76 @@
+/*
+** fanout.h - One disk read for many concurrent downloads of a file
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef PFTPD_FANOUT_H
+#define PFTPD_FANOUT_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+extern int fanout_chunks;	/* Chunks in each ring, 0 = no fan-out */
+extern int fanout_chunk_size;	/* Bytes per chunk */
+
+extern unsigned long fanout_reads;	/* Chunks read from disk */
+extern unsigned long fanout_shared;	/* Chunks sent from another's read */
+extern unsigned long fanout_behind;	/* Transfers that fell behind */
+
+
+typedef struct fanout_slot
+{
+    off_t chunk;		/* Chunk number held, -1 = none */
+    int len;
+    int loading;		/* Being read from disk */
+    int pins;			/* Transfers sending from the buffer */
+    char *buf;
+} FANOUT_SLOT;
+
+typedef struct fanout
+{
+    struct fanout *next;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    int refs;
+
+    pthread_mutex_t mtx;
+    pthread_cond_t cv;
+    int csize;			/* Bytes per chunk */
+    int nslots;
+    FANOUT_SLOT *slotv;
+} FANOUT;
+
+
+/*
+** Join (or start) the in-flight reads of the file described by
+** 'sp'. Returns NULL if fan-out isn't used for this file.
+*/
+extern FANOUT *
+fanout_get(const struct stat *sp);
+
+extern void
+fanout_release(FANOUT *fop);
+
+/*
+** Send the file from '*start' to EOF like s_copyfd2(), sharing the
+** chunks read from 'from_fd' with the other transfers of the file.
+*/
+extern off_t
+fanout_send(FANOUT *fop,
+	    int to_fd,
+	    int from_fd,
+	    off_t *start,
+	    volatile off_t *moved);
+
+#endif
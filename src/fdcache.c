@@ -0,0 +1,382 @@
+/*
+** fdcache.c - Shared descriptors for files being downloaded
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "pftpd.h"
+
+#include "plib/aalloc.h"
+#include "plib/safeio.h"
+#include "fdcache.h"
+
+
+int fdcache_size = 256;
+int fdcache_ttl = 2;
+int fdcache_idle = 30;
+
+unsigned long fdcache_hits = 0;
+unsigned long fdcache_misses = 0;
+
+
+/*
+** Entries are found by real path name and kept in LRU order. An
+** entry is trusted for fdcache_ttl seconds, after that the file is
+** stat()ed again and must still have the same device, inode, size
+** and modification time. The cache holds one reference to each
+** entry and every transfer using it another. Entries nobody has
+** used for fdcache_idle seconds are closed.
+*/
+#define FDCACHE_BUCKETS	256
+
+static FDCACHE *fdc_tab[FDCACHE_BUCKETS];
+static FDCACHE *fdc_lru_head = NULL;	/* Most recently used */
+static FDCACHE *fdc_lru_tail = NULL;
+static int fdc_count = 0;
+static time_t fdc_swept = 0;
+
+static pthread_mutex_t fdc_mtx;
+static pthread_once_t fdc_once = PTHREAD_ONCE_INIT;
+
+
+static void
+fdc_init(void)
+{
+    pthread_mutex_init(&fdc_mtx, NULL);
+}
+
+
+static unsigned int
+fdc_hash(const char *path)
+{
+    unsigned int h = 2166136261U;
+
+
+    while (*path)
+	h = (h ^ (unsigned char) *path++) * 16777619U;
+
+    return h;
+}
+
+
+/* Close and free a list of entries chained through 'next' */
+static void
+fdc_free(FDCACHE *fdcp)
+{
+    FDCACHE *next;
+
+
+    for (; fdcp; fdcp = next)
+    {
+	next = fdcp->next;
+
+	if (debug)
+	    fprintf(stderr, "fdcache: closing %s (fd %d)\n",
+		    fdcp->path, fdcp->fd);
+
+	s_close(fdcp->fd);
+	a_free(fdcp->path);
+	a_free(fdcp);
+    }
+}
+
+
+/* Must be called with fdc_mtx held */
+static FDCACHE *
+fdc_lookup(const char *path,
+	   unsigned int h)
+{
+    FDCACHE *fdcp;
+
+
+    for (fdcp = fdc_tab[h % FDCACHE_BUCKETS]; fdcp; fdcp = fdcp->next)
+	if (fdcp->hash == h && strcmp(fdcp->path, path) == 0)
+	    return fdcp;
+
+    return NULL;
+}
+
+
+/* Move to the front of the LRU list. Must be called with fdc_mtx held */
+static void
+fdc_touch(FDCACHE *fdcp)
+{
+    if (fdc_lru_head == fdcp)
+	return;
+
+    /* Unlink */
+    if (fdcp->lru_prev)
+	fdcp->lru_prev->lru_next = fdcp->lru_next;
+    if (fdcp->lru_next)
+	fdcp->lru_next->lru_prev = fdcp->lru_prev;
+    if (fdc_lru_tail == fdcp)
+	fdc_lru_tail = fdcp->lru_prev;
+
+    fdcp->lru_prev = NULL;
+    fdcp->lru_next = fdc_lru_head;
+    if (fdc_lru_head)
+	fdc_lru_head->lru_prev = fdcp;
+    fdc_lru_head = fdcp;
+    if (fdc_lru_tail == NULL)
+	fdc_lru_tail = fdcp;
+}
+
+
+/*
+** Take an entry out of the cache. If nobody else is using it, it
+** is put on '*deadp' to be closed once fdc_mtx has been released.
+** Must be called with fdc_mtx held.
+*/
+static void
+fdc_remove(FDCACHE *fdcp,
+	   FDCACHE **deadp)
+{
+    FDCACHE **fdcpp;
+
+
+    for (fdcpp = &fdc_tab[fdcp->hash % FDCACHE_BUCKETS];
+	 *fdcpp && *fdcpp != fdcp;
+	 fdcpp = &(*fdcpp)->next)
+	;
+    if (*fdcpp)
+	*fdcpp = fdcp->next;
+
+    if (fdcp->lru_prev)
+	fdcp->lru_prev->lru_next = fdcp->lru_next;
+    else
+	fdc_lru_head = fdcp->lru_next;
+    if (fdcp->lru_next)
+	fdcp->lru_next->lru_prev = fdcp->lru_prev;
+    else
+	fdc_lru_tail = fdcp->lru_prev;
+
+    fdcp->lru_prev = fdcp->lru_next = NULL;
+    fdcp->next = NULL;
+    fdcp->dead = 1;
+    fdc_count--;
+
+    if (--fdcp->refs == 0)
+    {
+	fdcp->next = *deadp;
+	*deadp = fdcp;
+    }
+}
+
+
+/*
+** Drop entries that have been idle for too long, at most once a
+** second. Must be called with fdc_mtx held.
+*/
+static void
+fdc_sweep(time_t now,
+	  FDCACHE **deadp)
+{
+    FDCACHE *fdcp, *prev;
+
+
+    if (now == fdc_swept)
+	return;
+    fdc_swept = now;
+
+    for (fdcp = fdc_lru_tail;
+	 fdcp && now - fdcp->used >= fdcache_idle;
+	 fdcp = prev)
+    {
+	prev = fdcp->lru_prev;
+	if (fdcp->refs == 1)
+	    fdc_remove(fdcp, deadp);
+    }
+}
+
+
+FDCACHE *
+fdcache_get(const char *path,
+	    int *fdp,
+	    struct stat *sp)
+{
+    FDCACHE *fdcp, *old, *dead;
+    struct stat sb;
+    unsigned int h;
+    time_t now;
+    int fd;
+
+
+    *fdp = -1;
+    h = fdc_hash(path);
+    time(&now);
+    dead = NULL;
+
+    if (fdcache_size > 0)
+    {
+	pthread_once(&fdc_once, fdc_init);
+
+	pthread_mutex_lock(&fdc_mtx);
+	fdcp = fdc_lookup(path, h);
+	if (fdcp && now - fdcp->checked < fdcache_ttl)
+	    goto Hit;
+	pthread_mutex_unlock(&fdc_mtx);
+
+	/* Time to check that the file is still the same */
+	if (fdcp && stat(path, &sb) == 0)
+	{
+	    pthread_mutex_lock(&fdc_mtx);
+	    fdcp = fdc_lookup(path, h);
+	    if (fdcp &&
+		fdcp->sb.st_dev == sb.st_dev && fdcp->sb.st_ino == sb.st_ino &&
+		fdcp->sb.st_size == sb.st_size &&
+		fdcp->sb.st_mtime == sb.st_mtime)
+	    {
+		fdcp->sb = sb;
+		fdcp->checked = now;
+		goto Hit;
+	    }
+	    pthread_mutex_unlock(&fdc_mtx);
+	}
+    }
+
+    fd = s_open(path, O_RDONLY);
+    if (fd < 0)
+	return NULL;
+
+    if (fstat(fd, sp) < 0)
+    {
+	s_close(fd);
+	return NULL;
+    }
+
+    *fdp = fd;
+
+    if (fdcache_size <= 0)
+	return NULL;
+
+    pthread_mutex_lock(&fdc_mtx);
+    fdcache_misses++;
+
+    /* Only plain files that every kind of copy leaves alone are shared */
+    if (!S_ISREG(sp->st_mode) || !copyfd_shareable(sp->st_size))
+    {
+	pthread_mutex_unlock(&fdc_mtx);
+	return NULL;
+    }
+
+    A_NEW(fdcp);
+    fdcp->path = a_strdup(path, "fdcache path");
+    fdcp->hash = h;
+    fdcp->fd = fd;
+    fdcp->sb = *sp;
+    fdcp->checked = now;
+    fdcp->used = now;
+    fdcp->refs = 2;
+
+    if ((old = fdc_lookup(path, h)) != NULL)
+	fdc_remove(old, &dead);
+
+    fdcp->next = fdc_tab[h % FDCACHE_BUCKETS];
+    fdc_tab[h % FDCACHE_BUCKETS] = fdcp;
+    fdcp->lru_prev = fdcp->lru_next = NULL;
+    fdc_touch(fdcp);
+    fdc_count++;
+
+    while (fdc_count > fdcache_size && fdc_lru_tail != fdcp)
+	fdc_remove(fdc_lru_tail, &dead);
+
+    fdc_sweep(now, &dead);
+    pthread_mutex_unlock(&fdc_mtx);
+
+    fdc_free(dead);
+    return fdcp;
+
+  Hit:
+    fdcp->refs++;
+    fdcp->used = now;
+    fdc_touch(fdcp);
+    fdcache_hits++;
+    *fdp = fdcp->fd;
+    *sp = fdcp->sb;
+    fdc_sweep(now, &dead);
+    pthread_mutex_unlock(&fdc_mtx);
+
+    fdc_free(dead);
+    return fdcp;
+}
+
+
+void
+fdcache_close(FDCACHE *fdcp,
+	      int fd)
+{
+    FDCACHE *dead;
+    time_t now;
+
+
+    if (fdcp == NULL)
+    {
+	if (fd >= 0)
+	    s_close(fd);
+	return;
+    }
+
+    time(&now);
+    dead = NULL;
+
+    pthread_mutex_lock(&fdc_mtx);
+    fdcp->used = now;
+    if (--fdcp->refs == 0)
+	dead = fdcp;
+    else
+    {
+	if (!fdcp->dead)
+	    fdc_touch(fdcp);
+	fdc_sweep(now, &dead);
+    }
+    pthread_mutex_unlock(&fdc_mtx);
+
+    fdc_free(dead);
+}
+
+
+void
+fdcache_forget(const char *path)
+{
+    FDCACHE *fdcp, *dead;
+    unsigned int h;
+
+
+    if (fdcache_size <= 0)
+	return;
+
+    pthread_once(&fdc_once, fdc_init);
+
+    h = fdc_hash(path);
+    dead = NULL;
+
+    pthread_mutex_lock(&fdc_mtx);
+    if ((fdcp = fdc_lookup(path, h)) != NULL)
+	fdc_remove(fdcp, &dead);
+    pthread_mutex_unlock(&fdc_mtx);
+
+    fdc_free(dead);
+}
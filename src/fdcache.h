@@ -0,0 +1,68 @@
+/*
+** fdcache.h - Shared descriptors for files being downloaded
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef PFTPD_FDCACHE_H
+#define PFTPD_FDCACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+extern int fdcache_size;	/* Open files to keep, 0 = no cache */
+extern int fdcache_ttl;		/* Seconds before an entry is checked again */
+extern int fdcache_idle;	/* Seconds to keep unused files open */
+
+extern unsigned long fdcache_hits;
+extern unsigned long fdcache_misses;
+
+
+typedef struct fdcache
+{
+    struct fdcache *next;	/* Hash chain */
+    struct fdcache *lru_prev;
+    struct fdcache *lru_next;
+    unsigned int hash;
+    char *path;
+
+    int fd;
+    struct stat sb;
+    time_t checked;		/* Last time the file was stat()ed */
+    time_t used;		/* Last time it was handed out or given back */
+
+    int refs;
+    int dead;			/* Removed from the cache, close on release */
+} FDCACHE;
+
+
+/*
+** Open the file at 'path' for reading. '*fdp' is set to the
+** descriptor (or -1 with errno set) and '*sp' to its status.
+** Returns the entry if the descriptor is shared - it must then only
+** be read at explicit offsets - or NULL if it is private.
+*/
+extern FDCACHE *
+fdcache_get(const char *path,
+	    int *fdp,
+	    struct stat *sp);
+
+/* Give back a descriptor from fdcache_get() */
+extern void
+fdcache_close(FDCACHE *fdc,
+	      int fd);
+
+/* The file at 'path' is being changed or removed */
+extern void
+fdcache_forget(const char *path);
+
+#endif
@@ -0,0 +1,340 @@
+/*
+** filecache.c - Memory cache for small, frequently fetched files
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MLOCK
+#include <sys/mman.h>
+#endif
+
+#include "pftpd.h"
+
+#include "plib/aalloc.h"
+#include "plib/safeio.h"
+#include "filecache.h"
+
+
+int filecache_memory = 8*1024*1024;
+int filecache_max_file = 64*1024;
+int filecache_ttl = 2;
+
+unsigned long filecache_hits = 0;
+unsigned long filecache_misses = 0;
+
+
+/*
+** Entries are found by (real) path name and kept in LRU order.
+** An entry is trusted for filecache_ttl seconds, after that it is
+** only used if the file still has the same device, inode, size and
+** modification time. The cache itself holds one
+** reference to each entry, and every transfer using it another.
+*/
+#define FILECACHE_BUCKETS	1024
+
+static FILECACHE *fc_tab[FILECACHE_BUCKETS];
+static FILECACHE *fc_lru_head = NULL;	/* Most recently used */
+static FILECACHE *fc_lru_tail = NULL;
+static long fc_bytes = 0;
+
+static pthread_mutex_t fc_mtx;
+static pthread_once_t fc_once = PTHREAD_ONCE_INIT;
+
+
+static void
+fc_init(void)
+{
+    pthread_mutex_init(&fc_mtx, NULL);
+}
+
+
+static unsigned int
+fc_hash(const char *path)
+{
+    unsigned int h = 2166136261U;
+
+
+    while (*path)
+	h = (h ^ (unsigned char) *path++) * 16777619U;
+
+    return h;
+}
+
+
+static void
+fc_free(FILECACHE *fcp)
+{
+#ifdef HAVE_MLOCK
+    (void) munlock(fcp->data, fcp->size);
+#endif
+    a_free(fcp->data);
+    a_free(fcp->path);
+    a_free(fcp);
+}
+
+
+/* Must be called with fc_mtx held */
+static FILECACHE *
+fc_lookup(const char *path,
+	  unsigned int h)
+{
+    FILECACHE *fcp;
+
+
+    for (fcp = fc_tab[h % FILECACHE_BUCKETS]; fcp; fcp = fcp->next)
+	if (fcp->hash == h && strcmp(fcp->path, path) == 0)
+	    return fcp;
+
+    return NULL;
+}
+
+
+/* Move to the front of the LRU list. Must be called with fc_mtx held */
+static void
+fc_touch(FILECACHE *fcp)
+{
+    if (fc_lru_head == fcp)
+	return;
+
+    /* Unlink */
+    if (fcp->lru_prev)
+	fcp->lru_prev->lru_next = fcp->lru_next;
+    if (fcp->lru_next)
+	fcp->lru_next->lru_prev = fcp->lru_prev;
+    if (fc_lru_tail == fcp)
+	fc_lru_tail = fcp->lru_prev;
+
+    fcp->lru_prev = NULL;
+    fcp->lru_next = fc_lru_head;
+    if (fc_lru_head)
+	fc_lru_head->lru_prev = fcp;
+    fc_lru_head = fcp;
+    if (fc_lru_tail == NULL)
+	fc_lru_tail = fcp;
+}
+
+
+/* Take an entry out of the cache. Must be called with fc_mtx held */
+static void
+fc_remove(FILECACHE *fcp)
+{
+    FILECACHE **fcpp;
+
+
+    for (fcpp = &fc_tab[fcp->hash % FILECACHE_BUCKETS];
+	 *fcpp && *fcpp != fcp;
+	 fcpp = &(*fcpp)->next)
+	;
+    if (*fcpp)
+	*fcpp = fcp->next;
+
+    if (fcp->lru_prev)
+	fcp->lru_prev->lru_next = fcp->lru_next;
+    else
+	fc_lru_head = fcp->lru_next;
+    if (fcp->lru_next)
+	fcp->lru_next->lru_prev = fcp->lru_prev;
+    else
+	fc_lru_tail = fcp->lru_prev;
+
+    fc_bytes -= fcp->size;
+    fcp->dead = 1;
+
+    if (--fcp->refs == 0)
+	fc_free(fcp);
+}
+
+
+/* Read a whole (small) file into a new entry */
+static FILECACHE *
+fc_load(const char *path,
+	unsigned int h,
+	int fd,
+	const struct stat *sp)
+{
+    FILECACHE *fcp;
+    ssize_t n;
+    off_t got;
+
+
+    A_NEW(fcp);
+    fcp->data = a_malloc(sp->st_size > 0 ? sp->st_size : 1, "filecache data");
+
+    for (got = 0; got < sp->st_size; got += n)
+    {
+	n = s_pread(fd, fcp->data + got, sp->st_size - got, got);
+	if (n <= 0)
+	{
+	    a_free(fcp->data);
+	    a_free(fcp);
+	    return NULL;
+	}
+    }
+
+#ifdef HAVE_MLOCK
+    /* Best effort - RLIMIT_MEMLOCK may not allow it */
+    (void) mlock(fcp->data, sp->st_size);
+#endif
+
+    fcp->path = a_strdup(path, "filecache path");
+    fcp->hash = h;
+    fcp->dev = sp->st_dev;
+    fcp->ino = sp->st_ino;
+    fcp->size = sp->st_size;
+    fcp->mtime = sp->st_mtime;
+    fcp->refs = 1;
+    fcp->dead = 0;
+
+    return fcp;
+}
+
+
+FILECACHE *
+filecache_get(const char *path)
+{
+    FILECACHE *fcp;
+    unsigned int h;
+    time_t now;
+
+
+    if (filecache_memory <= 0)
+	return NULL;
+
+    pthread_once(&fc_once, fc_init);
+
+    h = fc_hash(path);
+    time(&now);
+
+    pthread_mutex_lock(&fc_mtx);
+    fcp = fc_lookup(path, h);
+    if (fcp && now - fcp->checked < filecache_ttl)
+    {
+	fcp->refs++;
+	fc_touch(fcp);
+	filecache_hits++;
+    }
+    else
+	fcp = NULL;
+    pthread_mutex_unlock(&fc_mtx);
+
+    return fcp;
+}
+
+
+FILECACHE *
+filecache_load(const char *path,
+	       int fd,
+	       const struct stat *sp)
+{
+    FILECACHE *fcp, *old;
+    unsigned int h;
+    time_t now;
+
+
+    if (filecache_memory <= 0 || !S_ISREG(sp->st_mode) ||
+	sp->st_size > filecache_max_file || sp->st_size > filecache_memory)
+	return NULL;
+
+    pthread_once(&fc_once, fc_init);
+
+    h = fc_hash(path);
+    time(&now);
+
+    /* Still the same file? */
+    pthread_mutex_lock(&fc_mtx);
+    fcp = fc_lookup(path, h);
+    if (fcp &&
+	fcp->dev == sp->st_dev && fcp->ino == sp->st_ino &&
+	fcp->size == sp->st_size && fcp->mtime == sp->st_mtime)
+    {
+	fcp->checked = now;
+	fcp->refs++;
+	fc_touch(fcp);
+	filecache_hits++;
+	pthread_mutex_unlock(&fc_mtx);
+	return fcp;
+    }
+    filecache_misses++;
+    pthread_mutex_unlock(&fc_mtx);
+
+    if ((fcp = fc_load(path, h, fd, sp)) == NULL)
+	return NULL;
+
+    fcp->checked = now;
+
+    pthread_mutex_lock(&fc_mtx);
+
+    if ((old = fc_lookup(path, h)) != NULL)
+	fc_remove(old);
+
+    fcp->next = fc_tab[h % FILECACHE_BUCKETS];
+    fc_tab[h % FILECACHE_BUCKETS] = fcp;
+    fcp->lru_prev = fcp->lru_next = NULL;
+    fc_touch(fcp);
+    fc_bytes += fcp->size;
+
+    while (fc_bytes > filecache_memory && fc_lru_tail != fcp)
+	fc_remove(fc_lru_tail);
+
+    fcp->refs++;
+    pthread_mutex_unlock(&fc_mtx);
+
+    if (debug)
+	fprintf(stderr, "filecache_load(%s): loaded %lld bytes (%ld cached)\n",
+		path, (long long) fcp->size, fc_bytes);
+
+    return fcp;
+}
+
+
+void
+filecache_release(FILECACHE *fcp)
+{
+    pthread_mutex_lock(&fc_mtx);
+    if (--fcp->refs == 0)
+	fc_free(fcp);
+    pthread_mutex_unlock(&fc_mtx);
+}
+
+
+void
+filecache_forget(const char *path)
+{
+    FILECACHE *fcp;
+    unsigned int h;
+
+
+    if (filecache_memory <= 0)
+	return;
+
+    pthread_once(&fc_once, fc_init);
+
+    h = fc_hash(path);
+
+    pthread_mutex_lock(&fc_mtx);
+    if ((fcp = fc_lookup(path, h)) != NULL)
+	fc_remove(fcp);
+    pthread_mutex_unlock(&fc_mtx);
+}
@@ -0,0 +1,74 @@
+/*
+** filecache.h - Memory cache for small, frequently fetched files
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef PFTPD_FILECACHE_H
+#define PFTPD_FILECACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+extern int filecache_memory;	/* Total bytes of file data, 0 = no cache */
+extern int filecache_max_file;	/* Largest file to cache */
+extern int filecache_ttl;	/* Seconds before an entry is checked again */
+
+extern unsigned long filecache_hits;
+extern unsigned long filecache_misses;
+
+
+typedef struct filecache
+{
+    struct filecache *next;	/* Hash chain */
+    struct filecache *lru_prev;
+    struct filecache *lru_next;
+    unsigned int hash;
+    char *path;
+
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t checked;		/* Last time the file was checked */
+
+    char *data;
+    int refs;
+    int dead;			/* Removed from the cache, free on release */
+} FILECACHE;
+
+
+/*
+** Look up the file at 'path', without checking it if the entry is
+** recent enough. Returns a referenced entry, or NULL.
+*/
+extern FILECACHE *
+filecache_get(const char *path);
+
+/*
+** The file at 'path' has been opened as 'fd' with status 'sp'.
+** Returns a referenced entry with its contents, or NULL if it
+** shouldn't be cached.
+*/
+extern FILECACHE *
+filecache_load(const char *path,
+	       int fd,
+	       const struct stat *sp);
+
+extern void
+filecache_release(FILECACHE *fcp);
+
+/* The file at 'path' is being changed or removed */
+extern void
+filecache_forget(const char *path);
+
+#endif
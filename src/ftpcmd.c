@@ -39,6 +39,7 @@
 #include "plib/safestr.h"
 #include "plib/support.h"
 #include "plib/str2.h"
+#include "plib/crlf.h"
 
 
 #define MAX_PATHNAMELEN 2048
@@ -288,6 +289,13 @@ cmd_port(FTPCLIENT *fp,
 	       &h1, &h2, &h3, &h4, &p1, &p2) != 6)
 	return 501;
 
+    ftpdata_discard(fp);
+    if (fp->pasv >= 0)
+    {
+	s_close(fp->pasv);
+	fp->pasv = -1;
+    }
+
 #ifdef AF_INET6
     if (SGFAM(fp->cp->rsin) == AF_INET6)
     {
@@ -355,6 +363,7 @@ cmd_port(FTPCLIENT *fp,
 	return 0;
     }
 
+    ftpdata_preconnect(fp);
     return 200;
 }
 
@@ -588,34 +597,6 @@ cmd_stat(FTPCLIENT *fp,
     }
 }
 
-static int
-ascii_size(const char *path)
-{
-    int fd, size, c;
-    FDBUF *fp;
-
-    
-    fd = s_open(path, O_RDONLY);
-    if (fd < 0)
-	return -1;
-    
-    fp = fd_create(fd, FDF_CRLF);
-
-    size = 0;
-    while ((c = fd_getc(fp)) != EOF)
-    {
-	++size;
-	if (c == '\n')
-	    ++size;
-    }
-
-    fd_destroy(fp);
-    s_close(fd);
-    
-    return size;
-}
-
-
 
 static int
 cmd_size(FTPCLIENT *fp,
@@ -646,11 +627,11 @@ cmd_size(FTPCLIENT *fp,
 
     if (fp->type == ftp_binary)
     {
-	fd_printf(fp->fd, "213 %d\n", sb.st_size);
+	fd_printf(fp->fd, "213 %lld\n", (long long) sb.st_size);
     }
     else
     {
-	int size = ascii_size(rpath);
+	off_t size = ascii_size(rpath);
 
 	if (size < 0)
 	{
@@ -659,7 +640,7 @@ cmd_size(FTPCLIENT *fp,
 	    return 0;
 	}
 	
-	fd_printf(fp->fd, "213 %d\n", size);
+	fd_printf(fp->fd, "213 %lld\n", (long long) size);
     }
     return 0;
 }
@@ -678,8 +659,12 @@ cmd_eprt(FTPCLIENT *fp,
     if (fp->pasv == -2) /* XXX: What is a valid error code? */
 	return 501;
 
+    ftpdata_discard(fp);
     if (fp->pasv != -1)
+    {
 	s_close(fp->pasv);
+	fp->pasv = -1;
+    }
 
     if (arg == NULL)
 	return 501;
@@ -750,6 +735,7 @@ cmd_eprt(FTPCLIENT *fp,
 	return 0;
     }
 
+    ftpdata_preconnect(fp);
     return 200;
 }
 
@@ -809,8 +795,12 @@ cmd_epsv(FTPCLIENT *fp,
     int net_fam;
 
     
-    if (fp->pasv != -1)
+    ftpdata_discard(fp);
+    if (fp->pasv >= 0)
+    {
 	s_close(fp->pasv);
+	fp->pasv = -1;
+    }
 
     if (arg && arg[0])
     {
@@ -877,6 +867,7 @@ cmd_pasv(FTPCLIENT *fp,
     if (arg != NULL)
 	return 501;
 
+    ftpdata_discard(fp);
     if (fp->pasv != -1)
     {
 	if (debug)
@@ -964,23 +955,26 @@ static int
 cmd_rest(FTPCLIENT *fp,
 	 char *arg)
 {
-    int rest;
+    long long rest;
+    char *end;
 
     
     if (arg == NULL)
 	return 501;
 
     /* XXX: Make sure there isn't a DATA transfer running already */
-    
-    rest = atoi(arg);
-    if (rest < 0)
+
+    errno = 0;
+    rest = strtoll(arg, &end, 10);
+    if (end == arg || *end != '\0' || rest < 0 || errno == ERANGE ||
+	(off_t) rest != rest)
 	return 501;
 
     fp->data_start = rest;
 
     fd_printf(fp->fd,
-	      "350 RESTarting at %lu, continue with transfer command\n",
-	      fp->data_start);
+	      "350 RESTarting at %lld, continue with transfer command\n",
+	      (long long) fp->data_start);
     return 0;
 }
 
@@ -997,42 +991,90 @@ cmd_abor(FTPCLIENT *fcp,
 }
 
 
-static int
-send_ascii_file(int client_fd,
-		int file_fd,
-		off_t start)
-{
-    FDBUF *cfd;
-    FDBUF *ffd;
-    int c;
-    
-
-    cfd = fd_create(client_fd, FDF_CRLF);
-    ffd = fd_create(file_fd, FDF_CRLF);
-
-    c = EOF;
-    while (start-- > 0 && (c = fd_getc(ffd)) != EOF)
-	;
-    if (c == EOF)
-    {
-	fd_destroy(cfd);
-	fd_destroy(ffd);
+#define ASCII_BUFSIZE (64*1024)
 
-	if (start == 0)
-	    return 0;
+/*
+** Copy 'from_fd' to 'to_fd' in TYPE A, translating the line ends
+** to CRLF if 'to_net' is set, else to LF. When sending, the first
+** 'start' bytes of the translated data are skipped, so a REST marker
+** counts the same bytes as SIZE. Returns the number of bytes written.
+*/
+static off_t
+send_ascii_file(int to_fd,
+		int from_fd,
+		off_t start,
+		int to_net,
+		volatile off_t *moved)
+{
+    char *ibuf, *obuf, *ip, *bp;
+    COPYFD_READER *rp;
+    struct stat sb;
+    ssize_t len;
+    size_t n;
+    off_t total, pos;
+    int lastcr;
+    
+
+    /* Read ahead in another thread while translating and writing */
+    rp = NULL;
+    if (!to_net || (fstat(from_fd, &sb) == 0 && sb.st_size > copyfd_small))
+	rp = copyfd_reader_start(from_fd, to_net ? 0 : -1, 0, ASCII_BUFSIZE);
+    
+    ibuf = rp ? NULL : a_malloc(ASCII_BUFSIZE, "send_ascii_file: ibuf");
+    obuf = a_malloc(to_net ? 2*ASCII_BUFSIZE : ASCII_BUFSIZE,
+		    "send_ascii_file: obuf");
+
+    /* Files are read at explicit offsets, the descriptor may be shared */
+    total = 0;
+    pos = 0;
+    lastcr = 0;
+    ip = ibuf;
+    while ((len = (rp ? copyfd_reader_get(rp, &ip) :
+		   to_net ? s_pread(from_fd, ip, ASCII_BUFSIZE, pos) :
+		   s_read(from_fd, ip, ASCII_BUFSIZE))) > 0)
+    {
+	pos += len;
+	if (to_net)
+	    n = crlf_encode(obuf, ip, len, &lastcr);
 	else
-	    return -1;
-    }
+	    n = crlf_decode(obuf, ip, len, &lastcr);
+	if (rp)
+	    copyfd_reader_put(rp);
 
-    while ((c = fd_getc(ffd)) != EOF)
-    {
-	if (fd_putc(cfd, c))
+	bp = obuf;
+	if (start > 0)
+	{
+	    if (start >= n)
+	    {
+		start -= n;
+		continue;
+	    }
+	    bp += start;
+	    n -= start;
+	    start = 0;
+	}
+	
+	if (s_write(to_fd, bp, n) != n)
+	{
+	    len = -1;
 	    break;
+	}
+
+	total += n;
+	if (moved)
+	    *moved += n;
     }
 
-    fd_destroy(cfd);
-    fd_destroy(ffd);
-    return 0;
+    if (rp)
+	copyfd_reader_end(rp);
+    else
+	a_free(ibuf);
+    a_free(obuf);
+
+    if (len < 0 || start > 0)
+	return -1;
+
+    return total;
 }
 
 
@@ -1040,39 +1082,223 @@ send_ascii_file(int client_fd,
 
 typedef struct
 {
+    FTPCLIENT *fp;
     char *vpath;
     int file_fd;
+    FDCACHE *fdc;	/* file_fd is shared, only read at explicit offsets */
+    FILECACHE *cache;	/* Sending from the hot-file cache, file_fd = -1 */
+    FANOUT *fanout;	/* Sharing disk reads with other transfers */
     int to_client;
+    time_t start;
 } FTPDATA_XFER;
 
 
+/* Send the cached file contents, starting at 'start' */
+static off_t
+send_cached_file(int to_fd,
+		 FILECACHE *fcp,
+		 off_t start,
+		 volatile off_t *moved)
+{
+    off_t total;
+    int n;
+
+
+    if (start > fcp->size)
+	return -1;
+
+    for (total = 0; start + total < fcp->size; total += n)
+    {
+	n = s_write(to_fd, fcp->data + start + total, fcp->size - start - total);
+	if (n <= 0)
+	    return -1;
+	if (moved)
+	    *moved += n;
+    }
+
+    return total;
+}
+
+
+/* Log and clean up after a transfer, returns the reply code */
+static int
+xfer_finish(FTPCLIENT *fp,
+	    FTPDATA_XFER *dp,
+	    off_t err)
+{
+    time_t t2;
+
+    
+    if (err >= 0)
+    {
+	time(&t2);
+	
+	xferlog_append(fp,
+		       (unsigned long) t2 - (unsigned long) dp->start,
+		       err,
+		       dp->vpath,
+		       dp->to_client);
+    }
+		   
+    if (debug)
+	fprintf(stderr, "xfer_thread: Stop (err=%lld, errno=%d)\n",
+		(long long) err, errno);
+
+    fp->data_start = 0;
+    if (dp->cache)
+	filecache_release(dp->cache);
+    if (dp->fanout)
+	fanout_release(dp->fanout);
+    fdcache_close(dp->fdc, dp->file_fd);
+    a_free(dp->vpath);
+    a_free(dp);
+    
+    return err < 0 ? 426 : 226;
+}
+
+
+/*
+** Called by the io_uring engine's finisher thread when a transfer is
+** done - never by a ring thread, so it may send the reply.
+*/
+static void
+xfer_done(void *vp,
+	  int err,
+	  off_t total)
+{
+    FTPDATA_XFER *dp = (FTPDATA_XFER *) vp;
+    FTPCLIENT *fp = dp->fp;
+
+    
+    if (err)
+    {
+	errno = err;
+	ftpdata_done(fp, xfer_finish(fp, dp, -1));
+    }
+    else
+	ftpdata_done(fp, xfer_finish(fp, dp, total));
+}
+
+
+/*
+** Hand a binary transfer over to the io_uring engine, if running.
+** Returns 0 if it was started.
+*/
+static int
+xfer_async(FTPCLIENT *fp,
+	   FTPDATA_XFER *dp)
+{
+    struct stat sb;
+    off_t pos;
+
+    
+    if (uxfer_threads <= 0 || fp->type != ftp_binary ||
+	dp->cache || dp->fanout)
+	return -1;
+
+    if (dp->to_client)
+    {
+	/* Let the normal path deal with restarting beyond EOF */
+	if (fstat(dp->file_fd, &sb) < 0 || fp->data_start >= sb.st_size)
+	    return -1;
+	
+	return uxfer_start(fp->data->fd, -1,
+			   dp->file_fd, fp->data_start,
+			   &fp->data->nbytes, xfer_done, dp);
+    }
+
+    pos = lseek(dp->file_fd, fp->data_start, SEEK_SET);
+    if (pos == (off_t) -1)
+	return -1;
+
+    return uxfer_start(dp->file_fd, pos,
+		       fp->data->fd, -1,
+		       &fp->data->nbytes, xfer_done, dp);
+}
+
+
+/*
+** Called while the data connection for a RETR is being set up: get
+** the disk going on the start of the file meanwhile.
+*/
+static void
+xfer_prepare(FTPCLIENT *fp,
+	     void *vp)
+{
+    FTPDATA_XFER *dp = (FTPDATA_XFER *) vp;
+
+
+    if (dp->file_fd < 0)
+	return;
+
+    /* A TYPE A restart offset doesn't map to the file directly */
+    if (fp->type == ftp_binary)
+	copyfd_prefetch(dp->file_fd, fp->data_start);
+    else if (fp->data_start == 0)
+	copyfd_prefetch(dp->file_fd, 0);
+}
+
+
 static int
 xfer_thread(FTPCLIENT *fp,
 	    void *vp)
 {
     FTPDATA_XFER *dp = (FTPDATA_XFER *) vp;
-    int err;
-    time_t t1, t2;
+    struct stat sb, sb2;
+    off_t err;
 
     if (debug)
-	fprintf(stderr, "xfer_thread: Start (data_start = %lu)\n",
-		fp->data_start);
+	fprintf(stderr, "xfer_thread: Start (data_start = %lld)\n",
+		(long long) fp->data_start);
+
+    dp->fp = fp;
+    time(&dp->start);
 
-    time(&t1);
+    /* No data connection could be built */
+    if (fp->data->fd < 0)
+	return xfer_finish(fp, dp, -1);
+
+    if (xfer_async(fp, dp) == 0)
+	return FTPDATA_PENDING;
     
     if (dp->to_client)
     {
 	/* RETR */
 
-	if (fp->type == ftp_binary)
-	    err = s_copyfd(fp->data->fd,
-			   dp->file_fd,
-			   &fp->data_start,
-			   0);
+	if (dp->cache)
+	    err = send_cached_file(fp->data->fd,
+				   dp->cache,
+				   fp->data_start,
+				   &fp->data->nbytes);
+	else if (dp->fanout)
+	    err = fanout_send(dp->fanout,
+			      fp->data->fd,
+			      dp->file_fd,
+			      &fp->data_start,
+			      &fp->data->nbytes);
+	else if (fp->type == ftp_binary)
+	    err = s_copyfd2(fp->data->fd,
+			    dp->file_fd,
+			    &fp->data_start,
+			    0,
+			    &fp->data->nbytes);
 	else
+	{
+	    if (fstat(dp->file_fd, &sb) < 0)
+		sb.st_size = -1;
+	    
 	    err = send_ascii_file(fp->data->fd,
 				  dp->file_fd,
-				  fp->data_start);
+				  fp->data_start,
+				  1,
+				  &fp->data->nbytes);
+
+	    /* A complete transfer gives us the TYPE A size for free */
+	    if (err >= 0 && fp->data_start == 0 && sb.st_size >= 0 &&
+		fstat(dp->file_fd, &sb2) == 0 &&
+		sb2.st_size == sb.st_size && sb2.st_mtime == sb.st_mtime)
+		ascii_size_learn(&sb, err);
+	}
     }
     else
     {
@@ -1083,15 +1309,18 @@ xfer_thread(FTPCLIENT *fp,
 	    err = 0;
 	    if (fp->data_start)
 	    {
-		err = lseek(dp->file_fd, fp->data_start, SEEK_SET);
-		if (err)
+		if (lseek(dp->file_fd, fp->data_start, SEEK_SET) == (off_t) -1)
+		{
+		    err = -1;
 		    goto End;
+		}
 	    }
 
-	    err = s_copyfd(dp->file_fd,
-			   fp->data->fd,
-			   NULL,
-			   0);
+	    err = s_copyfd2(dp->file_fd,
+			    fp->data->fd,
+			    NULL,
+			    0,
+			    &fp->data->nbytes);
 	}
 	else
 	{
@@ -1106,32 +1335,14 @@ xfer_thread(FTPCLIENT *fp,
 	    
 	    err = send_ascii_file(dp->file_fd,
 				  fp->data->fd,
-				  0);
+				  0,
+				  0,
+				  &fp->data->nbytes);
 	}
     }
 
   End:
-    if (err >= 0)
-    {
-	time(&t2);
-	
-	xferlog_append(fp,
-		       (unsigned long) t2 - (unsigned long) t1,
-		       err,
-		       dp->vpath,
-		       dp->to_client);
-    }
-		   
-    if (debug)
-	fprintf(stderr, "xfer_thread: Stop (err=%d, errno=%d)\n", err, errno);
-
-    fp->data_start = 0;
-    s_close(dp->file_fd);
-    a_free(dp->vpath);
-    a_free(dp);
-    
-    
-    return err < 0 ? 426 : 226;
+    return xfer_finish(fp, dp, err);
 }
 
 
@@ -1162,8 +1373,17 @@ cmd_retr(FTPCLIENT *fp,
     dbp = a_malloc(sizeof(*dbp), "FTPDATA_XFER");
     dbp->vpath = a_strdup(vpath, "FTPDATA_XFER vpath");
     dbp->to_client = 1;
+
+    /* Small binary files may come straight from memory */
+    dbp->fdc = NULL;
+    dbp->file_fd = -1;
+    dbp->cache = NULL;
+    dbp->fanout = NULL;
+    if (fp->type == ftp_binary &&
+	(dbp->cache = filecache_get(rpath)) != NULL)
+	goto Start;
     
-    dbp->file_fd = s_open(rpath, O_RDONLY);
+    dbp->fdc = fdcache_get(rpath, &dbp->file_fd, &sb);
     if (dbp->file_fd < 0)
     {
 	fd_printf(fp->fd, "550 %s: %s.\n", vpath, strerror(errno));
@@ -1172,28 +1392,35 @@ cmd_retr(FTPCLIENT *fp,
 	return 0;
     }
 
-    if (fstat(dbp->file_fd, &sb) < 0)
+    if (!S_ISREG(sb.st_mode))
     {
-	fd_printf(fp->fd, "550 %s: %s.\n", vpath, strerror(errno));
-	s_close(dbp->file_fd);
+	fd_printf(fp->fd, "550 %s: Not a file.\n", vpath);
+	fdcache_close(dbp->fdc, dbp->file_fd);
 	a_free(dbp->vpath);
 	a_free(dbp);
 	return 0;
     }
 
-    if (!S_ISREG(sb.st_mode))
+    if (fp->type == ftp_binary &&
+	(dbp->cache = filecache_load(rpath, dbp->file_fd, &sb)) != NULL)
     {
-	fd_printf(fp->fd, "550 %s: Not a file.\n", vpath);
-	s_close(dbp->file_fd);
-	a_free(dbp->vpath);
-	a_free(dbp);
-	return 0;
+	fdcache_close(dbp->fdc, dbp->file_fd);
+	dbp->fdc = NULL;
+	dbp->file_fd = -1;
     }
+    else if (fp->type == ftp_binary)
+	dbp->fanout = fanout_get(&sb);
 
-    if (ftpdata_start(fp, vpath, xfer_thread, (void *) dbp) == NULL)
+  Start:
+    if (ftpdata_start(fp, vpath, xfer_prepare, xfer_thread,
+		      (void *) dbp) == NULL)
     {
 	fd_puts(fp->fd, "425 Can not build data connection.\n");
-	s_close(dbp->file_fd);
+	if (dbp->cache)
+	    filecache_release(dbp->cache);
+	if (dbp->fanout)
+	    fanout_release(dbp->fanout);
+	fdcache_close(dbp->fdc, dbp->file_fd);
 	a_free(dbp->vpath);
 	a_free(dbp);
     }
@@ -1230,6 +1457,9 @@ cmd_stor(FTPCLIENT *fp,
 	return 0;
     }
 
+    filecache_forget(rpath);
+    fdcache_forget(rpath);
+
     dbp = a_malloc(sizeof(*dbp), "FTPDATA_XFER");
     dbp->vpath = a_strdup(vpath, "FTPDATA_XFER vpath");
     dbp->to_client = 0;
@@ -1261,7 +1491,7 @@ cmd_stor(FTPCLIENT *fp,
 	return 0;
     }
 
-    if (ftpdata_start(fp, vpath, xfer_thread, (void *) dbp) == NULL)
+    if (ftpdata_start(fp, vpath, NULL, xfer_thread, (void *) dbp) == NULL)
     {
 	fd_puts(fp->fd, "425 Can not build data connection.\n");
 	s_close(dbp->file_fd);
@@ -1302,6 +1532,9 @@ cmd_appe(FTPCLIENT *fp,
 	return 0;
     }
 
+    filecache_forget(rpath);
+    fdcache_forget(rpath);
+
     dbp = a_malloc(sizeof(*dbp), "FTPDATA_XFER");
     dbp->vpath = a_strdup(vpath, "FTPDATA_XFER vpath");
     dbp->to_client = 0;
@@ -1310,6 +1543,7 @@ cmd_appe(FTPCLIENT *fp,
     if (dbp->file_fd < 0)
     {
 	fd_printf(fp->fd, "550 %s: %s.\n", vpath, strerror(errno));
+	a_free(dbp->vpath);
 	a_free(dbp);
 	return 0;
     }
@@ -1318,6 +1552,7 @@ cmd_appe(FTPCLIENT *fp,
     {
 	fd_printf(fp->fd, "550 %s: %s.\n", vpath, strerror(errno));
 	s_close(dbp->file_fd);
+	a_free(dbp->vpath);
 	a_free(dbp);
 	return 0;
     }
@@ -1326,14 +1561,16 @@ cmd_appe(FTPCLIENT *fp,
     {
 	fd_printf(fp->fd, "550 %s: Not a file.\n", vpath);
 	s_close(dbp->file_fd);
+	a_free(dbp->vpath);
 	a_free(dbp);
 	return 0;
     }
 
-    if (ftpdata_start(fp, vpath, xfer_thread, (void *) dbp) == NULL)
+    if (ftpdata_start(fp, vpath, NULL, xfer_thread, (void *) dbp) == NULL)
     {
 	fd_puts(fp->fd, "425 Can not build data connection.\n");
 	s_close(dbp->file_fd);
+	a_free(dbp->vpath);
 	a_free(dbp);
     }
     
@@ -1360,6 +1597,8 @@ cmd_dele(FTPCLIENT *fp,
     if (rpath == NULL)
 	return 501;
 
+    filecache_forget(rpath);
+    fdcache_forget(rpath);
     if (unlink(rpath))
     {
 	fd_printf(fp->fd, "550 %s: %s.\n", vpath, strerror(errno));
@@ -1522,6 +1761,10 @@ cmd_rnto(FTPCLIENT *fp,
     if (rpath == NULL)
 	return 501;
 
+    filecache_forget(fp->rnfr);
+    filecache_forget(rpath);
+    fdcache_forget(fp->rnfr);
+    fdcache_forget(rpath);
     if (rename(fp->rnfr, rpath))
     {
 	a_free(fp->rnfr);
@@ -1643,6 +1886,7 @@ ftpcmd_parse(FTPCLIENT *fp,
 	if (fp->errors > max_errors)
 	{
 	    fd_puts(fd, "500 Too many errors\n");
+	    peer_error(&fp->cp->rsin);
 	    return 500;
 	}
 	
@@ -1714,6 +1958,7 @@ ftpcmd_parse(FTPCLIENT *fp,
 	    if (fp->errors > max_errors)
 	    {
 		fd_puts(fd, "500 Too many errors\n");
+		peer_error(&fp->cp->rsin);
 		return -1;
 	    }
 	}
@@ -1726,6 +1971,7 @@ ftpcmd_parse(FTPCLIENT *fp,
     if (fp->errors > max_errors)
     {
 	fd_puts(fd, "500 Too many errors\n");
+	peer_error(&fp->cp->rsin);
 	return -1;
     }
 
@@ -1769,6 +2015,7 @@ ftpcmd_create(CLIENT *cp)
     fp->pass = NULL;
 
     fp->pasv = -1;
+    fp->preconn = NULL;
 
     fp->data = NULL;
     fp->data_start = 0;
@@ -1798,6 +2045,7 @@ ftpcmd_destroy(FTPCLIENT *fcp)
 
     if (fcp->pasv != -1)
 	s_close(fcp->pasv);
+    ftpdata_discard(fcp);
     
     a_free(fcp->cwd);
     a_free(fcp->pass);
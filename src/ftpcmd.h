@@ -46,6 +46,7 @@ typedef struct FTPCLIENT
     
     int pasv;
     struct sockaddr_gen port;
+    FTPDATA_PRECONN *preconn;	/* Already connecting to 'port' */
 
     FTPDATA *data;
     
@@ -18,6 +18,7 @@
 #include <syslog.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -36,45 +37,99 @@
 #include "plib/safestr.h"
 #include "plib/support.h"
 #include "plib/timeout.h"
+#include "plib/tpool.h"
 
 #define PASV_TIMEOUT 120
 
-static void *
-ftpdata_thread(void *vp)
+/* How often to check the progress of a transfer */
+#define FTPDATA_CHECK_INTERVAL 5
+
+int data_stall_timeout = 5*60;
+int data_min_rate = 0;
+int data_rate_window = 60;
+int data_connect_timeout = 60;
+int data_preconnect = 0;
+
+int data_workers_min = 0;
+int data_workers_max = 0;	/* 0 = one new thread per transfer */
+int data_workers_idle = 60;
+
+TPOOL *ftpdata_pool = NULL;
+
+
+/*
+** Called from the timeout thread. Aborts the transfer if no bytes
+** have moved for data_stall_timeout seconds, or if fewer than
+** data_min_rate bytes/second moved over the last data_rate_window.
+*/
+static void
+ftpdata_check(void *vp)
 {
-    FTPCLIENT *fcp = (FTPCLIENT *) vp;
-    int code;
-    FTPDATA_RES *res;
+    FTPDATA *fdp = (FTPDATA *) vp;
+    const char *why = NULL;
+    time_t now;
+    off_t n;
 
 
-    pthread_mutex_lock(&fcp->data->mtx);
-    fcp->data->state = 1;
-    pthread_mutex_unlock(&fcp->data->mtx);
-    
-    if (debug)
-	fprintf(stderr, "ftpdata_thread: start\n");
+    time(&now);
+    n = fdp->nbytes;
 
-    code = fcp->data->handler(fcp, fcp->data->vp);
+    if (n != fdp->last_bytes)
+    {
+	fdp->last_bytes = n;
+	fdp->last_move = now;
+    }
+    else if (data_stall_timeout > 0 &&
+	     now - fdp->last_move >= data_stall_timeout)
+	why = "stalled";
 
-    if (debug)
-	fprintf(stderr, "ftpdata_thread: handler called\n");
+    if (why == NULL && data_min_rate > 0 && now > fdp->win_start &&
+	now - fdp->win_start >= data_rate_window)
+    {
+	if ((n - fdp->win_bytes) / (now - fdp->win_start) < data_min_rate)
+	    why = "too slow";
 
-    A_NEW(res);
-    res->code = code;
-    
-    /* Signal that we are done */
-    pthread_mutex_lock(&fcp->data->mtx);
-    code = s_close(fcp->data->fd);
-    if (code < 0)
-	syslog(LOG_ERR, "ftpdata_thread: close: %m");
-	    
-    fcp->data->fd = -1;
-    fcp->data->state = 3; 
-    
-    pthread_mutex_unlock(&fcp->data->mtx);
-    pthread_cond_broadcast(&fcp->data->cv);
+	fdp->win_bytes = n;
+	fdp->win_start = now;
+    }
+
+    if (why)
+    {
+	syslog(LOG_NOTICE, "data transfer %s after %lld bytes - aborting",
+	       why, (long long) n);
+	ftpdata_abort(fdp);
+	return;
+    }
+
+    timeout_reset(fdp->tp, FTPDATA_CHECK_INTERVAL);
+}
+
+
+/*
+** Finish a data session: close the connection, send the final reply
+** and wake up anyone waiting for it. Called by the FTPDATA thread, or
+** by whoever completes a transfer that the handler left FTPDATA_PENDING.
+*/
+void
+ftpdata_done(FTPCLIENT *fcp,
+	     int code)
+{
+    FTPDATA *fdp = fcp->data;
+
+
+    if (fdp->tp)
+    {
+	timeout_destroy(fdp->tp);
+	fdp->tp = NULL;
+    }
+
+    pthread_mutex_lock(&fdp->mtx);
+    if (fdp->fd >= 0 && s_close(fdp->fd) < 0)
+	syslog(LOG_ERR, "ftpdata_done: close: %m");
+    fdp->fd = -1;
+    pthread_mutex_unlock(&fdp->mtx);
     
-    switch (res->code)
+    switch (code)
     {
       case 0:
 	break;
@@ -96,38 +151,454 @@ ftpdata_thread(void *vp)
 	fd_printf(fcp->fd, "%d ???\n", code);
     }
     
+    /* Signal that we are done - last, since the control connection
+       thread may free everything as soon as it sees this */
+    pthread_mutex_lock(&fdp->mtx);
+    fdp->code = code;
+    fdp->state = 3; 
+    pthread_mutex_unlock(&fdp->mtx);
+    pthread_cond_broadcast(&fdp->cv);
+}
+
+
+/*
+** Wait for the client to connect to our passive listener. The kernel
+** has been completing connections on it since PASV/EPSV, so this
+** usually just picks up one that is already waiting. Waits in short
+** slices so that an ABOR doesn't have to wait for PASV_TIMEOUT.
+*/
+static int
+ftpdata_accept(FTPCLIENT *fcp,
+	       FTPDATA *fdp)
+{
+    struct sockaddr_gen sin;
+    socklen_t slen;
+    int fd, res, waited, state;
+    
+
     if (debug)
-	fprintf(stderr, "ftpdata_thread: Stop\n");
+	fprintf(stderr, "ftpdata_accept: Waiting for PASV connection\n");
+	
+    for (waited = 0; ; waited++)
+    {
+	pthread_mutex_lock(&fdp->mtx);
+	state = fdp->state;
+	pthread_mutex_unlock(&fdp->mtx);
+	
+	if (state >= 2)
+	{
+	    /* Aborted */
+	    s_close(fdp->listen_fd);
+	    fdp->listen_fd = -1;
+	    return -1;
+	}
+	
+	if (waited >= PASV_TIMEOUT)
+	{
+	    errno = ETIMEDOUT;
+	    goto Fail;
+	}
+	
+	res = s_waitfd(fdp->listen_fd, 1);
+	if (res < 0)
+	    goto Fail;
+	if (res > 0)
+	    break;
+    }
+    
+    slen = sizeof(sin);
+    fd = s_accept(fdp->listen_fd, (struct sockaddr *) &sin, &slen);
+    if (fd < 0)
+	goto Fail;
+	
+    if (debug)
+    {
+	char buf1[256];
+	
+	fprintf(stderr, "Got passive connection from:\n");
+	fprintf(stderr, "\tsin_family = %d\n", SGFAM(sin));
+	fprintf(stderr, "\tsin_addr   = %s\n",
+		s_inet_ntox(&sin, buf1, sizeof(buf1)));
+	fprintf(stderr, "\tsin_port   = %d\n",
+		ntohs(SGPORT(sin)));
+    }
+	
+    /* Make sure the connection came from the same host as the
+       control connection was from */
+    
+    if (SGSIZE(sin) != SGSIZE(fcp->cp->rsin) ||
+	memcmp(SGADDRP(sin),
+	       SGADDRP(fcp->cp->rsin),
+	       SGSIZE(sin)) != 0)
+    {
+	char buf1[256], buf2[256];
+	
+	syslog(LOG_WARNING,
+	       "ftpdata_accept: Foreign PASV FTP-DATA from %s:%d (control %s:%d) - rejected\n",
+	       s_inet_ntox(&sin, buf2, sizeof(buf2)),
+	       ntohs(SGPORT(sin)),
+	       s_inet_ntox(&fcp->cp->rsin, buf1, sizeof(buf1)),
+	       ntohs(SGPORT(fcp->cp->rsin)));
+	
+	s_close(fd);
+	fd = -1;
+    }
+    
+    /* Shut down the listening socket for the passive connection */
+    s_close(fdp->listen_fd);
+    fdp->listen_fd = -1;
+    return fd;
+    
+  Fail:
+    syslog(LOG_ERR, "ftpdata_accept: accept(Passive FTP-DATA): %m");
+    
+    s_close(fdp->listen_fd);
+    fdp->listen_fd = -1;
+    return -1;
+}
+
+
+/*
+** Active connections are set up without any global lock. The
+** source port is either a fresh port-20 socket from the rpad helper
+** or an ephemeral port, bound with SO_REUSEADDR, so concurrent
+** sessions don't get in each other's way, and a client that never
+** answers only holds up its own session for data_connect_timeout.
+*/
+static int
+ftpdata_socket(FTPCLIENT *fcp)
+{
+    struct sockaddr_gen sin;
+    socklen_t slen;
+    int fd;
+    
+
+    SGINIT(sin);
+    slen = SGSOCKSIZE(sin);
+    
+    /* Get the local address that the FTP client connected to */
+    if (getsockname(fcp->cp->fd, (struct sockaddr *) &sin, &slen) != 0)
+    {
+	syslog(LOG_WARNING, "ftpdata_socket: getsockname: %m");
+	return -1;
+    }
+    
+    fd = rpa_rresvport(rpap, &sin);
+    if (fd < 0)
+	fd = create_bind_socket(&sin, 0);
+    
+    if (fd < 0)
+	syslog(LOG_ERR, "ftpdata_socket: socket/bind(Active FTP-DATA): %m");
+
+    return fd;
+}
+
+
+static void
+ftpdata_connect_failed(FTPDATA *fdp,
+		       int fd)
+{
+    char buf1[256];
+
+
+    syslog(LOG_WARNING, "ftpdata_connect: connect(%d,%s:%d): %m",
+	   fd,
+	   s_inet_ntox(&fdp->port, buf1, sizeof(buf1)),
+	   ntohs(SGPORT(fdp->port)));
+}
+
+
+/* Get an active connection going, unless PORT/EPRT already did */
+static void
+ftpdata_connect_start(FTPCLIENT *fcp,
+		      FTPDATA *fdp)
+{
+    int fd;
+    
+
+    if (fdp->fd >= 0)
+	return;
+    
+    fd = ftpdata_socket(fcp);
+    if (fd < 0)
+	return;
+
+    if (s_connect_start(fd,
+			(struct sockaddr *) &fdp->port,
+			SGSOCKSIZE(fdp->port)) < 0)
+    {
+	ftpdata_connect_failed(fdp, fd);
+	s_close(fd);
+	return;
+    }
+
+    /* Let ftpdata_abort() get at it while we are connecting */
+    pthread_mutex_lock(&fdp->mtx);
+    if (fdp->state >= 2)
+    {
+	pthread_mutex_unlock(&fdp->mtx);
+	s_close(fd);
+	return;
+    }
+    fdp->fd = fd;
+    pthread_mutex_unlock(&fdp->mtx);
+}
+
+
+/* Wait for the connect to finish, returns the socket or -1 */
+static int
+ftpdata_connect(FTPCLIENT *fcp,
+		FTPDATA *fdp)
+{
+    int fd, retry;
+    
+
+    for (retry = fdp->preconnected; ; retry = 0)
+    {
+	fd = fdp->fd;
+	if (fd < 0)
+	    return -1;
+	
+	if (s_connect_wait(fd, data_connect_timeout) == 0)
+	    return fd;
+
+	if (retry)
+	{
+	    if (debug)
+		fprintf(stderr, "ftpdata_connect: pre-connect failed: %s\n",
+			strerror(errno));
+	}
+	else
+	    ftpdata_connect_failed(fdp, fd);
+	
+	pthread_mutex_lock(&fdp->mtx);
+	fdp->fd = -1;
+	pthread_mutex_unlock(&fdp->mtx);
+	s_close(fd);
+
+	if (!retry)
+	    return -1;
+	
+	/* Perhaps the client wasn't listening yet - try again */
+	ftpdata_connect_start(fcp, fdp);
+    }
+}
+
+
+/* Called from the timeout thread when a pre-connection went unused */
+static void
+ftpdata_preconn_expire(void *vp)
+{
+    FTPDATA_PRECONN *pcp = (FTPDATA_PRECONN *) vp;
+    int fd;
+
+
+    pthread_mutex_lock(&pcp->mtx);
+    fd = pcp->fd;
+    pcp->fd = -1;
+    pthread_mutex_unlock(&pcp->mtx);
+
+    if (debug)
+	fprintf(stderr, "ftpdata_preconn_expire: closing fd %d\n", fd);
+    
+    if (fd >= 0)
+	s_close(fd);
+}
+
+
+/*
+** Connecting at PORT/EPRT time instead of at the transfer command
+** saves a round trip per transfer. The client is already listening
+** when it sends PORT, and if it wasn't the transfer simply connects
+** again.
+*/
+void
+ftpdata_preconnect(FTPCLIENT *fcp)
+{
+    FTPDATA_PRECONN *pcp;
+    int fd;
+
     
-    return res;
+    ftpdata_discard(fcp);
+    
+    if (data_preconnect <= 0 || !SGPORT(fcp->port))
+	return;
+
+    fd = ftpdata_socket(fcp);
+    if (fd < 0)
+	return;
+
+    if (s_connect_start(fd,
+			(struct sockaddr *) &fcp->port,
+			SGSOCKSIZE(fcp->port)) < 0)
+    {
+	if (debug)
+	    fprintf(stderr, "ftpdata_preconnect: connect: %s\n",
+		    strerror(errno));
+	s_close(fd);
+	return;
+    }
+
+    A_NEW(pcp);
+    pthread_mutex_init(&pcp->mtx, NULL);
+    pcp->fd = fd;
+    pcp->tp = timeout_create(data_preconnect, ftpdata_preconn_expire, pcp);
+    fcp->preconn = pcp;
 }
 
 
+/* Take over the pre-connected socket, returns -1 if there is none */
+static int
+ftpdata_preconn_take(FTPCLIENT *fcp)
+{
+    FTPDATA_PRECONN *pcp = fcp->preconn;
+    int fd;
+
+
+    if (pcp == NULL)
+	return -1;
+
+    fcp->preconn = NULL;
+    
+    /* Waits for a running ftpdata_preconn_expire() */
+    timeout_destroy(pcp->tp);
+    
+    fd = pcp->fd;
+    pthread_mutex_destroy(&pcp->mtx);
+    a_free(pcp);
+    
+    return fd;
+}
 
-static pthread_mutex_t ftpdata_mtx;
 
 void
-ftpdata_init(void)
+ftpdata_discard(FTPCLIENT *fcp)
+{
+    int fd;
+
+
+    if ((fd = ftpdata_preconn_take(fcp)) >= 0)
+	s_close(fd);
+}
+
+
+/*
+** Build the data connection, in the FTPDATA thread so the control
+** connection can go on reading commands meanwhile. The connection
+** comes up while the handler's prepare function runs - a passive
+** one is completed by the kernel, an active one is nonblocking.
+** Returns the socket, or -1 if there is none.
+*/
+static int
+ftpdata_setup(FTPCLIENT *fcp,
+	      FTPDATA *fdp)
+{
+    int fd;
+    int one = 1;
+
+
+    if (fdp->listen_fd < 0)
+	ftpdata_connect_start(fcp, fdp);
+
+    if (fdp->prepare)
+	fdp->prepare(fcp, fdp->vp);
+    
+    if (fdp->listen_fd >= 0)
+	fd = ftpdata_accept(fcp, fdp);
+    else
+	fd = ftpdata_connect(fcp, fdp);
+
+    if (fd < 0)
+	return -1;
+    
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *) &one, sizeof(one)))
+	syslog(LOG_WARNING, "ftpdata_setup: setsockopt(TCP_NODELAY): %m");
+    
+#ifdef IPTOS_THROUGHPUT
+    {
+	int tos = IPTOS_THROUGHPUT;
+	if (setsockopt(fd, IPPROTO_IP, IP_TOS, (void *) &tos, sizeof(tos)))
+	    syslog(LOG_WARNING, "ftpdata_setup: setsockopt(IPTOS_THROUGHPUT): %m");
+    }
+#endif	
+#ifdef TCP_NOPUSH
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, (void *) &one, sizeof(one)))
+	syslog(LOG_WARNING, "ftpdata_setup: setsockopt(TCP_NOPUSH): %m");
+#endif
+
+    pthread_mutex_lock(&fdp->mtx);
+    fdp->fd = fd;
+    if (fdp->state >= 2)
+    {
+	/* Aborted while connecting */
+	fdp->fd = -1;
+	pthread_mutex_unlock(&fdp->mtx);
+	s_close(fd);
+	return -1;
+    }
+    pthread_mutex_unlock(&fdp->mtx);
+
+    fdp->last_move = fdp->win_start = time(NULL);
+    if (data_stall_timeout > 0 || data_min_rate > 0)
+	fdp->tp = timeout_create(FTPDATA_CHECK_INTERVAL, ftpdata_check, fdp);
+    
+    return fd;
+}
+
+
+static void *
+ftpdata_thread(void *vp)
 {
-    pthread_mutex_init(&ftpdata_mtx, NULL);
+    FTPCLIENT *fcp = (FTPCLIENT *) vp;
+    FTPDATA *fdp = fcp->data;
+    int code, fd;
+
+
+    /* May already have been aborted while waiting for a worker */
+    pthread_mutex_lock(&fdp->mtx);
+    if (fdp->state == 0)
+	fdp->state = 1;
+    pthread_mutex_unlock(&fdp->mtx);
+    
+    if (debug)
+	fprintf(stderr, "ftpdata_thread: start\n");
+
+    fd = ftpdata_setup(fcp, fdp);
+    
+    /* Without a connection the handler only cleans up */
+    code = fdp->handler(fcp, fdp->vp);
+
+    if (debug)
+	fprintf(stderr, "ftpdata_thread: handler called (code=%d)\n", code);
+
+    if (fd < 0)
+	code = 425;
+    
+    if (code != FTPDATA_PENDING)
+	ftpdata_done(fcp, code);
+    
+    if (debug)
+	fprintf(stderr, "ftpdata_thread: Stop\n");
+    
+    return NULL;
 }
 
 
+
 /*
-** XXX: Can only have one active FTPDATA process in use between
-** XXX: bind() and connect() - per FTP listen source address
+** Only checks the request and starts the FTPDATA thread - the data
+** connection is accepted or connected there, so a slow client never
+** keeps the control connection from reading ABOR, STAT or NOOP.
 */
 FTPDATA *
 ftpdata_start(FTPCLIENT *fcp,
 	      const char *reason,
+	      void (*prepare)(FTPCLIENT *fcp, void *vp),
 	      int (*handler)(FTPCLIENT *fcp, void *vp),
 	      void *vp)
 {
-    int err, attempt;
-    int one = 1;
+    int err;
     FTPDATA *fdp;
-    struct sockaddr_gen sin;
-    socklen_t slen;
     
     
     if (debug)
@@ -141,160 +612,64 @@ ftpdata_start(FTPCLIENT *fcp,
 	return NULL;
     }
     
+    if (fcp->pasv == -1 && !SGPORT(fcp->port))
+    {
+	syslog(LOG_ERR, "ftpdata_start: Internal Error - No FTP-DATA port assigned");
+	return NULL;
+    }
 
     A_NEW(fdp);
     fdp->state = 0;
+    fdp->fd = -1;
+    fdp->prepare = prepare;
     fdp->handler = handler;
     fdp->vp = vp;
 
-    fd_printf(fcp->fd,
-	      "150 Opening %s mode data connection for %s.\n",
-	      fcp->type == ftp_binary ? "BINARY" : "ASCII",
-	      reason);
-
+    /* The FTPDATA thread takes over the passive listener */
+    fdp->listen_fd = fcp->pasv;
     if (fcp->pasv != -1)
-    {
-	/* Passive connection */
-
-	if (debug)
-	    fprintf(stderr, "ftpdata_start: Waiting for PASV connection\n");
-	
-	slen = sizeof(sin);
-	fdp->fd = s_accept2(fcp->pasv, (struct sockaddr *) &sin, &slen, PASV_TIMEOUT);
-	
-	if (fdp->fd < 0)
-	{
-	    syslog(LOG_ERR, "ftpdata_start: accept(Passive FTP-DATA): %m");
-
-	    s_close(fcp->pasv);
-	    fcp->pasv = -1;
-	    
-	    a_free(fdp);
-	    return NULL;
-	}
-	
-	if (debug)
-	{
-	    char buf1[256];
-	    
-	    fprintf(stderr, "Got passive connection from:\n");
-	    fprintf(stderr, "\tsin_family = %d\n", SGFAM(sin));
-	    fprintf(stderr, "\tsin_addr   = %s\n",
-		    s_inet_ntox(&sin, buf1, sizeof(buf1)));
-	    fprintf(stderr, "\tsin_port   = %d\n",
-		    ntohs(SGPORT(sin)));
-	}
-	
-	/* Make sure the connection came from the same host as the
-	   control connection was from */
-
-	if (SGSIZE(sin) != SGSIZE(fcp->cp->rsin) ||
-	    memcmp(SGADDRP(sin),
-		   SGADDRP(fcp->cp->rsin),
-		   SGSIZE(sin)) != 0)
-	{
-	    char buf1[256], buf2[256];
-	    
-	    syslog(LOG_WARNING,
-		   "ftpdata_start: Foreign PASV FTP-DATA from %s:%d (control %s:%d) - rejected\n",
-		   s_inet_ntox(&sin, buf2, sizeof(buf2)),
-		   ntohs(SGPORT(sin)),
-		   s_inet_ntox(&fcp->cp->rsin, buf1, sizeof(buf1)),
-		   ntohs(SGPORT(fcp->cp->rsin)));
-
-	    s_close(fdp->fd);
-	    a_free(fdp);
-	    return NULL;
-	}
-
-	/* Shut down the listening socket for the passive connection */
-	s_close(fcp->pasv);
 	fcp->pasv = -1;
-    }
     else
     {
-	/* Active connection */
-	
-	if (!SGPORT(fcp->port))
-	{
-	    syslog(LOG_ERR, "ftpdata_start: Internal Error - No FTP-DATA port assigned");
-	    
-	    a_free(fdp);
-	    return NULL;
-	}
-	
-	SGINIT(sin);
-	slen = SGSOCKSIZE(sin);
-
-	/* Get the local address that the FTP client connected to */
-	if (getsockname(fcp->cp->fd, (struct sockaddr *) &sin, &slen) != 0)
-	{
-	    syslog(LOG_WARNING, "ftpdata_start: getsockname: %m");
-	    a_free(fdp);
-	    return NULL;
-	}
+	fdp->port = fcp->port;
+	fdp->fd = ftpdata_preconn_take(fcp);
+	fdp->preconnected = (fdp->fd >= 0);
+    }
 
-	pthread_mutex_lock(&ftpdata_mtx);
-	
-	fdp->fd = rpa_rresvport(rpap, &sin);
-	if (fdp->fd < 0)
-	    fdp->fd = create_bind_socket(&sin, 0);
+    fd_printf(fcp->fd,
+	      "150 Opening %s mode data connection for %s.\n",
+	      fcp->type == ftp_binary ? "BINARY" : "ASCII",
+	      reason);
 
-	if (fdp->fd < 0)
-	{
-	    syslog(LOG_ERR, "ftpdata_start: socket/bind(Active FTP-DATA): %m");
-	    
-	    pthread_mutex_unlock(&ftpdata_mtx);
-	    a_free(fdp);
-	    return NULL;
-	}
-	    
-	if (s_connect(fdp->fd,
-		      (struct sockaddr *) &fcp->port,
-		      SGSOCKSIZE(fcp->port)) < 0)
-	{
-	    char buf1[256];
-	    
-	    
-	    syslog(LOG_WARNING, "ftpdata_start: connect(%d,%s:%d): %m",
-		   fdp->fd,
-		   s_inet_ntox(&fcp->port, buf1, sizeof(buf1)),
-		   ntohs(SGPORT(fcp->port)));
-	    
-	    s_close(fdp->fd);
-	    pthread_mutex_unlock(&ftpdata_mtx);
-	    
-	    a_free(fdp);
-	    return NULL;
-	}
-    }
+    fcp->data = fdp;
 
-    pthread_mutex_unlock(&ftpdata_mtx);
+    fdp->nbytes = 0;
+    fdp->last_bytes = fdp->win_bytes = 0;
+    fdp->tp = NULL;
     
-    if (setsockopt(fdp->fd, IPPROTO_TCP, TCP_NODELAY, (void *) &one, sizeof(one)))
-	syslog(LOG_WARNING, "ftpdata_start: setsockopt(TCP_NODELAY): %m");
-    
-#ifdef IPTOS_THROUGHPUT
+    /*
+    ** Hand it to an already running worker, if we have a pool. Never
+    ** wait for room in its queue here - this may be an event thread
+    ** serving other clients - use a thread of its own instead.
+    */
+    err = 0;
+    fdp->pooled = (ftpdata_pool != NULL);
+    if (!fdp->pooled ||
+	tpool_tryput(ftpdata_pool, ftpdata_thread, (void *) fcp) < 0)
     {
-	int tos = IPTOS_THROUGHPUT;
-	if (setsockopt(fdp->fd, IPPROTO_IP, IP_TOS, (void *) &tos, sizeof(tos)))
-	    syslog(LOG_WARNING, "ftpdata_start: setsockopt(IPTOS_THROUGHPUT): %m");
+	fdp->pooled = 0;
+	err = pthread_create(&fdp->tid, NULL, ftpdata_thread, (void *) fcp);
     }
-#endif	
-#ifdef TCP_NOPUSH
-    if (setsockopt(fdp->fd, IPPROTO_TCP, TCP_NOPUSH, (void *) &one, sizeof(one)))
-	syslog(LOG_WARNING, "ftpdata_start: setsockopt(TCP_NOPUSH): %m");
-#endif
-    
-    fcp->data = fdp;
-    
-    err = pthread_create(&fdp->tid, NULL, ftpdata_thread, (void *) fcp);
     if (err)
     {
 	syslog(LOG_ERR, "ftpdata_start: pthread_create: %s",
 	       strerror(err));
 
-	s_close(fdp->fd);
+	fcp->data = NULL;
+	if (fdp->listen_fd >= 0)
+	    s_close(fdp->listen_fd);
+	if (fdp->fd >= 0)
+	    s_close(fdp->fd);
 	a_free(fdp);
 	return NULL;
     }
@@ -343,7 +718,6 @@ ftpdata_wait(FTPDATA *fdp)
 int
 ftpdata_join(FTPDATA *fdp)
 {
-    FTPDATA_RES *res;
     int code;
     
 
@@ -364,14 +738,14 @@ ftpdata_join(FTPDATA *fdp)
     while (fdp->state <= 2)
 	pthread_cond_wait(&fdp->cv, &fdp->mtx);
 
-    if (fdp->state == 3)
+    if (fdp->state == 3 && !fdp->pooled)
     {
 	if (debug)
 	    fprintf(stderr,
 		    "ftpdata_join(%p): Waiting for thread to exit\n",
 		    fdp);
 	
-	while ((code = pthread_join(fdp->tid, (void *) &res)) == EINTR)
+	while ((code = pthread_join(fdp->tid, NULL)) == EINTR)
 	    ;
 	
 	if (code)
@@ -382,10 +756,8 @@ ftpdata_join(FTPDATA *fdp)
     }
 
     fdp->state = 4;
+    code = fdp->code;
     pthread_mutex_unlock(&fdp->mtx);
-    
-    code = res->code;
-    a_free(res);
 
     if (debug)
 	fprintf(stderr, "ftpdata_join(%p): Done (code=%d)\n", fdp, code);
@@ -405,7 +777,7 @@ ftpdata_abort(FTPDATA *fdp)
     pthread_mutex_lock(&fdp->mtx);
     if (fdp->state < 2)
     {
-	if (shutdown(fdp->fd, 2) < 0)
+	if (fdp->fd >= 0 && shutdown(fdp->fd, 2) < 0)
 	    syslog(LOG_ERR, "ftpdata_abort(%p): shutdown(%d, 2): %m",
 		   fdp, fdp->fd);
 	
@@ -440,7 +812,7 @@ ftpdata_destroy(FTPDATA *fdp)
     while (fdp->state <= 2)
 	pthread_cond_wait(&fdp->cv, &fdp->mtx);
 
-    if (fdp->state == 3)
+    if (fdp->state == 3 && !fdp->pooled)
     {
 	if (debug)
 	    fprintf(stderr,
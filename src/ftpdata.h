@@ -15,40 +15,100 @@
 #ifndef FTPDATA_H
 #define FTPDATA_H
 
+#include <sys/types.h>
+#include <time.h>
+
 #include "plib/threads.h"
+#include "plib/sockaddr.h"
+#include "plib/timeout.h"
+#include "plib/tpool.h"
 
 struct FTPCLIENT;
 
+extern int data_stall_timeout;	/* Seconds without progress, 0 = forever */
+extern int data_min_rate;	/* Bytes/second, 0 = no limit */
+extern int data_rate_window;	/* Seconds to measure data_min_rate over */
+extern int data_connect_timeout; /* Seconds for an active connect, 0 = forever */
+extern int data_preconnect;	/* Seconds to keep an unused connection
+				   made at PORT/EPRT, 0 = no pre-connect */
+
+extern int data_workers_min;
+extern int data_workers_max;	/* 0 = one new thread per transfer */
+extern int data_workers_idle;
+
+/* Shared transfer threads, NULL = a new thread for each transfer */
+extern TPOOL *ftpdata_pool;
+
 typedef struct FTPDATA
 {
     pthread_mutex_t mtx;
     pthread_cond_t  cv;
     int fd;
+    int listen_fd;		/* PASV listener still to accept from, or -1 */
+    struct sockaddr_gen port;	/* Client address for an active connection */
+    int preconnected;		/* 'fd' was connected at PORT/EPRT time */
     int state;
     pthread_t tid;
+    int pooled;			/* Running in ftpdata_pool, no thread to join */
+    void (*prepare)(struct FTPCLIENT *fcp, void *vp);
     int (*handler)(struct FTPCLIENT *fcp, void *vp);
     void *vp;
+    int code;			/* Final reply code */
+
+    volatile off_t nbytes;	/* Bytes moved so far, updated by handler */
+
+    /* Progress watchdog state, only used by ftpdata_check() */
+    TIMEOUT *tp;
+    off_t last_bytes;
+    time_t last_move;
+    off_t win_bytes;
+    time_t win_start;
 } FTPDATA;
 
 
-typedef struct FTPDATA_RES
+/* An active connection started as soon as PORT/EPRT was accepted */
+typedef struct FTPDATA_PRECONN
 {
-    int code;
-} FTPDATA_RES;
+    pthread_mutex_t mtx;
+    int fd;			/* -1 once it has been discarded */
+    TIMEOUT *tp;		/* Discards it if still unused */
+} FTPDATA_PRECONN;
 
 
-/* Initialize global variables */
-extern void
-ftpdata_init(void);
+/*
+** Returned by a handler that has passed the transfer on to someone
+** else, who will call ftpdata_done() when finished.
+*/
+#define FTPDATA_PENDING (-1)
 
 
-/* Initiate a FTPDATA session */
+/*
+** Initiate a FTPDATA session. 'prepare' (if not NULL) is called in
+** the FTPDATA thread while the data connection is being set up, so
+** the handler can start sending as soon as it is up. 'handler' is
+** then called to do the transfer, with fp->data->fd == -1 if there
+** is no connection, in which case it should only clean up.
+*/
 extern FTPDATA *
 ftpdata_start(struct FTPCLIENT *fp,
 	      const char *reason,
+	      void (*prepare)(struct FTPCLIENT *fp, void *vp),
 	      int (*handler)(struct FTPCLIENT *fp, void *vp),
 	      void *vp);
 
+/* Finish a FTPDATA session with the final reply 'code' */
+extern void
+ftpdata_done(struct FTPCLIENT *fp,
+	     int code);
+
+/* Start connecting to the PORT/EPRT address, if data_preconnect */
+extern void
+ftpdata_preconnect(struct FTPCLIENT *fp);
+
+/* Close an unused pre-connected socket, if any */
+extern void
+ftpdata_discard(struct FTPCLIENT *fp);
+
 /* Get state of FTPDATA session */
 extern int
 ftpdata_state(FTPDATA *fdp);
@@ -294,22 +294,18 @@ strwildmatch(const char *string, const char *pattern)
 }
 #endif
 
-static int
+static void
 send_file_listing(FDBUF *fp,
+		  DIRLIST *dlp,
 		  const char *rpath,
 		  int flags,
 		  char *match)
 {
-    DIRLIST *dlp;
     struct dirent *dep;
     struct stat *sp;
     int i;
     
 
-    dlp = dirlist_get(rpath);
-    if (dlp == NULL)
-	return -1;
-
     for (i = 0; i < dlp->dec; i++)
     {
 	dep = dlp->dev[i].d;
@@ -351,7 +347,7 @@ send_file_listing(FDBUF *fp,
 		break;
 		
 	      default:
-		fd_printf(fp, "%7d", sp->st_size);
+		fd_printf(fp, "%7lld", (long long) sp->st_size);
 	    }
 	    
 	    fd_printf(fp, " %12s %s",
@@ -410,9 +406,6 @@ send_file_listing(FDBUF *fp,
 	    fd_putc(fp, '\n');
 	}
     }
-	
-    dirlist_free(dlp);
-    return 0;
 }
 
 
@@ -425,9 +418,24 @@ typedef struct
     char *vpath;
     char *match;
     int flags;
+    DIRLIST *dlp;		/* Read by list_prepare() */
+    int err;			/* errno if dlp is NULL */
 } FTPDATA_LIST;
 
 
+/* Read the directory while the data connection is being set up */
+static void
+list_prepare(FTPCLIENT *fp,
+	     void *vp)
+{
+    FTPDATA_LIST *lp = (FTPDATA_LIST *) vp;
+
+
+    lp->dlp = dirlist_get(lp->rpath);
+    lp->err = errno;
+}
+
+
 static int
 list_thread(FTPCLIENT *fp,
 	    void *vp)
@@ -439,17 +447,29 @@ list_thread(FTPCLIENT *fp,
     if (debug)
 	fprintf(stderr, "list_thread: start\n");
     
-    data_fdp = fd_create(fp->data->fd, FDF_CRLF);
-
-    if (send_file_listing(data_fdp, lp->rpath, lp->flags, lp->match))
+    /* No data connection could be built */
+    rc = 425;
+    if (fp->data->fd < 0)
+	goto End;
+    
+    if (lp->dlp == NULL)
     {
-	fd_printf(fp->fd, "550: %s: %s.\n", lp->vpath, strerror(errno));
+	fd_printf(fp->fd, "550: %s: %s.\n", lp->vpath, strerror(lp->err));
 	rc = 0;
+	goto End;
     }
-    else
-	rc = 226;
+    
+    data_fdp = fd_create(fp->data->fd, FDF_CRLF);
+    data_fdp->moved = &fp->data->nbytes;
+
+    send_file_listing(data_fdp, lp->dlp, lp->rpath, lp->flags, lp->match);
+    rc = 226;
     
     fd_destroy(data_fdp);
+
+  End:
+    if (lp->dlp)
+	dirlist_free(lp->dlp);
     a_free(lp->rpath);
     a_free(lp->vpath);
     a_free(lp->match);
@@ -550,7 +570,11 @@ do_listing(FTPCLIENT *fp,
     flp->flags = ls_flags |
 	((strcmp(vpath, "/") == 0 || *vpath == '\0') ? LS_SKIPDOTDOT : 0);
     
-    if (ftpdata_start(fp, "file listing", list_thread, (void *) flp) == NULL)
+    flp->dlp = NULL;
+    flp->err = 0;
+    
+    if (ftpdata_start(fp, "file listing", list_prepare, list_thread,
+		      (void *) flp) == NULL)
     {
 	fd_puts(fp->fd, "425 Can not build data connection.\n");
 	
@@ -570,8 +594,17 @@ ftplist_send(FTPCLIENT *fp,
 	     const char *path,
 	     int flags)
 {
+    DIRLIST *dlp;
+
+    
     if (flags & LS_FTPDATA)
 	return do_listing(fp, path, flags & ~LS_FTPDATA);
-    else
-	return send_file_listing(fp->fd, path, flags, NULL); /* Match? */
+
+    dlp = dirlist_get(path);
+    if (dlp == NULL)
+	return -1;
+    
+    send_file_listing(fp->fd, dlp, path, flags, NULL); /* Match? */
+    dirlist_free(dlp);
+    return 0;
 }
@@ -0,0 +1,394 @@
+/*
+** handoff.c - Pass the listening sockets on to a new server process
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <syslog.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "pftpd.h"
+
+#include "plib/safeio.h"
+#include "plib/safestr.h"
+#include "plib/aalloc.h"
+#include "handoff.h"
+
+
+int handoff_timeout = 30;
+int handoff_drain = 0;
+
+static char **handoff_argv = NULL;
+static char *handoff_path = NULL;
+static int handoff_fd = -1;
+static int handoff_done = 0;
+static int handoff_root = 0;	/* Started with root privileges */
+static volatile int handoff_drained_flag = 0;
+
+
+void
+handoff_setup(int argc,
+	      char **argv)
+{
+    char buf[PATH_MAX];
+    int i;
+
+
+    handoff_argv = a_malloc((argc+1) * sizeof(char *), "handoff_argv");
+    for (i = 0; i < argc; i++)
+	handoff_argv[i] = a_strdup(argv[i], "handoff_argv[]");
+    handoff_argv[i] = NULL;
+
+    handoff_root = (geteuid() == 0);
+
+    /* We chdir() later on, so relative paths must be resolved now */
+    if (argc > 0 && strchr(argv[0], '/') != NULL &&
+	realpath(argv[0], buf) != NULL)
+	handoff_path = a_strdup(buf, "handoff_path");
+    else if (argc > 0)
+	handoff_path = handoff_argv[0];
+}
+
+
+static int
+send_fds(int sock,
+	 int *fds,
+	 int nfds)
+{
+    struct iovec iov[1];
+    struct msghdr msg;
+#ifdef SCM_RIGHTS
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAXFDS)];
+    } cmsgbuf;
+    struct cmsghdr *cmsg;
+#endif
+    int code;
+
+
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = (void *) &nfds;
+    iov[0].iov_len = sizeof(nfds);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    msg.msg_name = NULL;
+
+#ifdef SCM_RIGHTS
+    memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+    msg.msg_control = cmsgbuf.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+#else
+    msg.msg_accrights = (void *) fds;
+    msg.msg_accrightslen = sizeof(int) * nfds;
+#endif
+
+    while ((code = sendmsg(sock, &msg, 0)) < 0 && errno == EINTR)
+	;
+
+    return code;
+}
+
+
+static int
+recv_fds(int sock,
+	 int *fds,
+	 int maxfds)
+{
+    struct iovec iov[1];
+    struct msghdr msg;
+#ifdef SCM_RIGHTS
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAXFDS)];
+    } cmsgbuf;
+    struct cmsghdr *cmsg;
+#endif
+    int code, nfds, n;
+
+
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = (void *) &nfds;
+    iov[0].iov_len = sizeof(nfds);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    msg.msg_name = NULL;
+
+#ifdef SCM_RIGHTS
+    msg.msg_control = cmsgbuf.buf;
+    msg.msg_controllen = sizeof(cmsgbuf.buf);
+#else
+    msg.msg_accrights = (void *) fds;
+    msg.msg_accrightslen = sizeof(int) * maxfds;
+#endif
+
+    nfds = 0;
+    while ((code = recvmsg(sock, &msg, 0)) < 0 && errno == EINTR)
+	;
+    if (code <= 0)
+	return -1;
+
+#ifdef SCM_RIGHTS
+    n = 0;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+	n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if (n > maxfds)
+	    n = maxfds;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+    }
+#else
+    n = msg.msg_accrightslen / sizeof(int);
+#endif
+
+    if (n != nfds)
+    {
+	syslog(LOG_ERR, "handoff: expected %d descriptors, got %d", nfds, n);
+	return -1;
+    }
+
+    return n;
+}
+
+
+static void *
+drain_thread(void *vp)
+{
+    SERVER *sp = (SERVER *) vp;
+    time_t start;
+    int n;
+
+
+    time(&start);
+    while ((n = server_clients(sp)) > 0 &&
+	   (handoff_drain <= 0 || time(NULL) - start < handoff_drain))
+    {
+	if (debug)
+	    fprintf(stderr, "drain_thread: %d clients left\n", n);
+	sleep(1);
+    }
+
+    syslog(LOG_NOTICE, "handoff complete (%d clients left) - terminating", n);
+
+    /* Let the main thread shut down the process */
+    handoff_drained_flag = 1;
+    kill(getpid(), SIGTERM);
+    return NULL;
+}
+
+
+int
+handoff_drained(void)
+{
+    return handoff_drained_flag;
+}
+
+
+int
+handoff_start(SERVER *sp)
+{
+    int sv[2], fds[HANDOFF_MAXFDS], nfds, i, code, maxfd, status;
+    char buf[32], ack;
+    pid_t pid;
+    pthread_t tid;
+
+
+    if (handoff_done)
+    {
+	syslog(LOG_NOTICE, "handoff: already in progress");
+	return -1;
+    }
+
+    if (handoff_path == NULL)
+    {
+	syslog(LOG_ERR, "handoff: unknown program path");
+	return -1;
+    }
+
+    /*
+    ** The new process redoes our startup - chroot(), pid file etc -
+    ** from the original path. Neither works from inside a chroot()
+    ** or once root privileges are gone, so don't even try.
+    */
+    if (server_root_dir)
+    {
+	syslog(LOG_ERR, "handoff: not possible with server:root-dir set");
+	return -1;
+    }
+    
+    if (handoff_root && geteuid() != 0)
+    {
+	syslog(LOG_ERR, "handoff: not possible after giving up root privileges");
+	return -1;
+    }
+
+    nfds = 0;
+    for (i = 0; i < sp->nshards && nfds < HANDOFF_MAXFDS; i++)
+	if (sp->shards[i].fd >= 0)
+	    fds[nfds++] = sp->shards[i].fd;
+
+    if (nfds == 0)
+    {
+	syslog(LOG_ERR, "handoff: no listening sockets");
+	return -1;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+	syslog(LOG_ERR, "handoff: socketpair: %m");
+	return -1;
+    }
+
+    s_snprintf(buf, sizeof(buf), "%d", sv[1]);
+    setenv(HANDOFF_ENV, buf, 1);
+
+#ifdef _SC_OPEN_MAX
+    maxfd = sysconf(_SC_OPEN_MAX);
+#else
+    maxfd = getdtablesize();
+#endif
+
+    pid = fork();
+    if (pid == 0)
+    {
+	/* Don't leak client connections into the new process */
+	for (i = 3; i < maxfd; i++)
+	    if (i != sv[1])
+		close(i);
+
+	i = open("/dev/null", O_RDWR);
+	if (i >= 0 && i != 0)
+	{
+	    dup2(i, 0);
+	    if (i != sv[1])
+		close(i);
+	}
+
+	execvp(handoff_path, handoff_argv);
+	_exit(EXIT_FAILURE);
+    }
+
+    unsetenv(HANDOFF_ENV);
+    s_close(sv[1]);
+
+    if (pid < 0)
+    {
+	syslog(LOG_ERR, "handoff: fork: %m");
+	s_close(sv[0]);
+	return -1;
+    }
+
+    if (send_fds(sv[0], fds, nfds) < 0)
+    {
+	syslog(LOG_ERR, "handoff: sendmsg: %m");
+	goto Fail;
+    }
+
+    /* Wait for the new process to start accepting connections */
+    code = s_waitfd(sv[0], handoff_timeout);
+    if (code <= 0 || s_read(sv[0], &ack, 1) != 1)
+    {
+	syslog(LOG_ERR, "handoff: no response from new process (pid %d)",
+	       (int) pid);
+	goto Fail;
+    }
+
+    s_close(sv[0]);
+    handoff_done = 1;
+
+    syslog(LOG_NOTICE, "handoff: %d listening sockets passed to pid %d - draining %d clients",
+	   nfds, (int) pid, server_clients(sp));
+
+    server_detach(sp);
+
+    code = pthread_create(&tid, &sp->ca_detached, drain_thread, (void *) sp);
+    if (code)
+    {
+	syslog(LOG_ERR, "handoff: pthread_create: %s", strerror(code));
+	(void) drain_thread(sp);
+    }
+
+    return 0;
+
+  Fail:
+    s_close(sv[0]);
+    kill(pid, SIGKILL);
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+	;
+    return -1;
+}
+
+
+int
+handoff_receive(int *fds,
+		int maxfds)
+{
+    char *cp;
+    int n;
+
+
+    cp = getenv(HANDOFF_ENV);
+    if (cp == NULL)
+	return 0;
+
+    handoff_fd = atoi(cp);
+    unsetenv(HANDOFF_ENV);
+
+    n = recv_fds(handoff_fd, fds, maxfds);
+    if (n <= 0)
+    {
+	syslog(LOG_ERR, "handoff: receiving listening sockets failed");
+	s_close(handoff_fd);
+	handoff_fd = -1;
+	return -1;
+    }
+
+    if (debug)
+	fprintf(stderr, "handoff_receive: got %d listening sockets\n", n);
+
+    return n;
+}
+
+
+void
+handoff_ready(void)
+{
+    if (handoff_fd < 0)
+	return;
+
+    (void) s_write(handoff_fd, "1", 1);
+    s_close(handoff_fd);
+    handoff_fd = -1;
+}
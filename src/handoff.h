@@ -0,0 +1,62 @@
+/*
+** handoff.h - Pass the listening sockets on to a new server process
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef PFTPD_HANDOFF_H
+#define PFTPD_HANDOFF_H
+
+#include "plib/server.h"
+
+#define HANDOFF_ENV	"PFTPD_HANDOFF"
+#define HANDOFF_MAXFDS	256
+
+extern int handoff_timeout;	/* Seconds to wait for the new process */
+extern int handoff_drain;	/* Max seconds to wait for old clients, 0 = forever */
+
+/* Save the command line used to start a new process */
+extern void
+handoff_setup(int argc,
+	      char **argv);
+
+/*
+** Start a new server process and pass our listening sockets to it.
+** If successful, stop accepting and exit when all clients are gone.
+** Refused (-1) for a chroot()ed server, and for one started as root
+** that has since switched to another user, since the new process
+** could not set itself up.
+*/
+extern int
+handoff_start(SERVER *sp);
+
+/*
+** In a new process: fetch the listening sockets from the old one.
+** Returns the number of sockets, 0 if not started by a handoff,
+** or -1 on failure.
+*/
+extern int
+handoff_receive(int *fds,
+		int maxfds);
+
+/*
+** True once the clients left after a handoff are gone (or the drain
+** time is up). The process should then exit - drain_thread() sends
+** us a SIGTERM to get that done.
+*/
+extern int
+handoff_drained(void);
+
+/* In a new process: tell the old one we are up and running */
+extern void
+handoff_ready(void);
+
+#endif
@@ -38,6 +38,7 @@
 #include "plib/timeout.h"
 #include "plib/str2.h"
 #include "plib/daemon.h"
+#include "plib/tpool.h"
 
 
 #if defined(HAVE_LIBTHREAD) && defined(HAVE_THR_SETCONCURRENCY)
@@ -62,9 +63,18 @@ int use_chroot = 0;
 int listen_sock = -1;
 int listen_port = IPPORT_FTP;
 struct sockaddr_gen listen_addr;
+struct sockaddr_gen listen_addrv[LISTEN_MAXADDRS];
+int listen_addrc = 0;
 int listen_backlog = 256;
+int listen_shards = 1;   /* 0 = one per CPU */
+int listen_affinity = 0;
 
 int requests_max = 0;
+
+int workers_min = 0;
+int workers_max = 0;	/* 0 = one new thread per client */
+int workers_idle = 60;
+int workers_queue = 0;	/* 0 = same as workers_max */
 int skip_dotfiles = 1;
 
 int socket_type = -1;
@@ -279,6 +289,27 @@ an optional argument and 'ARG' denotes a required argument.\n", fp);
 }
 
 
+/*
+** Add an address to listen on. A port given with the address
+** overrides the default port.
+*/
+int
+listen_add_address(const char *str)
+{
+    if (listen_addrc >= LISTEN_MAXADDRS)
+    {
+	syslog(LOG_ERR, "too many listen addresses (max %d)", LISTEN_MAXADDRS);
+	return -1;
+    }
+    
+    if (str2addr(str, &listen_addrv[listen_addrc]) < 0)
+	return -1;
+
+    listen_addrc++;
+    return 0;
+}
+
+
 static int
 parse_option(PETOPT *pp,
 	     PETOPTS *pov,
@@ -315,10 +346,8 @@ parse_option(PETOPT *pp,
 	break;
 	
       case 'a':
-	if (str2addr(arg, &listen_addr) < 0)
+	if (listen_add_address(arg) < 0)
 	    return POE_INVALID;
-	if (SGPORT(listen_addr) != 0)
-	    listen_port = ntohs(SGPORT(listen_addr));
 	break;
 	
       case 'p':
@@ -400,12 +429,13 @@ int
 main(int argc,
      char *argv[])
 {
-    int err, sig, nfmax;
+    int err, sig, nfmax, i;
     char *optarg, *orig_server_ftp_dir;
     PETOPT *pop;
     int code = LOG_DAEMON;
     SERVER *servp = NULL;
     sigset_t srvsigset;
+    int hfds[HANDOFF_MAXFDS], nhfds;
     
 
     a_init();
@@ -413,6 +443,7 @@ main(int argc,
     sigemptyset(&srvsigset);
     sigaddset(&srvsigset, SIGHUP);
     sigaddset(&srvsigset, SIGTERM);
+    sigaddset(&srvsigset, SIGUSR2);
     sigaddset(&srvsigset, SIGPIPE);
 #ifdef SIGTTOU
     sigaddset(&srvsigset, SIGTTOU);
@@ -447,6 +478,9 @@ main(int argc,
     s_signal(SIGPIPE, SIG_IGN);
 #endif
     
+    /* Save the original command line for binary upgrades */
+    handoff_setup(argc, argv);
+    
     nfmax = unlimit_nofile();
 
     /* Set max concurrent requests (allow 3 per client) */
@@ -500,12 +534,17 @@ main(int argc,
 		argv0);
 	return EXIT_FAILURE;
     }
+
+    /* Started by an older server process handing over its sockets? */
+    nhfds = handoff_receive(hfds, HANDOFF_MAXFDS);
+    if (nhfds < 0)
+	return EXIT_FAILURE;
     
     
     if (!debug && 
 	getppid() != INIT_PID && !init_mode &&
 	socket_type != SOCKTYPE_CONNECTED &&
-	listen_sock < 0)
+	listen_sock < 0 && nhfds == 0)
     {
 	become_daemon();
     }
@@ -524,14 +563,39 @@ main(int argc,
     if (listen_port > 0)
 	SGPORT(listen_addr) = htons(listen_port);
 
+    /* Default to the wildcard address */
+    if (listen_addrc == 0)
+	listen_addrv[listen_addrc++] = listen_addr;
+    
+    for (i = 0; i < listen_addrc; i++)
+	if (SGPORT(listen_addrv[i]) == 0)
+	    SGPORT(listen_addrv[i]) = htons(listen_port);
+
+    if (listen_addrc > 1 && listen_sock >= 0)
+    {
+	syslog(LOG_WARNING, "using the inherited socket - ignoring listen addresses");
+	listen_addrc = 1;
+    }
+    
+    /* Needed to listen on both :: and 0.0.0.0 */
+    server_v6only = (listen_addrc > 1);
+
     timeout_init();
     
-    servp = server_init(listen_sock,
-			&listen_addr,
-			(socket_type != SOCKTYPE_CONNECTED ?
-			 listen_backlog : -1), 
-			requests_max,
-			request_handler);
+    if (nhfds > 0)
+	servp = server_adopt(hfds, nhfds,
+			     requests_max,
+			     listen_affinity,
+			     request_handler);
+    else
+	servp = server_init(listen_sock,
+			    &listen_addrv[0],
+			    (socket_type != SOCKTYPE_CONNECTED ?
+			     listen_backlog : -1), 
+			    requests_max,
+			    listen_shards,
+			    listen_affinity,
+			    request_handler);
     if (servp == NULL)
     {
 	if (debug)
@@ -540,6 +604,18 @@ main(int argc,
 	goto Exit;
     }
 
+    for (i = 1; nhfds == 0 && i < listen_addrc; i++)
+    {
+	if (server_add_address(servp, &listen_addrv[i],
+			       listen_backlog, listen_shards) < 0)
+	{
+	    if (debug)
+		fprintf(stderr, "%s: failed binding to the TCP/IP socket #%d\n",
+			argv[0], i+1);
+	    goto Exit;
+	}
+    }
+
 
     if (server_root_dir)
     {
@@ -597,7 +673,6 @@ main(int argc,
     
     drop_root_privs();
     xferlog_init();
-    ftpdata_init();
 
     if (rpad_dir)
 	rpa_init(rpad_dir);
@@ -621,7 +696,56 @@ main(int argc,
     
     pthread_sigmask(SIG_BLOCK, &srvsigset, NULL);
 
+    if (request_event_threads > 0)
+    {
+	request_evloop = evloop_create(request_event_threads);
+	if (request_evloop)
+	{
+	    servp->handler = request_start;
+	    servp->async = 1;
+	}
+	else
+	    syslog(LOG_ERR, "evloop_create(%d): %m - using one thread per client",
+		   request_event_threads);
+    }
+
+    if (workers_max > 0 && !servp->async)
+    {
+	servp->pool = tpool_create(workers_min, workers_max,
+				   workers_idle, workers_queue);
+	if (servp->pool == NULL)
+	    syslog(LOG_ERR, "tpool_create(%d, %d): %m - using one thread per client",
+		   workers_min, workers_max);
+    }
+    
+    if (data_workers_max > 0)
+    {
+	ftpdata_pool = tpool_create(data_workers_min, data_workers_max,
+				    data_workers_idle, 0);
+	if (ftpdata_pool == NULL)
+	    syslog(LOG_ERR, "tpool_create(%d, %d): %m - using one thread per transfer",
+		   data_workers_min, data_workers_max);
+    }
+    
+    if (uxfer_threads > 0 && uxfer_init() < 0)
+	syslog(LOG_ERR, "uxfer_init(%d): %m - using one thread per transfer",
+	       uxfer_threads);
+    
+    if (request_shed)
+	servp->busy_msg = "421 Too many users - try again later.\r\n";
+
+    /* Without a worker pool there is no queue to measure */
+    if (request_shed && request_shed_queue > 0 && servp->pool == NULL)
+	syslog(LOG_WARNING,
+	       "server:shed-queue-depth needs server:max-workers (and no server:event-threads) - ignored");
+
+    if (request_shed || PEER_ENABLED())
+	servp->admit = request_admit;
+    if (PEER_ENABLED())
+	servp->release = request_release;
+    
     server_start(servp);
+    handoff_ready();
 
     /* XXX: Handle server thread termination! */
     
@@ -636,9 +760,39 @@ main(int argc,
 	    /* Close and reopen the xferlog file */
 	    syslog(LOG_NOTICE, "SIGHUP received - reinitializing xferlog");
 	    xferlog_init();
+	    if (servp->admit)
+		syslog(LOG_NOTICE, "%d active clients, %lu rejected",
+		       server_clients(servp), servp->rejected);
+	    for (i = COPYFD_AUTO+1; i < COPYFD_NSTRATEGIES; i++)
+		if (copyfd_count[i] > 0)
+		    syslog(LOG_NOTICE, "copy strategy %s: %lu copies, %llu bytes",
+			   copyfd_name(i), copyfd_count[i], copyfd_bytes[i]);
+	    if (filecache_memory > 0)
+		syslog(LOG_NOTICE, "file cache: %lu hits, %lu misses",
+		       filecache_hits, filecache_misses);
+	    if (fdcache_size > 0)
+		syslog(LOG_NOTICE, "fd cache: %lu hits, %lu misses",
+		       fdcache_hits, fdcache_misses);
+	    if (fanout_chunks > 0)
+		syslog(LOG_NOTICE,
+		       "fan-out: %lu chunks read, %lu shared, %lu fell behind",
+		       fanout_reads, fanout_shared, fanout_behind);
 	    break;
 
+	  case SIGUSR2:
+	    /* Start a new server binary and hand over to it */
+	    syslog(LOG_NOTICE, "SIGUSR2 received - handing over to new process");
+	    handoff_start(servp);
+	    break;
+	    
 	  case SIGTERM:
+	    if (handoff_drained())
+	    {
+		/* The new process has taken over */
+		petopt_cleanup(pop);
+		return EXIT_SUCCESS;
+	    }
+	    
 	    /* Terminate gracefully - close server socket, but wait for
 	       and active clients to finish */
 	    syslog(LOG_NOTICE, "SIGTERM received - terminating");
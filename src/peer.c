@@ -0,0 +1,294 @@
+/*
+** peer.c - Per client address accounting
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pftpd.h"
+
+#include "plib/aalloc.h"
+#include "peer.h"
+
+
+int peer_max_sessions = 0;
+int peer_max_errors = 0;
+int peer_error_window = 5*60;
+int peer_prefix4 = 32;
+int peer_prefix6 = 64;
+
+
+#ifdef HAVE_THREADS
+
+/*
+** A hash table with a lock for each group ("stripe") of buckets,
+** so lookups for different addresses rarely contend
+*/
+#define PEER_BUCKETS	1024
+#define PEER_LOCKS	64
+
+typedef struct peer
+{
+    struct peer *next;
+    int family;
+    unsigned char addr[16];
+    int sessions;
+    int errors;
+    time_t err_start;
+} PEER;
+
+static PEER *peer_tab[PEER_BUCKETS];
+static pthread_mutex_t peer_mtx[PEER_LOCKS];
+static pthread_once_t peer_once = PTHREAD_ONCE_INIT;
+
+
+static void
+peer_init(void)
+{
+    int i;
+
+    for (i = 0; i < PEER_LOCKS; i++)
+	pthread_mutex_init(&peer_mtx[i], NULL);
+}
+
+
+/*
+** Build the lookup key: the address masked to the configured
+** prefix length. IPv4 mapped IPv6 addresses are treated as IPv4.
+*/
+static void
+peer_key(const struct sockaddr_gen *rsin,
+	 int *family,
+	 unsigned char *addr)
+{
+    const unsigned char *ap;
+    int len, bits, i;
+
+
+    memset(addr, 0, 16);
+
+    ap = (const unsigned char *) SGADDRP(*rsin);
+    len = SGSIZE(*rsin);
+    *family = SGFAM(*rsin);
+
+#ifdef HAVE_IPV6
+    if (*family == AF_INET6 &&
+	IN6_IS_ADDR_V4MAPPED((const struct in6_addr *) ap))
+    {
+	ap += 12;
+	len = 4;
+	*family = AF_INET;
+    }
+#endif
+
+    bits = (*family == AF_INET ? peer_prefix4 : peer_prefix6);
+    if (bits < 0 || bits > len*8)
+	bits = len*8;
+
+    for (i = 0; i < len && bits > 0; i++, bits -= 8)
+	addr[i] = ap[i] & (bits >= 8 ? 0xFF : (0xFF << (8-bits)) & 0xFF);
+}
+
+
+static unsigned int
+peer_hash(int family,
+	  const unsigned char *addr)
+{
+    unsigned int h = 2166136261U;
+    int i;
+
+
+    h = (h ^ family) * 16777619U;
+    for (i = 0; i < 16; i++)
+	h = (h ^ addr[i]) * 16777619U;
+
+    return h % PEER_BUCKETS;
+}
+
+
+static int
+peer_idle(PEER *pp,
+	  time_t now)
+{
+    return (pp->sessions == 0 &&
+	    (pp->errors == 0 || now - pp->err_start >= peer_error_window));
+}
+
+
+/*
+** Find (and optionally create) the entry for an address. Idle
+** entries found along the way are freed. Must be called with the
+** bucket's lock held.
+*/
+static PEER *
+peer_lookup(unsigned int h,
+	    int family,
+	    const unsigned char *addr,
+	    int create,
+	    time_t now)
+{
+    PEER *pp, **ppp;
+
+
+    ppp = &peer_tab[h];
+    while ((pp = *ppp) != NULL)
+    {
+	if (pp->family == family && memcmp(pp->addr, addr, 16) == 0)
+	    return pp;
+
+	if (peer_idle(pp, now))
+	{
+	    *ppp = pp->next;
+	    a_free(pp);
+	}
+	else
+	    ppp = &pp->next;
+    }
+
+    if (!create)
+	return NULL;
+
+    A_NEW(pp);
+    pp->family = family;
+    memcpy(pp->addr, addr, 16);
+    pp->sessions = 0;
+    pp->errors = 0;
+    pp->err_start = now;
+    pp->next = peer_tab[h];
+    peer_tab[h] = pp;
+
+    return pp;
+}
+
+
+const char *
+peer_admit(const struct sockaddr_gen *rsin)
+{
+    unsigned char addr[16];
+    unsigned int h;
+    int family;
+    time_t now;
+    PEER *pp;
+    const char *msg = NULL;
+
+
+    if (!PEER_ENABLED())
+	return NULL;
+
+    pthread_once(&peer_once, peer_init);
+
+    peer_key(rsin, &family, addr);
+    h = peer_hash(family, addr);
+    time(&now);
+
+    pthread_mutex_lock(&peer_mtx[h % PEER_LOCKS]);
+
+    pp = peer_lookup(h, family, addr, 1, now);
+
+    if (peer_max_errors > 0 &&
+	pp->errors >= peer_max_errors &&
+	now - pp->err_start < peer_error_window)
+	msg = "421 Too many errors from your address - try again later.\r\n";
+
+    else if (peer_max_sessions > 0 && pp->sessions >= peer_max_sessions)
+	msg = "421 Too many connections from your address - try again later.\r\n";
+
+    else
+	pp->sessions++;
+
+    pthread_mutex_unlock(&peer_mtx[h % PEER_LOCKS]);
+
+    if (debug && msg)
+	fprintf(stderr, "peer_admit: rejected: %s", msg);
+
+    return msg;
+}
+
+
+void
+peer_release(const struct sockaddr_gen *rsin)
+{
+    unsigned char addr[16];
+    unsigned int h;
+    int family;
+    PEER *pp;
+
+
+    if (!PEER_ENABLED())
+	return;
+
+    pthread_once(&peer_once, peer_init);
+
+    peer_key(rsin, &family, addr);
+    h = peer_hash(family, addr);
+
+    pthread_mutex_lock(&peer_mtx[h % PEER_LOCKS]);
+    pp = peer_lookup(h, family, addr, 0, time(NULL));
+    if (pp && pp->sessions > 0)
+	pp->sessions--;
+    pthread_mutex_unlock(&peer_mtx[h % PEER_LOCKS]);
+}
+
+
+void
+peer_error(const struct sockaddr_gen *rsin)
+{
+    unsigned char addr[16];
+    unsigned int h;
+    int family;
+    time_t now;
+    PEER *pp;
+
+
+    if (peer_max_errors <= 0)
+	return;
+
+    pthread_once(&peer_once, peer_init);
+
+    peer_key(rsin, &family, addr);
+    h = peer_hash(family, addr);
+    time(&now);
+
+    pthread_mutex_lock(&peer_mtx[h % PEER_LOCKS]);
+    pp = peer_lookup(h, family, addr, 1, now);
+    if (now - pp->err_start >= peer_error_window)
+    {
+	pp->errors = 0;
+	pp->err_start = now;
+    }
+    pp->errors++;
+    pthread_mutex_unlock(&peer_mtx[h % PEER_LOCKS]);
+}
+
+#else /* No threads - sessions run in separate processes */
+
+const char *
+peer_admit(const struct sockaddr_gen *rsin)
+{
+    return NULL;
+}
+
+void
+peer_release(const struct sockaddr_gen *rsin)
+{
+}
+
+void
+peer_error(const struct sockaddr_gen *rsin)
+{
+}
+
+#endif
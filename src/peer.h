@@ -0,0 +1,44 @@
+/*
+** peer.h - Per client address accounting
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef PFTPD_PEER_H
+#define PFTPD_PEER_H
+
+#include "plib/sockaddr.h"
+
+extern int peer_max_sessions;	/* 0 = no limit */
+extern int peer_max_errors;	/* 0 = no limit */
+extern int peer_error_window;	/* Seconds */
+extern int peer_prefix4;	/* Bits of IPv4 address to group by */
+extern int peer_prefix6;	/* Bits of IPv6 address to group by */
+
+/* True if any per-peer limit is enabled */
+#define PEER_ENABLED()	(peer_max_sessions > 0 || peer_max_errors > 0)
+
+/*
+** Register a new session. Returns NULL if OK, or a reply
+** message if the client should be turned away.
+*/
+extern const char *
+peer_admit(const struct sockaddr_gen *rsin);
+
+/* A session admitted by peer_admit() has ended */
+extern void
+peer_release(const struct sockaddr_gen *rsin);
+
+/* Record a session that was dropped for too many errors */
+extern void
+peer_error(const struct sockaddr_gen *rsin);
+
+#endif
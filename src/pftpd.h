@@ -39,6 +39,13 @@
 #include "xferlog.h"
 #include "socket.h"
 #include "rpa.h"
+#include "peer.h"
+#include "handoff.h"
+#include "uxfer.h"
+#include "ascii.h"
+#include "filecache.h"
+#include "fdcache.h"
+#include "fanout.h"
 
 
 #ifndef PATH_PREFIX
@@ -85,10 +92,22 @@ extern char *argv0;
 extern int listen_sock;
 extern int listen_port;
 extern struct sockaddr_gen listen_addr;
+
+#define LISTEN_MAXADDRS 32
+extern struct sockaddr_gen listen_addrv[LISTEN_MAXADDRS];
+extern int listen_addrc;
+extern int listen_add_address(const char *str);
 extern int listen_backlog;
+extern int listen_shards;
+extern int listen_affinity;
 
 extern int requests_max;
 
+extern int workers_min;
+extern int workers_max;
+extern int workers_idle;
+extern int workers_queue;
+
 extern char *server_root_dir;
 extern char *pidfile_path;
 extern char server_version[];
@@ -32,6 +32,8 @@
 
 #include <arpa/inet.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/time.h>
 
 
 #include "pftpd.h"
@@ -39,9 +41,32 @@
 #include "plib/support.h"
 #include "plib/safeio.h"
 #include "plib/timeout.h"
+#include "plib/aalloc.h"
+#include "plib/evloop.h"
+#include "plib/tpool.h"
 
 int request_timeout = 15*60;  /* 15 minutes */
 
+int request_event_threads = 0; /* 0 = one thread per client */
+EVLOOP *request_evloop = NULL;
+
+int request_shed = 0;         /* Send 421 instead of queueing new clients */
+int request_shed_queue = 0;   /* Max queued clients, 0 = no limit.
+				 Only with a worker pool, see main() */
+int request_shed_latency = 0; /* Max avg command latency (ms), 0 = no limit */
+
+static pthread_mutex_t latency_mtx = PTHREAD_MUTEX_INITIALIZER;
+static long latency_avg = 0;  /* Moving average, in microseconds */
+static time_t latency_last = 0;
+
+
+typedef struct
+{
+    FTPCLIENT *fp;
+    TIMEOUT *tp;
+    EVENT *evp;
+} REQUEST;
+
 
 static void
 send_timeout_message(int fd)
@@ -81,6 +106,102 @@ sigurg_handler(int sig)
 #endif
 
 
+/*
+** Handle one command line. Returns non-zero if the session
+** should be terminated.
+*/
+static int
+request_line(FTPCLIENT *fp,
+	     TIMEOUT *tp,
+	     char *buf)
+{
+    if (ftpdata_state(fp->data) == 3)
+    {
+	int code;
+	
+	
+	/* Harvest the FTP DATA thread */
+	
+	code = ftpdata_join(fp->data);
+	
+	ftpdata_destroy(fp->data);
+	fp->data = NULL;
+    }
+    
+    if (tp)
+	timeout_reset(tp, request_timeout);
+    
+    if (debug)
+	fprintf(stderr, "Got: %s\n", buf);
+
+    if (request_shed_latency > 0)
+    {
+	struct timeval t0, t1;
+	long us;
+	int rc;
+
+	
+	gettimeofday(&t0, NULL);
+	rc = ftpcmd_parse(fp, buf);
+	gettimeofday(&t1, NULL);
+
+	us = (t1.tv_sec - t0.tv_sec) * 1000000L + (t1.tv_usec - t0.tv_usec);
+	
+	pthread_mutex_lock(&latency_mtx);
+	latency_avg += (us - latency_avg) / 8;
+	latency_last = t1.tv_sec;
+	pthread_mutex_unlock(&latency_mtx);
+	
+	return rc;
+    }
+    
+    return ftpcmd_parse(fp, buf);
+}
+
+
+/*
+** Called by the server for each new connection before a session
+** is created. Returns NULL to let the client in, or a 421 reply.
+*/
+const char *
+request_admit(SERVER *sp,
+	      const struct sockaddr_gen *rsin)
+{
+    static const char *busy = "421 Too many users - try again later.\r\n";
+    long avg;
+    time_t last;
+    
+
+    if (request_shed)
+    {
+	if (request_shed_queue > 0 && sp->pool &&
+	    tpool_queued(sp->pool) >= request_shed_queue)
+	    return busy;
+	
+	if (request_shed_latency > 0)
+	{
+	    pthread_mutex_lock(&latency_mtx);
+	    avg = latency_avg;
+	    last = latency_last;
+	    pthread_mutex_unlock(&latency_mtx);
+	    
+	    /* Ignore stale averages when no commands have been seen lately */
+	    if (avg / 1000 >= request_shed_latency && time(NULL) - last < 10)
+		return busy;
+	}
+    }
+
+    return peer_admit(rsin);
+}
+
+
+void
+request_release(CLIENT *cp)
+{
+    peer_release(&cp->rsin);
+}
+
+
 void
 request_handler(CLIENT *cp)
 {
@@ -131,26 +252,7 @@ request_handler(CLIENT *cp)
     
     while (fd_gets(fp->fd, buf, sizeof(buf)) == 0)
     {
-	if (ftpdata_state(fp->data) == 3)
-	{
-	    int code;
-	
-    
-	    /* Harvest the FTP DATA thread */
-
-	    code = ftpdata_join(fp->data);
-	    
-	    ftpdata_destroy(fp->data);
-	    fp->data = NULL;
-	}
-	
-	if (tp)
-	    timeout_reset(tp, request_timeout);
-
-	if (debug)
-	    fprintf(stderr, "Got: %s\n", buf);
-	
-	err = ftpcmd_parse(fp, buf);
+	err = request_line(fp, tp, buf);
 	if (err)
 	    break;
     }
@@ -165,4 +267,133 @@ request_handler(CLIENT *cp)
 }
 
 
+/*
+** The last part of request_end(). Waits for the FTPDATA thread, if
+** any, to finish.
+*/
+static void *
+request_teardown(void *vp)
+{
+    REQUEST *rp = (REQUEST *) vp;
+    CLIENT *cp = rp->fp->cp;
+
+
+    ftpcmd_destroy(rp->fp);
+    a_free(rp);
+    
+    server_client_done(cp);
+    return NULL;
+}
+
+
+static void
+request_end(REQUEST *rp)
+{
+    CLIENT *cp = rp->fp->cp;
+    pthread_t tid;
+    int state;
+    
+
+    if (debug)
+	fprintf(stderr, "request_end: fd#%d: terminating\n", cp->fd);
+    
+    if (rp->tp)
+	timeout_destroy(rp->tp);
+
+    evloop_remove(rp->evp);
+
+    /*
+    ** A transfer may take a while to stop - don't keep the event
+    ** thread (and every other session on it) waiting for it
+    */
+    state = ftpdata_state(rp->fp->data);
+    if (state >= 0 && state <= 2)
+    {
+	ftpdata_abort(rp->fp->data);
+	if (pthread_create(&tid, &cp->sp->ca_detached,
+			   request_teardown, (void *) rp) == 0)
+	    return;
+    }
+    
+    (void) request_teardown(rp);
+}
+
+
+/*
+** Called from one of the event threads when input is
+** available on the control connection
+*/
+static void
+request_event(EVENT *evp,
+	      void *vp)
+{
+    REQUEST *rp = (REQUEST *) vp;
+    char buf[512];
+    
+    
+    if (fd_fill(rp->fp->fd) != 0)
+    {
+	request_end(rp);
+	return;
+    }
 
+    while (fd_haveline(rp->fp->fd))
+    {
+	if (fd_gets(rp->fp->fd, buf, sizeof(buf)) != 0 ||
+	    request_line(rp->fp, rp->tp, buf) != 0)
+	{
+	    request_end(rp);
+	    return;
+	}
+    }
+
+    if (evloop_rearm(evp) < 0)
+	request_end(rp);
+}
+
+
+/*
+** Start a client session that is driven by the event loop
+** instead of a dedicated thread. Returns at once.
+*/
+void
+request_start(CLIENT *cp)
+{
+    REQUEST *rp;
+    char buf[256];
+
+
+    if (debug)
+	fprintf(stderr, "request_start: fd#%d: start (client: %s:%d)\n",
+		cp->fd,
+		s_inet_ntox(&cp->rsin, buf, sizeof(buf)),
+		ntohs(SGPORT(cp->rsin)));
+
+    A_NEW(rp);
+    rp->tp = NULL;
+    rp->evp = NULL;
+    
+    rp->fp = ftpcmd_create(cp);
+    if (rp->fp == NULL)
+    {
+	a_free(rp);
+	server_client_done(cp);
+	return;
+    }
+
+    if (request_timeout > 0)
+	rp->tp = timeout_create(request_timeout, timeout_handler, rp->fp);
+
+    rp->evp = evloop_add(request_evloop, cp->fd, request_event, rp);
+    if (rp->evp == NULL)
+    {
+	request_end(rp);
+	return;
+    }
+
+    ftpcmd_send_banner(rp->fp);
+
+    /* rp may be gone as soon as the event is armed */
+    if (evloop_rearm(rp->evp) < 0)
+	request_end(rp);
+}
@@ -16,9 +16,24 @@
 #define PFTPD_REQUEST_H
 
 #include "plib/server.h"
+#include "plib/evloop.h"
 
 extern int request_timeout;
 
+extern int request_event_threads;
+extern EVLOOP *request_evloop;
+
+extern int request_shed;
+extern int request_shed_queue;
+extern int request_shed_latency;
+
 extern void request_handler(CLIENT *cp);
 
+extern void request_start(CLIENT *cp);
+
+extern const char *request_admit(SERVER *sp,
+				 const struct sockaddr_gen *rsin);
+
+extern void request_release(CLIENT *cp);
+
 #endif
@@ -482,20 +482,31 @@ rpa_pipe_rresvport(RPA *rp,
 rpa_rresvport(RPA *rp,
 	      struct sockaddr_gen *sp)
 {
+    int fd = -1;
+
+    
     if (rp)
 	switch (rp->type)
 	{
 	  case 1:
-	    return rpa_unix_rresvport(rp, sp);
+	    /* One request and reply at a time on the shared connection */
+	    pthread_mutex_lock(&rp->mtx);
+	    fd = rpa_unix_rresvport(rp, sp);
+	    pthread_mutex_unlock(&rp->mtx);
+	    break;
 	    
 	  case 2:
-	    return rpa_door_rresvport(rp, sp);
+	    fd = rpa_door_rresvport(rp, sp);
+	    break;
 	    
 	  case 3:
-	    return rpa_pipe_rresvport(rp, sp);
+	    pthread_mutex_lock(&rp->mtx);
+	    fd = rpa_pipe_rresvport(rp, sp);
+	    pthread_mutex_unlock(&rp->mtx);
+	    break;
 	}
 
-    return -1;
+    return fd;
 }
 
 
@@ -0,0 +1,590 @@
+/*
+** uxfer.c - File transfers driven by io_uring
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <fcntl.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "pftpd.h"
+
+#include "plib/aalloc.h"
+#include "plib/safeio.h"
+#include "plib/uring.h"
+#include "uxfer.h"
+
+
+int uxfer_threads = 0;
+
+
+#if defined(HAVE_THREADS) && defined(HAVE_LINUX_IO_URING_H)
+
+/*
+** Every thread owns one ring with UXFER_SLOTS transfers in flight,
+** each with its own registered buffer and two registered file slots
+** (source and destination). A transfer alternates between reading
+** into its buffer and writing it out, so there is at most one
+** operation per transfer queued in the ring.
+*/
+#define UXFER_SLOTS	64
+#define UXFER_BUFSIZE	(64*1024)
+#define UXFER_ENTRIES	(2*UXFER_SLOTS)
+
+/* user_data 0 is the wakeup pipe, else (slot+1) << 1 | is_write */
+#define UD_WAKEUP	0
+
+
+typedef struct uxfer_job
+{
+    struct uxfer_job *next;
+    int fd[2];		/* 0 = source, 1 = destination */
+    off_t off[2];	/* -1 for sockets */
+    int slot;
+    int blen;		/* Bytes in buffer */
+    int bpos;		/* Bytes of buffer written */
+    off_t total;
+    volatile off_t *moved;
+    COPYFD_CACHE cache;	/* Page cache hints for a plain file source */
+    int cached;
+    int err;		/* Result, for the finisher thread */
+    void (*done)(void *arg, int err, off_t total);
+    void *arg;
+} UXFER_JOB;
+
+
+typedef struct uxfer_ring
+{
+    URING ring;
+    int fixed_bufs;
+    int fixed_files;
+    char *bufs;
+
+    pthread_t tid;
+    pthread_mutex_t mtx;
+    UXFER_JOB *incoming;	/* Handed over by other threads */
+    UXFER_JOB **incoming_tail;
+    int wakeup[2];
+    char wbuf[64];
+
+    /* Only touched by the ring's own thread */
+    UXFER_JOB *slots[UXFER_SLOTS];
+    int freev[UXFER_SLOTS];
+    int nfree;
+    UXFER_JOB *waiting;
+    UXFER_JOB **waiting_tail;
+} UXFER_RING;
+
+
+static UXFER_RING *uxfer_ringv = NULL;
+static int uxfer_ringc = 0;
+static unsigned int uxfer_next = 0;
+static pthread_mutex_t uxfer_mtx;
+
+/*
+** Finished jobs, waiting for the finisher thread to call their 'done'
+** function. That may block (on the control connection, say), which
+** must not hold up the transfers on a ring.
+*/
+static UXFER_JOB *uxfer_finished = NULL;
+static UXFER_JOB **uxfer_finished_tail = &uxfer_finished;
+static pthread_mutex_t uxfer_finished_mtx;
+static pthread_cond_t uxfer_finished_cv;
+
+
+static int
+uxfer_queue(UXFER_RING *rp,
+	    UXFER_JOB *jp,
+	    int write)
+{
+    struct io_uring_sqe *sqe;
+    char *buf;
+
+
+    sqe = uring_get_sqe(&rp->ring);
+    if (sqe == NULL)
+	return -1;
+
+    buf = rp->bufs + jp->slot * UXFER_BUFSIZE;
+    if (write)
+    {
+	sqe->opcode = rp->fixed_bufs ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->addr = (unsigned long) (buf + jp->bpos);
+	sqe->len = jp->blen - jp->bpos;
+    }
+    else
+    {
+	sqe->opcode = rp->fixed_bufs ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->addr = (unsigned long) buf;
+	sqe->len = UXFER_BUFSIZE;
+    }
+
+    sqe->off = (__u64) jp->off[write];
+    sqe->buf_index = jp->slot;
+    if (rp->fixed_files)
+    {
+	sqe->fd = 2*jp->slot + write;
+	sqe->flags = IOSQE_FIXED_FILE;
+    }
+    else
+	sqe->fd = jp->fd[write];
+
+    sqe->user_data = ((unsigned long long) (jp->slot+1) << 1) | write;
+    return 0;
+}
+
+
+static void
+uxfer_queue_wakeup(UXFER_RING *rp)
+{
+    struct io_uring_sqe *sqe;
+
+
+    sqe = uring_get_sqe(&rp->ring);
+    if (sqe == NULL)
+	return;
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = rp->wakeup[0];
+    sqe->addr = (unsigned long) rp->wbuf;
+    sqe->len = sizeof(rp->wbuf);
+    sqe->off = (__u64) -1;
+    sqe->user_data = UD_WAKEUP;
+}
+
+
+static void
+uxfer_files(UXFER_RING *rp,
+	    int slot,
+	    int fd0,
+	    int fd1)
+{
+    struct io_uring_files_update fu;
+    int fds[2];
+
+
+    if (!rp->fixed_files)
+	return;
+
+    fds[0] = fd0;
+    fds[1] = fd1;
+    memset(&fu, 0, sizeof(fu));
+    fu.offset = 2*slot;
+    fu.fds = (unsigned long) fds;
+
+    if (uring_register(&rp->ring, IORING_REGISTER_FILES_UPDATE, &fu, 2) < 0)
+    {
+	syslog(LOG_WARNING, "uxfer: IORING_REGISTER_FILES_UPDATE: %m - not using registered files");
+	rp->fixed_files = 0;
+    }
+}
+
+
+/* Give the job a slot and start reading, or put it in line for one */
+static void
+uxfer_begin(UXFER_RING *rp,
+	    UXFER_JOB *jp)
+{
+    if (rp->nfree == 0)
+    {
+	jp->next = NULL;
+	*rp->waiting_tail = jp;
+	rp->waiting_tail = &jp->next;
+	return;
+    }
+
+    jp->slot = rp->freev[--rp->nfree];
+    rp->slots[jp->slot] = jp;
+    uxfer_files(rp, jp->slot, jp->fd[0], jp->fd[1]);
+    (void) uxfer_queue(rp, jp, 0);
+}
+
+
+static void
+uxfer_finish(UXFER_RING *rp,
+	     UXFER_JOB *jp,
+	     int err)
+{
+    uxfer_files(rp, jp->slot, -1, -1);
+    rp->slots[jp->slot] = NULL;
+    rp->freev[rp->nfree++] = jp->slot;
+
+    if (jp->cached)
+	copyfd_cache_end(&jp->cache, jp->off[0]);
+    
+    jp->err = err;
+    jp->next = NULL;
+    pthread_mutex_lock(&uxfer_finished_mtx);
+    *uxfer_finished_tail = jp;
+    uxfer_finished_tail = &jp->next;
+    pthread_cond_signal(&uxfer_finished_cv);
+    pthread_mutex_unlock(&uxfer_finished_mtx);
+
+    if (rp->waiting)
+    {
+	jp = rp->waiting;
+	rp->waiting = jp->next;
+	if (rp->waiting == NULL)
+	    rp->waiting_tail = &rp->waiting;
+	uxfer_begin(rp, jp);
+    }
+}
+
+
+static void
+uxfer_complete(UXFER_RING *rp,
+	       unsigned long long ud,
+	       int res)
+{
+    UXFER_JOB *jp, *next;
+    int write;
+
+
+    if (ud == UD_WAKEUP)
+    {
+	pthread_mutex_lock(&rp->mtx);
+	jp = rp->incoming;
+	rp->incoming = NULL;
+	rp->incoming_tail = &rp->incoming;
+	pthread_mutex_unlock(&rp->mtx);
+
+	for (; jp; jp = next)
+	{
+	    next = jp->next;
+	    uxfer_begin(rp, jp);
+	}
+
+	uxfer_queue_wakeup(rp);
+	return;
+    }
+
+    write = ud & 1;
+    jp = rp->slots[(ud >> 1) - 1];
+
+    if (res == -EINTR || res == -EAGAIN)
+    {
+	(void) uxfer_queue(rp, jp, write);
+	return;
+    }
+
+    if (res < 0)
+    {
+	uxfer_finish(rp, jp, -res);
+	return;
+    }
+
+    if (!write)
+    {
+	if (res == 0)
+	{
+	    /* EOF */
+	    uxfer_finish(rp, jp, 0);
+	    return;
+	}
+
+	jp->blen = res;
+	jp->bpos = 0;
+	if (jp->off[0] >= 0)
+	    jp->off[0] += res;
+	if (jp->cached)
+	    copyfd_cache_update(&jp->cache, jp->off[0]);
+	(void) uxfer_queue(rp, jp, 1);
+	return;
+    }
+
+    if (res == 0)
+    {
+	uxfer_finish(rp, jp, EIO);
+	return;
+    }
+
+    jp->bpos += res;
+    jp->total += res;
+    if (jp->off[1] >= 0)
+	jp->off[1] += res;
+    if (jp->moved)
+	*jp->moved += res;
+
+    (void) uxfer_queue(rp, jp, jp->bpos < jp->blen);
+}
+
+
+static void *
+uxfer_thread(void *vp)
+{
+    UXFER_RING *rp = (UXFER_RING *) vp;
+    struct io_uring_cqe *cqe;
+    unsigned long long ud;
+    int res;
+
+
+    if (debug)
+	fprintf(stderr, "uxfer_thread: Started\n");
+
+    uxfer_queue_wakeup(rp);
+
+    for (;;)
+    {
+	if (uring_submit(&rp->ring, 1) < 0 && errno != EBUSY)
+	{
+	    syslog(LOG_ERR, "uxfer: io_uring_enter: %m");
+	    sleep(1);
+	}
+
+	while ((cqe = uring_peek_cqe(&rp->ring)) != NULL)
+	{
+	    ud = cqe->user_data;
+	    res = cqe->res;
+	    uring_cqe_seen(&rp->ring);
+
+	    uxfer_complete(rp, ud, res);
+	}
+    }
+
+    return NULL;
+}
+
+
+static void *
+uxfer_finisher(void *vp)
+{
+    UXFER_JOB *jp, *next;
+
+
+    if (debug)
+	fprintf(stderr, "uxfer_finisher: Started\n");
+
+    for (;;)
+    {
+	pthread_mutex_lock(&uxfer_finished_mtx);
+	while (uxfer_finished == NULL)
+	    pthread_cond_wait(&uxfer_finished_cv, &uxfer_finished_mtx);
+	jp = uxfer_finished;
+	uxfer_finished = NULL;
+	uxfer_finished_tail = &uxfer_finished;
+	pthread_mutex_unlock(&uxfer_finished_mtx);
+
+	for (; jp; jp = next)
+	{
+	    next = jp->next;
+	    jp->done(jp->arg, jp->err, jp->total);
+	    a_free(jp);
+	}
+    }
+
+    return NULL;
+}
+
+
+static int
+uxfer_ring_init(UXFER_RING *rp)
+{
+    struct iovec iov[UXFER_SLOTS];
+    int fds[2*UXFER_SLOTS];
+    int i;
+
+
+    if (uring_init(&rp->ring, UXFER_ENTRIES) < 0)
+	return -1;
+
+    if (pipe(rp->wakeup) < 0)
+    {
+	uring_exit(&rp->ring);
+	return -1;
+    }
+    /* Never block a client thread on a full wakeup pipe */
+    (void) fcntl(rp->wakeup[1], F_SETFL, O_NONBLOCK);
+
+    rp->bufs = a_malloc(UXFER_SLOTS * UXFER_BUFSIZE, "UXFER_RING bufs");
+
+    for (i = 0; i < UXFER_SLOTS; i++)
+    {
+	iov[i].iov_base = rp->bufs + i*UXFER_BUFSIZE;
+	iov[i].iov_len = UXFER_BUFSIZE;
+	rp->freev[i] = UXFER_SLOTS-1-i;
+    }
+    rp->nfree = UXFER_SLOTS;
+
+    /* Both are optimizations only - may fail due to RLIMIT_MEMLOCK etc */
+    rp->fixed_bufs =
+	(uring_register(&rp->ring, IORING_REGISTER_BUFFERS, iov, UXFER_SLOTS) == 0);
+
+    for (i = 0; i < 2*UXFER_SLOTS; i++)
+	fds[i] = -1;
+    rp->fixed_files =
+	(uring_register(&rp->ring, IORING_REGISTER_FILES, fds, 2*UXFER_SLOTS) == 0);
+
+    if (debug)
+	fprintf(stderr, "uxfer_ring_init: fd#%d: fixed buffers=%d, fixed files=%d\n",
+		rp->ring.fd, rp->fixed_bufs, rp->fixed_files);
+
+    pthread_mutex_init(&rp->mtx, NULL);
+    rp->incoming = NULL;
+    rp->incoming_tail = &rp->incoming;
+    rp->waiting = NULL;
+    rp->waiting_tail = &rp->waiting;
+
+    return 0;
+}
+
+
+int
+uxfer_init(void)
+{
+    pthread_attr_t ca_detached;
+    pthread_t tid;
+    int i, code;
+
+
+    if (uxfer_threads <= 0)
+	return 0;
+
+    pthread_mutex_init(&uxfer_mtx, NULL);
+    pthread_mutex_init(&uxfer_finished_mtx, NULL);
+    pthread_cond_init(&uxfer_finished_cv, NULL);
+    pthread_attr_init(&ca_detached);
+    pthread_attr_setdetachstate(&ca_detached, PTHREAD_CREATE_DETACHED);
+
+    code = pthread_create(&tid, &ca_detached, uxfer_finisher, NULL);
+    if (code)
+    {
+	syslog(LOG_ERR, "uxfer_init: pthread_create: %s", strerror(code));
+	pthread_attr_destroy(&ca_detached);
+	errno = code;
+	return -1;
+    }
+
+    uxfer_ringv = a_malloc(uxfer_threads * sizeof(UXFER_RING), "UXFER_RING");
+
+    for (i = 0; i < uxfer_threads; i++)
+    {
+	if (uxfer_ring_init(&uxfer_ringv[i]) < 0)
+	{
+	    syslog(LOG_ERR, "uxfer_init: io_uring_setup: %m");
+	    break;
+	}
+
+	code = pthread_create(&uxfer_ringv[i].tid, &ca_detached,
+			      uxfer_thread, (void *) &uxfer_ringv[i]);
+	if (code)
+	{
+	    syslog(LOG_ERR, "uxfer_init: pthread_create: %s", strerror(code));
+	    break;
+	}
+    }
+
+    pthread_attr_destroy(&ca_detached);
+
+    /* Rings that failed to start are simply not used */
+    uxfer_ringc = i;
+    if (uxfer_ringc == 0)
+    {
+	errno = ENOSYS;
+	return -1;
+    }
+
+    return 0;
+}
+
+
+int
+uxfer_start(int to_fd,
+	    off_t to_off,
+	    int from_fd,
+	    off_t from_off,
+	    volatile off_t *moved,
+	    void (*done)(void *arg, int err, off_t total),
+	    void *arg)
+{
+    UXFER_RING *rp;
+    UXFER_JOB *jp;
+    struct stat sb;
+
+
+    if (uxfer_ringc == 0)
+	return -1;
+
+    pthread_mutex_lock(&uxfer_mtx);
+    rp = &uxfer_ringv[uxfer_next++ % uxfer_ringc];
+    pthread_mutex_unlock(&uxfer_mtx);
+
+    A_NEW(jp);
+    jp->next = NULL;
+    jp->fd[0] = from_fd;
+    jp->fd[1] = to_fd;
+    jp->off[0] = from_off;
+    jp->off[1] = to_off;
+    jp->slot = -1;
+    jp->blen = jp->bpos = 0;
+    jp->total = 0;
+    jp->moved = moved;
+    jp->done = done;
+    jp->arg = arg;
+
+    jp->cached = 0;
+    if (from_off >= 0 && fstat(from_fd, &sb) == 0)
+    {
+	copyfd_cache_start(&jp->cache, from_fd, sb.st_size, from_off);
+	jp->cached = (jp->cache.willneed || jp->cache.dontneed);
+    }
+
+    pthread_mutex_lock(&rp->mtx);
+    *rp->incoming_tail = jp;
+    rp->incoming_tail = &jp->next;
+    pthread_mutex_unlock(&rp->mtx);
+
+    (void) write(rp->wakeup[1], "", 1);
+    return 0;
+}
+
+#else /* No threads or no io_uring */
+
+int
+uxfer_init(void)
+{
+    if (uxfer_threads <= 0)
+	return 0;
+
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+uxfer_start(int to_fd,
+	    off_t to_off,
+	    int from_fd,
+	    off_t from_off,
+	    volatile off_t *moved,
+	    void (*done)(void *arg, int err, off_t total),
+	    void *arg)
+{
+    return -1;
+}
+
+#endif
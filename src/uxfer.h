@@ -0,0 +1,43 @@
+/*
+** uxfer.h - File transfers driven by io_uring
+**
+** Copyright (c) 2015 Peter Eriksson <pen@lysator.liu.se>
+**
+** This program is free software; you can redistribute it and/or
+** modify it as you wish - as long as you don't claim that you wrote
+** it.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+*/
+
+#ifndef PFTPD_UXFER_H
+#define PFTPD_UXFER_H
+
+#include <sys/types.h>
+
+extern int uxfer_threads;	/* Number of rings/threads, 0 = disabled */
+
+
+/* Start the transfer threads. Returns -1 if io_uring is not available */
+extern int
+uxfer_init(void);
+
+/*
+** Copy from 'from_fd' to 'to_fd' until EOF. The offsets are where
+** to start in plain files, or -1 for sockets. 'done' is called from
+** the engine's finisher thread (not a ring thread, so it may block)
+** when finished, with 'err' set to 0 or an errno value. Returns -1
+** (and nothing is started) if the engine isn't running.
+*/
+extern int
+uxfer_start(int to_fd,
+	    off_t to_off,
+	    int from_fd,
+	    off_t from_off,
+	    volatile off_t *moved,
+	    void (*done)(void *arg, int err, off_t total),
+	    void *arg);
+
+#endif
@@ -69,7 +69,7 @@ xferlog_close(void)
 void
 xferlog_append(FTPCLIENT *fp,
 	       int xfertime,		/* unsigned long ? */
-	       int nbytes,		/* size_t ? */
+	       off_t nbytes,
 	       const char *filename,
 	       int direction)
 {
@@ -98,11 +98,11 @@ xferlog_append(FTPCLIENT *fp,
     }
 
     if (s_snprintf(buf, sizeof(buf),
-		   "%.24s %u %s %u %s %c %s %c %c %s ftp %d %s\n",
+		   "%.24s %u %s %lld %s %c %s %c %c %s ftp %d %s\n",
 		   vbuf,
 		   xfertime,
 		   hostname,
-		   nbytes,
+		   (long long) nbytes,
 		   filename,
 		   fp->type == ftp_ascii ? 'a' : 'b',
 		   "_", /* options? */
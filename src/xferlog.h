@@ -26,7 +26,7 @@ xferlog_close(void);
 extern void
 xferlog_append(FTPCLIENT *fp,
 	       int xfertime,
-	       int nbytes,
+	       off_t nbytes,
 	       const char *filename,
 	       int direction);
 